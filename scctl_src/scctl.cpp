@@ -26,7 +26,9 @@
  * 
  * To avoid encurring a discovery timeout for each op, there is a
  * server mode, in which a permanent process executes the above
- * commands, received on Unix socket, and returns the results.
+ * commands, received on Unix socket, and returns the results. Clients
+ * can also keep the connection open to send several commands and
+ * receive change notifications (see the protocol description below).
  *
  * When executing any of the ops from the command line, the program
  * first tries to contact the server, and does things itself if no
@@ -36,6 +38,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/stat.h>
@@ -46,10 +50,21 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 
 #include "libupnpp/upnpplib.hxx"
 #include "libupnpp/log.hxx"
+#include "libupnpp/control/discovery.hxx"
 #include "libupnpp/control/linnsongcast.hxx"
+#include "libupnpp/control/ohproduct.hxx"
+#include "libupnpp/control/ohreceiver.hxx"
 
 #include "../src/netcon.h"
 #include "../src/smallut.h"
@@ -58,6 +73,7 @@
 using namespace UPnPClient;
 using namespace UPnPP;
 using namespace std;
+using namespace std::placeholders;
 using namespace Songcast;
 
 #define OPT_L 0x1
@@ -70,58 +86,567 @@ using namespace Songcast;
 #define OPT_r 0x80
 #define OPT_s 0x100
 #define OPT_x 0x200
+#define OPT_a 0x400
+
+#define OPT_j 0x800
+#define OPT_w 0x1000
 
 static const string sep("||");
 
+// Quote a string value for the JSON output.
+static string jsonString(const string& in)
+{
+    string out("\"");
+    for (unsigned char c : in) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char buf[10];
+                sprintf(buf, "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+static const char *stateName(const ReceiverState& scs)
+{
+    switch (scs.state) {
+    case ReceiverState::SCRS_GENERROR:    return "Error";
+    case ReceiverState::SCRS_NOOH:        return "Nooh";
+    case ReceiverState::SCRS_NOTRECEIVER: return "Off";
+    case ReceiverState::SCRS_STOPPED:     return "Stop";
+    case ReceiverState::SCRS_PLAYING:     return "Play";
+    }
+    return "Error";
+}
+
+// With -j, each output line is a JSON object.
+static void formatReceiver(ostringstream& out, const ReceiverState& scs,
+                           int ops, int age = -1)
+{
+    if (ops & OPT_j) {
+        out << "{\"state\":\"" << stateName(scs) << "\"" <<
+            ",\"name\":" << jsonString(scs.nm) <<
+            ",\"udn\":" << jsonString(scs.UDN) <<
+            ",\"uri\":" << jsonString(scs.uri) <<
+            ",\"reason\":" << jsonString(scs.reason);
+        if (age >= 0) {
+            out << ",\"age\":" << age;
+        }
+        out << "}" << endl;
+        return;
+    }
+    string dsep = (ops & OPT_m) ? sep : " ";
+    switch (scs.state) {
+    case ReceiverState::SCRS_GENERROR:    out << "Error " << dsep;break;
+    case ReceiverState::SCRS_NOOH:        out << "Nooh  " << dsep;break;
+    case ReceiverState::SCRS_NOTRECEIVER: out << "Off   " << dsep;break;
+    case ReceiverState::SCRS_STOPPED:     out << "Stop  " << dsep;break;
+    case ReceiverState::SCRS_PLAYING:     out << "Play  " << dsep;break;
+    }
+    out << scs.nm << dsep;
+    out << scs.UDN << dsep;
+    if (scs.state == ReceiverState::SCRS_PLAYING) {
+        out << scs.uri;
+    } else if (scs.state == ReceiverState::SCRS_GENERROR) {
+        out << scs.reason;
+    }
+    if ((ops & OPT_a) && age >= 0) {
+        out << dsep << age;
+    }
+    out << endl;
+}
+
+static void formatSender(ostringstream& out, const SenderState& scs,
+                         int ops, int age = -1)
+{
+    if (ops & OPT_j) {
+        out << "{\"name\":" << jsonString(scs.nm) <<
+            ",\"udn\":" << jsonString(scs.UDN) <<
+            ",\"reason\":" << jsonString(scs.reason) <<
+            ",\"uri\":" << jsonString(scs.uri);
+        if (age >= 0) {
+            out << ",\"age\":" << age;
+        }
+        out << "}" << endl;
+        return;
+    }
+    string dsep = (ops & OPT_m) ? sep : " ";
+    out << scs.nm << dsep;
+    out << scs.UDN << dsep;
+    out << scs.reason << dsep;
+    out << scs.uri;
+    if ((ops & OPT_a) && age >= 0) {
+        out << dsep << age;
+    }
+    out << endl;
+}
+
+// Error line for a command which could not run at all.
+static string formatError(const string& name, const string& reason, int ops)
+{
+    if (ops & OPT_j) {
+        return string("{\"status\":\"Error\",\"name\":") +
+            jsonString(name) + ",\"reason\":" + jsonString(reason) + "}\n";
+    }
+    return string("Error ") + name + " " + reason + "\n";
+}
+
+/*
+ * Device state cache for the server, so that list requests don't
+ * query all the devices.
+ *
+ * A worker thread does all the network operations:
+ *  - A full scan (listReceivers/listSenders) on startup, then
+ *    periodically, and when discovery reports a device we don't
+ *    know. This finds new devices and forgets the gone ones.
+ *  - For each known receiver, we subscribe to the OHReceiver and
+ *    OHProduct events, and get its state again when they report a
+ *    change (or after we changed it ourselves).
+ * Each entry records when it was last updated. Receiver state changes
+ * are also queued for the server connections which asked to watch
+ * them, and the notifier is called to tell the server.
+ */
+class StateCache {
+public:
+    StateCache() : scanned(false), scanneeded(true), stopping(false) {}
+    void start();
+    string receivers(int ops);
+    string senders(int ops);
+    // Name can be a friendly name or an UDN
+    void setDirty(const string& name);
+    // Set before start(). Called from the worker thread.
+    void setNotifier(std::function<void ()> func) {
+        notifier = func;
+    }
+    vector<ReceiverState> takeChanges();
+
+private:
+    // Event reporter for one receiver: just flag the entry.
+    class Reporter : public VarEventReporter {
+    public:
+        Reporter(StateCache *c, const string& udn) : cache(c), UDN(udn) {}
+        virtual void changed(const char *, int) {
+            cache->setDirty(UDN);
+        }
+        virtual void changed(const char *, const char *) {
+            cache->setDirty(UDN);
+        }
+        StateCache *cache;
+        string UDN;
+    };
+    struct RcvEntry {
+        ReceiverState st;
+        time_t updated;
+        bool dirty;
+        // Keeps the event subscriptions alive
+        OHRCH rcv;
+        OHPRH prod;
+        std::shared_ptr<Reporter> reporter;
+    };
+    void worker();
+    void scan();
+    void update(const string& udn);
+    bool discovered(const UPnPDeviceDesc& dev, const UPnPServiceDesc& srv);
+    // Called with the lock held
+    void changed(const ReceiverState& st);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    // Receivers by UDN
+    map<string, RcvEntry> rcvs;
+    vector<SenderState> snds;
+    time_t sndsupdated;
+    bool scanned;
+    bool scanneeded;
+    bool stopping;
+    vector<ReceiverState> changes;
+    std::function<void ()> notifier;
+};
+
+// Full scan interval. Discovery and events do most of the work.
+static const int cacheScanSecs = 120;
+
+void StateCache::start()
+{
+    UPnPDeviceDirectory::addCallback(
+        std::bind(&StateCache::discovered, this, _1, _2));
+    thread = std::thread(&StateCache::worker, this);
+}
+
+bool StateCache::discovered(const UPnPDeviceDesc& dev,
+                            const UPnPServiceDesc& srv)
+{
+    // Only receivers are in rcvs. New senders are found by the
+    // periodic scan.
+    if (srv.serviceType.find(":service:Receiver:") == string::npos) {
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (rcvs.find(dev.UDN) == rcvs.end()) {
+        LOGDEB("scctl: cache: discovered " << dev.friendlyName << endl);
+        scanneeded = true;
+        cv.notify_all();
+    }
+    return true;
+}
+
+void StateCache::setDirty(const string& name)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto& ent : rcvs) {
+        if (ent.first == name || ent.second.st.nm == name) {
+            ent.second.dirty = true;
+            cv.notify_all();
+        }
+    }
+}
+
+static bool sameState(const ReceiverState& a, const ReceiverState& b)
+{
+    return a.state == b.state && a.nm == b.nm && a.uri == b.uri &&
+        a.reason == b.reason;
+}
+
+void StateCache::changed(const ReceiverState& st)
+{
+    if (!notifier) {
+        return;
+    }
+    changes.push_back(st);
+    notifier();
+}
+
+vector<ReceiverState> StateCache::takeChanges()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    vector<ReceiverState> ret;
+    ret.swap(changes);
+    return ret;
+}
+
+// The network operations are performed without holding the lock,
+// including the event subscriptions (installReporter()): the
+// libupnpp event threads call setDirty() with the libupnpp callback
+// lock held.
+void StateCache::scan()
+{
+    vector<ReceiverState> vrcvs;
+    listReceivers(vrcvs);
+    vector<SenderState> vsnds;
+    listSenders(vsnds);
+    time_t now = time(0);
+
+    // Subscriptions to start or stop once the lock is released
+    vector<RcvEntry> toinstall;
+    vector<RcvEntry> toremove;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    map<string, RcvEntry> nrcvs;
+    for (auto& st : vrcvs) {
+        RcvEntry& ent = nrcvs[st.UDN];
+        auto it = rcvs.find(st.UDN);
+        if (it != rcvs.end() && it->second.reporter) {
+            // Keep the existing subscriptions
+            ent = it->second;
+        } else if (st.rcv && st.prod) {
+            ent.reporter = std::make_shared<Reporter>(this, st.UDN);
+            ent.rcv = st.rcv;
+            ent.prod = st.prod;
+            toinstall.push_back(ent);
+        }
+        if (it == rcvs.end() || !sameState(it->second.st, st)) {
+            changed(st);
+        }
+        ent.st = st;
+        ent.updated = now;
+        ent.dirty = false;
+    }
+    for (auto& ent : rcvs) {
+        if (nrcvs.find(ent.first) == nrcvs.end()) {
+            LOGDEB("scctl: cache: " << ent.second.st.nm << " is gone\n");
+            if (ent.second.rcv) {
+                toremove.push_back(ent.second);
+            }
+            ReceiverState st = ent.second.st;
+            st.state = ReceiverState::SCRS_GENERROR;
+            st.reason = "gone";
+            changed(st);
+        }
+    }
+    rcvs.swap(nrcvs);
+    snds.swap(vsnds);
+    sndsupdated = now;
+    scanned = true;
+    cv.notify_all();
+    lock.unlock();
+
+    // The entries hold references to the reporters, which stay valid
+    // until they are uninstalled.
+    for (auto& ent : toremove) {
+        ent.rcv->installReporter(0);
+        ent.prod->installReporter(0);
+    }
+    for (auto& ent : toinstall) {
+        ent.rcv->installReporter(ent.reporter.get());
+        ent.prod->installReporter(ent.reporter.get());
+    }
+}
+
+void StateCache::update(const string& udn)
+{
+    ReceiverState st;
+    getReceiverState(udn, st);
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = rcvs.find(udn);
+    if (it != rcvs.end()) {
+        if (!sameState(it->second.st, st)) {
+            changed(st);
+        }
+        it->second.st = st;
+        it->second.updated = time(0);
+    }
+}
+
+void StateCache::worker()
+{
+    time_t lastscan = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (scanneeded || time(0) - lastscan >= cacheScanSecs) {
+            scanneeded = false;
+            lock.unlock();
+            scan();
+            lock.lock();
+            lastscan = time(0);
+            continue;
+        }
+        vector<string> dirty;
+        for (auto& ent : rcvs) {
+            if (ent.second.dirty) {
+                ent.second.dirty = false;
+                dirty.push_back(ent.first);
+            }
+        }
+        if (!dirty.empty()) {
+            lock.unlock();
+            for (const auto& udn : dirty) {
+                update(udn);
+            }
+            lock.lock();
+            continue;
+        }
+        cv.wait_for(lock, std::chrono::seconds(cacheScanSecs));
+    }
+}
+
+string StateCache::receivers(int ops)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] {return scanned;});
+    ostringstream out;
+    time_t now = time(0);
+    for (const auto& ent : rcvs) {
+        formatReceiver(out, ent.second.st, ops, int(now - ent.second.updated));
+    }
+    return out.str();
+}
+
+string StateCache::senders(int ops)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] {return scanned;});
+    ostringstream out;
+    time_t now = time(0);
+    for (const auto& snd : snds) {
+        formatSender(out, snd, ops, int(now - sndsupdated));
+    }
+    return out.str();
+}
+
+// Set when running as server
+static StateCache *theCache;
+
 string showReceivers(int ops)
 {
+    if (theCache) {
+        return theCache->receivers(ops);
+    }
     vector<ReceiverState> vscs;
     listReceivers(vscs);
     ostringstream out;
-    string dsep = (ops & OPT_m) ? sep : " ";
-    
     for (auto& scs: vscs) {
-        switch (scs.state) {
-        case ReceiverState::SCRS_GENERROR:    out << "Error " << dsep;break;
-        case ReceiverState::SCRS_NOOH:        out << "Nooh  " << dsep;break;
-        case ReceiverState::SCRS_NOTRECEIVER: out << "Off   " << dsep;break;
-        case ReceiverState::SCRS_STOPPED:     out << "Stop  " << dsep;break;
-        case ReceiverState::SCRS_PLAYING:     out << "Play  " << dsep;break;
-        }
-        out << scs.nm << dsep;
-        out << scs.UDN << dsep;
-        if (scs.state == ReceiverState::SCRS_PLAYING) {
-            out << scs.uri;
-        } else if (scs.state == ReceiverState::SCRS_GENERROR) {
-            out << scs.reason;
-        }
-        out << endl;
+        formatReceiver(out, scs, ops);
     }
     return out.str();
 }
 
 string showSenders(int ops)
 {
+    if (theCache) {
+        return theCache->senders(ops);
+    }
     vector<SenderState> vscs;
     listSenders(vscs);
     ostringstream out;
-    string dsep = (ops & OPT_m) ? sep : " ";
-
     for (auto& scs: vscs) {
-        out << scs.nm << dsep;
-        out << scs.UDN << dsep;
-        out << scs.reason << dsep;
-        out << scs.uri;
+        formatSender(out, scs, ops);
+    }
+    return out.str();
+}
+
+// Tell the cache that we changed the state of these
+static void cacheSetDirty(const vector<string>& names)
+{
+    if (theCache) {
+        for (const auto& name : names) {
+            theCache->setDirty(name);
+        }
+    }
+}
+
+// Max number of receivers we talk to at the same time
+static const unsigned int fanoutMax = 8;
+
+// Call func(i) for i in [0, n[, on at most fanoutMax threads.
+static void fanout(unsigned int n, std::function<void (unsigned int)> func)
+{
+    std::atomic<unsigned int> next(0);
+    auto worker = [&] () {
+        unsigned int i;
+        while ((i = next++) < n) {
+            func(i);
+        }
+    };
+    vector<std::thread> threads;
+    for (unsigned int i = 1; i < std::min(n, fanoutMax); i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+static int msSince(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Make the receivers play uri. This does the same as
+// setReceiverPlaying() for each of them, but concurrently, and in two
+// phases: first get the state, switch to the Receiver source and set
+// the sender for all, then tell them all to play, so that they start
+// as close together as possible. Returns one line per receiver, with
+// the time used by each phase.
+static string playReceivers(const vector<string>& names, const string& uri,
+                            const string& meta, int ops)
+{
+    struct Op {
+        ReceiverState st;
+        string reason;
+        int prepms;
+        int playms;
+    };
+    vector<Op> rops(names.size());
+
+    fanout(names.size(), [&] (unsigned int i) {
+            Op& op = rops[i];
+            auto start = std::chrono::steady_clock::now();
+            op.playms = -1;
+            getReceiverState(names[i], op.st);
+            if (op.st.state == ReceiverState::SCRS_GENERROR ||
+                op.st.state == ReceiverState::SCRS_NOOH ||
+                !op.st.rcv || !op.st.prod) {
+                op.reason = op.st.reason.empty() ? "no receiver" :
+                    op.st.reason;
+            } else if (op.st.state == ReceiverState::SCRS_NOTRECEIVER &&
+                       op.st.prod->setSourceIndex(op.st.receiverSourceIndex)) {
+                op.reason = "can't set source index";
+            } else if (op.st.rcv->setSender(uri, meta)) {
+                op.reason = "can't set sender";
+            }
+            op.prepms = msSince(start);
+        });
+
+    fanout(names.size(), [&] (unsigned int i) {
+            Op& op = rops[i];
+            if (!op.reason.empty()) {
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            if (op.st.rcv->play()) {
+                op.reason = "play failed";
+            }
+            op.playms = msSince(start);
+        });
+
+    ostringstream out;
+    string dsep = (ops & OPT_m) ? sep : " ";
+    for (unsigned int i = 0; i < names.size(); i++) {
+        const Op& op = rops[i];
+        if (ops & OPT_j) {
+            out << "{\"status\":\"" << (op.reason.empty() ? "Ok" : "Error") <<
+                "\",\"name\":" << jsonString(names[i]) <<
+                ",\"preparems\":" << op.prepms <<
+                ",\"playms\":" << op.playms <<
+                ",\"reason\":" << jsonString(op.reason) << "}" << endl;
+            continue;
+        }
+        out << (op.reason.empty() ? "Ok " : "Error ") << dsep << names[i] <<
+            dsep << "prepare " << op.prepms << " mS" << dsep;
+        if (op.playms >= 0) {
+            out << "play " << op.playms << " mS";
+        }
+        if (!op.reason.empty()) {
+            out << dsep << op.reason;
+        }
         out << endl;
     }
     return out.str();
 }
 
+string setFromReceiver(const string& master, const vector<string>& slaves,
+                       int ops)
+{
+    ReceiverState mst;
+    getReceiverState(master, mst);
+    if (mst.uri.empty()) {
+        return formatError(master, "has no sender uri " + mst.reason, ops);
+    }
+    return playReceivers(slaves, mst.uri, mst.meta, ops);
+}
+
+string setFromSender(const string& sender, const vector<string>& receivers,
+                     int ops)
+{
+    SenderState sst;
+    getSenderState(sender, sst);
+    if (!sst.has_sender) {
+        return formatError(sender, sst.reason, ops);
+    }
+    return playReceivers(receivers, sst.uri, sst.meta, ops);
+}
+
 static char *thisprog;
 static char usage [] =
 " -l List renderers with Songcast Receiver capability\n"
 " -L List Songcast Senders\n"
 "   -m : for above modes: use parseable format\n"
+"   -a : for above modes: add the age of the data in seconds (server mode\n"
+"        answers from a cache updated by discovery and events)\n"
 "For the following options the renderers can be designated by their \n"
 "uid (safer) or friendly name\n"
 " -s <master> <slave> [slave ...] : Set up the slaves renderers as Songcast\n"
@@ -130,6 +655,11 @@ static char usage [] =
 " -r <sender> <renderer> <renderer> : set up the renderers in Receiver mode\n"
 "    playing data from the sender. This is like -s but we get the uri from \n"
 "    the sender instead of a sibling receiver\n"
+"   For -s and -r, the receivers are set up in parallel, and one line is\n"
+"   printed for each, with the time used to set it up and start it.\n"
+" -j For all the above: print one JSON object per line.\n"
+" -w List the receivers, then print a line each time the state of one\n"
+"    changes. Needs a running server. -m and -j apply.\n"
 " -S Run as server\n"
 " -f If no server is found, scctl will fork one after performing the\n"
 "    requested command, so that the next execution will not have to wait for\n"
@@ -151,16 +681,19 @@ Usage(FILE *fp = stderr)
 
 int runserver();
 bool tryserver(int flags, int argc, char *argv[]);
+int watchserver(int opflags);
 
 int main(int argc, char *argv[])
 {
     thisprog = argv[0];
 
     int ret;
-    while ((ret = getopt(argc, argv, "fhmLlrsSx")) != -1) {
+    while ((ret = getopt(argc, argv, "afhjmLlrsSwx")) != -1) {
         switch (ret) {
+        case 'a': op_flags |= OPT_a; break;
         case 'f': op_flags |= OPT_f; break;
         case 'h': Usage(stdout); break;
+        case 'j': op_flags |= OPT_j; break;
         case 'l':
             op_flags |= OPT_l;
             break;
@@ -179,6 +712,7 @@ int main(int argc, char *argv[])
         case 'S':
             op_flags |= OPT_S;
             break;
+        case 'w': op_flags |= OPT_w; break;
         case 'x':
             op_flags |= OPT_x;
             break;
@@ -187,6 +721,10 @@ int main(int argc, char *argv[])
     }
     //fprintf(stderr, "argc %d optind %d flgs: 0x%x\n", argc, optind, op_flags);
 
+    if (op_flags & OPT_w) {
+        return watchserver(op_flags);
+    }
+
     // If we're not a server, try to contact one to avoid the
     // discovery timeout
     if (!(op_flags & OPT_S) && tryserver(op_flags, argc -optind, 
@@ -195,7 +733,7 @@ int main(int argc, char *argv[])
     }
 
     // At least one action needed. 
-    if ((op_flags & ~(OPT_f|OPT_m)) == 0)
+    if ((op_flags & ~(OPT_a|OPT_f|OPT_j|OPT_m)) == 0)
         Usage();
 
     LibUPnP *mylib = LibUPnP::getLibUPnP();
@@ -228,13 +766,17 @@ int main(int argc, char *argv[])
     } else if ((op_flags & OPT_r)) {
         if (args.size() < 2)
             Usage();
-        setReceiversFromSender(args[0], vector<string>(args.begin() + 1,
-                                                       args.end()));
+        string out = setFromSender(args[0], vector<string>(args.begin() + 1,
+                                                           args.end()),
+                                   op_flags);
+        cout << out;
     } else if ((op_flags & OPT_s)) {
         if (args.size() < 2)
             Usage();
-        setReceiversFromReceiver(args[0], vector<string>(args.begin()+1,
-                                                         args.end()));
+        string out = setFromReceiver(args[0], vector<string>(args.begin()+1,
+                                                             args.end()),
+                                     op_flags);
+        cout << out;
     } else if ((op_flags & OPT_x)) {
         if (args.size() < 1)
             Usage();
@@ -273,6 +815,42 @@ bool sockname(string& nm)
 }
 
 
+/*
+ * Client/server protocol.
+ *
+ * One-shot mode (the scctl command line): the client sends one line
+ * holding the option flags in hexadecimal and the arguments, separated
+ * by spaces. The server sends the output and closes the connection.
+ *
+ * Persistent mode: the client first sends a "KEEP" line, then any
+ * number of requests, without having to wait for the replies. A
+ * request is the decimal length of the payload on a line, followed by
+ * the payload: the option flags and the arguments, one per line (so
+ * that they can contain spaces). The requests are executed and
+ * answered in order, each reply being a "R <length>" line followed by
+ * the command output. A request with the watch flag (-w) is answered
+ * with the current list of receivers, after which the server sends an
+ * "E <length>" event with one line each time the state of a receiver
+ * changes, formatted according to the flags of the watch request.
+ */
+
+// Max size for a persistent mode request
+static const unsigned long maxRequestSize = 64 * 1024;
+
+static bool connectserver(NetconCli *clicon)
+{
+    string snm;
+    if (!sockname(snm)) {
+        return false;
+    }
+    if (clicon->openconn(snm.c_str(), (unsigned int)0) < 0) {
+        // Server not running case, no big deal
+        LOGDEB("openconn(" << snm << ") failed (ok: server not running)\n");
+        return false;
+    }
+    return true;
+}
+
 // Try to have an op run in server process (to avoid the discovery
 // timeout).
 bool tryserver(const string& cmd)
@@ -285,14 +863,7 @@ bool tryserver(const string& cmd)
         cerr << "tryserver: new NetconCli failed\n";
         return false;
     }
-    
-    string snm;
-    if (!sockname(snm)) {
-        return false;
-    }
-    if (clicon->openconn(snm.c_str(), (unsigned int)0) < 0) {
-        // Server not running case, no big deal
-        LOGDEB("openconn(" << snm << ") failed (ok: server not running)\n");
+    if (!connectserver(clicon)) {
         return false;
     }
 
@@ -333,50 +904,61 @@ bool tryserver(int opflags, int argc, char **argv)
     return tryserver(cmd);
 }
 
+// Read a persistent mode reply or event.
+static bool readFrame(NetconData *con, char& kind, string& payload)
+{
+    char buf[100];
+    if (con->getline(buf, sizeof(buf)) <= 0) {
+        return false;
+    }
+    char *ep;
+    unsigned long len = strtoul(buf + 1, &ep, 10);
+    if ((buf[0] != 'R' && buf[0] != 'E') || *ep != '\n') {
+        LOGERR("scctl: bad reply header from server: " << buf << endl);
+        return false;
+    }
+    kind = buf[0];
+    payload.resize(len);
+    if (len > 0 && con->doreceive(&payload[0], len) != int(len)) {
+        return false;
+    }
+    return true;
+}
 
-// Listening endpoint for the server. For each connection, one request
-// is served immediately and the connection is closed.
-class MyNetconServLis : public NetconServLis {
-public:
-protected:
-    int cando(Netcon::Event reason);
-};
-
-// Server worker method. Called for each connection, does one thing
-// and returns.
-int MyNetconServLis::cando(Netcon::Event reason)
+// Watch mode: print the receivers list, then the state changes as
+// they are reported by the server.
+int watchserver(int opflags)
 {
-    NetconServCon *con = accept();
-    if (con == 0) {
-        LOGERR("scctl server: accept() failed\n");
+    NetconCli *clicon = new NetconCli();
+    NetconP con(clicon);
+    if (!connectserver(clicon)) {
+        cerr << "scctl: -w needs a running server (scctl -S)\n";
         return 1;
     }
-    std::unique_ptr<Netcon> conhold(con);
-
-    // Get command
-    string line;
-    {
-        char buf[2048];
-        if  (con->getline(buf, 2048, 2) <= 0) {
-            LOGERR("scctl: server: getline() failed\n");
-            return 1;
-        }
-        line = buf;
+    char opts[30];
+    sprintf(opts, "0x%x", opflags);
+    string payload(opts);
+    string req = string("KEEP\n") + lltodecstr(payload.size()) + "\n" +
+        payload;
+    if (clicon->send(req.c_str(), req.size()) < 0) {
+        cerr << "Send failed\n";
+        return 1;
     }
+    char kind;
+    while (readFrame(clicon, kind, payload)) {
+        cout << payload << flush;
+    }
+    return 0;
+}
 
-    trimstring(line, " \n");
-
-    LOGDEB1("scctl: server: got cmd: " << line << endl);
-
-    vector<string> toks;
-    stringToTokens(line, toks);
+// Execute a request. toks holds the option flags and the arguments.
+static bool runCommand(const vector<string>& toks, string& out)
+{
     if (toks.empty()) {
-        return 1;
+        return false;
     }
-
     int opflags = strtoul(toks[0].c_str(), 0, 0);
 
-    string out;
     if (opflags & OPT_p) {
         // ping
         out = "Ok\n";
@@ -386,37 +968,242 @@ int MyNetconServLis::cando(Netcon::Event reason)
         out = showSenders(opflags);
     } else if (opflags & OPT_s) {
         if (toks.size() < 3)
-            return 1;
-        vector<string>::iterator beg = toks.begin();
+            return false;
+        vector<string>::const_iterator beg = toks.begin();
         beg++;
         string master = *beg;
         beg++;
         vector<string> slaves(beg, toks.end());
-        ReceiverState mst;
-        getReceiverState(master, mst);
-        for (auto it = slaves.begin(); it != slaves.end(); it++) {
-            ReceiverState st;
-            getReceiverState(*it, st);
-            setReceiverPlaying(st, mst.uri, mst.meta);
-        }
+        out = setFromReceiver(master, slaves, opflags);
+        cacheSetDirty(slaves);
     } else if (opflags & OPT_x) {
         if (toks.size() < 2)
-            return 1;
-        vector<string>::iterator beg = toks.begin();
+            return false;
+        vector<string>::const_iterator beg = toks.begin();
         beg++;
         vector<string> slaves(beg, toks.end());
         stopReceivers(slaves);
+        cacheSetDirty(slaves);
     } else if (opflags & OPT_r) {
         if (toks.size() < 3)
-            return 1;
-        vector<string>::iterator beg = toks.begin();
+            return false;
+        vector<string>::const_iterator beg = toks.begin();
         beg++;
         string sender = *beg;
         beg++;
         vector<string> receivers(beg, toks.end());
-        setReceiversFromSender(sender, receivers);
+        out = setFromSender(sender, receivers, opflags);
+        cacheSetDirty(receivers);
     } else {
         LOGERR("scctl: server: bad cmd:" << toks[0] << endl);
+        return false;
+    }
+    return true;
+}
+
+// Persistent mode connection. Requests are accumulated until complete
+// and executed, and the replies and events are queued and sent when
+// the connection is writable.
+class Session : public NetconWorker {
+public:
+    Session(NetconData *c) : con(c), watchops(-1) {}
+    virtual int data(NetconData *con, Netcon::Event reason);
+    void queue(char kind, const string& payload);
+
+    NetconData *con;
+    string inbuf;
+    string outbuf;
+    // Flags of the watch request, or -1
+    int watchops;
+
+private:
+    bool request(const string& payload);
+    bool requests();
+    int close();
+};
+
+// The sessions which want the receiver state changes
+static std::set<Session*> watchers;
+
+void Session::queue(char kind, const string& payload)
+{
+    outbuf += kind;
+    outbuf += " " + lltodecstr(payload.size()) + "\n";
+    outbuf += payload;
+    con->addselevents(Netcon::NETCONPOLL_WRITE);
+}
+
+int Session::close()
+{
+    watchers.erase(this);
+    // Returning 0 will clear the current event.
+    con->clearselevents(Netcon::NETCONPOLL_READ | Netcon::NETCONPOLL_WRITE);
+    return 0;
+}
+
+bool Session::request(const string& payload)
+{
+    vector<string> toks;
+    stringToTokens(payload, toks, "\n");
+    if (toks.empty()) {
+        return false;
+    }
+    int opflags = strtoul(toks[0].c_str(), 0, 0);
+    string out;
+    if (opflags & OPT_w) {
+        watchops = opflags;
+        watchers.insert(this);
+        out = showReceivers(opflags);
+    } else if (!runCommand(toks, out)) {
+        out = "Error bad command\n";
+    }
+    queue('R', out);
+    return true;
+}
+
+int Session::data(NetconData *, Netcon::Event reason)
+{
+    // The connection is edge-triggered: we must read or write until
+    // we would block.
+    if (reason & Netcon::NETCONPOLL_WRITE) {
+        while (!outbuf.empty()) {
+            int cnt = con->send(outbuf.c_str(), outbuf.size());
+            if (cnt < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return close();
+                }
+                return 1;
+            }
+            outbuf.erase(0, cnt);
+        }
+        con->clearselevents(Netcon::NETCONPOLL_WRITE);
+        return 1;
+    }
+
+    char buf[4096];
+    for (;;) {
+        int cnt = con->receive(buf, sizeof(buf));
+        if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (cnt <= 0) {
+            // EOF or error
+            return close();
+        }
+        inbuf.append(buf, cnt);
+        if (!requests()) {
+            return close();
+        }
+    }
+}
+
+// Execute the complete requests in the input buffer.
+bool Session::requests()
+{
+    for (;;) {
+        string::size_type nl = inbuf.find('\n');
+        if (nl == string::npos) {
+            if (inbuf.size() > 20) {
+                LOGERR("scctl: server: bad request header\n");
+                return false;
+            }
+            break;
+        }
+        char *ep;
+        unsigned long len = strtoul(inbuf.c_str(), &ep, 10);
+        if (ep != inbuf.c_str() + nl || len > maxRequestSize) {
+            LOGERR("scctl: server: bad request header\n");
+            return false;
+        }
+        if (inbuf.size() < nl + 1 + len) {
+            break;
+        }
+        if (!request(inbuf.substr(nl + 1, len))) {
+            LOGERR("scctl: server: empty request\n");
+            return false;
+        }
+        inbuf.erase(0, nl + 1 + len);
+    }
+    return true;
+}
+
+// Reads the cache wakeup pipe and sends the receiver state changes
+// to the watching sessions.
+class ChangeReader : public NetconWorker {
+public:
+    virtual int data(NetconData *con, Netcon::Event) {
+        char buf[100];
+        if (con->receive(buf, sizeof(buf)) < 0 &&
+            errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOGERR("scctl: server: can't read the notify pipe\n");
+            return 0;
+        }
+        vector<ReceiverState> changes = theCache->takeChanges();
+        for (auto session : watchers) {
+            for (const auto& st : changes) {
+                ostringstream out;
+                formatReceiver(out, st, session->watchops, 0);
+                session->queue('E', out.str());
+            }
+        }
+        return 1;
+    }
+};
+
+// Listening endpoint for the server. For each connection, the first
+// line is read at once. In one-shot mode, the request is served
+// immediately and the connection is closed. Else the connection is
+// added to the selectloop.
+class MyNetconServLis : public NetconServLis {
+public:
+protected:
+    int cando(Netcon::Event reason);
+};
+
+// Server worker method. Called for each connection.
+int MyNetconServLis::cando(Netcon::Event reason)
+{
+    NetconServCon *con = accept();
+    if (con == 0) {
+        LOGERR("scctl server: accept() failed\n");
+        return 1;
+    }
+    std::unique_ptr<Netcon> conhold(con);
+
+    // Get command
+    string line;
+    {
+        char buf[2048];
+        if  (con->getline(buf, 2048, 2) <= 0) {
+            LOGERR("scctl: server: getline() failed\n");
+            return 1;
+        }
+        line = buf;
+    }
+
+    trimstring(line, " \n");
+
+    LOGDEB1("scctl: server: got cmd: " << line << endl);
+
+    if (line == "KEEP") {
+        std::shared_ptr<NetconData> dcon(con);
+        conhold.release();
+        auto session = std::make_shared<Session>(con);
+        dcon->setcallback(session);
+        dcon->setedgetrigger(true);
+        getloop()->addselcon(dcon, Netcon::NETCONPOLL_READ);
+        // The client may have sent requests along with the first
+        // line, and they may be sitting in the getline buffer.
+        if (session->data(con, Netcon::NETCONPOLL_READ) <= 0) {
+            getloop()->remselcon(dcon);
+        }
+        return 1;
+    }
+
+    vector<string> toks;
+    stringToTokens(line, toks);
+    string out;
+    if (!runCommand(toks, out)) {
         return 1;
     }
 
@@ -454,8 +1241,26 @@ int runserver()
     signal(SIGCHLD, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
 
-    // Initialize lib at once, will be ready when we need it
-    showReceivers(0);
+    // Initialize lib at once, and start filling the cache
+    LibUPnP *mylib = LibUPnP::getLibUPnP();
+    if (!mylib || !mylib->ok()) {
+        LOGERR("scctl: server: can't initialize libupnpp\n");
+        return 1;
+    }
+    theCache = new StateCache();
+    // The cache worker tells the selectloop about receiver state
+    // changes through a pipe.
+    int notifypipe[2];
+    if (pipe(notifypipe) < 0) {
+        LOGERR("scctl: server: pipe() failed\n");
+        return 1;
+    }
+    fcntl(notifypipe[1], F_SETFL, O_NONBLOCK);
+    theCache->setNotifier([notifypipe] () {
+            // If the pipe is full, a wakeup is pending anyway
+            if (write(notifypipe[1], "x", 1) < 0) {}
+        });
+    theCache->start();
 
     MyNetconServLis *servlis = new MyNetconServLis();
     if (servlis == 0) {
@@ -469,6 +1274,10 @@ int runserver()
 
     SelectLoop myloop;
     myloop.addselcon(NetconP(servlis), Netcon::NETCONPOLL_READ);
+    NetconCli *notifycon = new NetconCli();
+    notifycon->setconn(notifypipe[0]);
+    notifycon->setcallback(std::make_shared<ChangeReader>());
+    myloop.addselcon(NetconP(notifycon), Netcon::NETCONPOLL_READ);
 
     LOGDEB("scctl: server: openservice(" << snm << ") Ok\n");
 
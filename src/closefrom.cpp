@@ -143,6 +143,27 @@ int libclf_closefrom(int fd0)
     return 0;
 }
 
+int libclf_maxfd()
+{
+    DIR *dirp;
+    struct dirent *ent;
+    int maxfd = -1;
+
+    dirp = opendir("/proc/self/fd");
+    if (dirp == 0) {
+        return sysconf(_SC_OPEN_MAX);
+    }
+    while ((ent = readdir(dirp)) != 0) {
+        int fd;
+        if (sscanf(ent->d_name, "%d", &fd) == 1 && fd > maxfd &&
+                fd != dirfd(dirp)) {
+            maxfd = fd;
+        }
+    }
+    closedir(dirp);
+    return maxfd + 1;
+}
+
 /*************************************************************************/
 #else
 /* System has no native support for this functionality whatsoever.
@@ -192,6 +213,16 @@ int libclf_closefrom(int fd0)
 }
 #endif
 
+#if !(defined(linux) || defined(__linux) || defined(__linux__))
+int libclf_maxfd()
+{
+#ifdef _SC_OPEN_MAX
+    return sysconf(_SC_OPEN_MAX);
+#else
+    return getdtablesize();
+#endif
+}
+#endif
 
 #else /* TEST_CLOSEFROM */
 
@@ -20,4 +20,8 @@
 /* Close all descriptors >=  fd */
 extern int libclf_closefrom(int fd);
 
+/* Return a value above all the open descriptors: the highest open one
+   + 1 if we can find it, else the descriptor table size */
+extern int libclf_maxfd();
+
 #endif /* _closefrom_h_included_ */
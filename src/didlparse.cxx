@@ -0,0 +1,569 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "didlparse.hxx"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "libupnpp/upnpavutils.hxx"
+
+#include "smallut.h"
+#include "upmpdutils.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+// Append the UTF-8 encoding of a character reference value.
+static void appendutf8(string& out, unsigned long c)
+{
+    if (c < 0x80) {
+        out += char(c);
+    } else if (c < 0x800) {
+        out += char(0xc0 | (c >> 6));
+        out += char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += char(0xe0 | (c >> 12));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    } else if (c < 0x110000) {
+        out += char(0xf0 | (c >> 18));
+        out += char(0x80 | ((c >> 12) & 0x3f));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    }
+}
+
+// Append text, translating the entity and character references.
+static void appenddecoded(string& out, const char *cp, const char *end)
+{
+    while (cp < end) {
+        const char *amp = (const char *)memchr(cp, '&', end - cp);
+        if (amp == nullptr) {
+            out.append(cp, end - cp);
+            return;
+        }
+        out.append(cp, amp - cp);
+        const char *semi = (const char *)memchr(amp, ';', end - amp);
+        if (semi == nullptr) {
+            out.append(amp, end - amp);
+            return;
+        }
+        string ent(amp + 1, semi - amp - 1);
+        if (ent == "amp") {
+            out += '&';
+        } else if (ent == "lt") {
+            out += '<';
+        } else if (ent == "gt") {
+            out += '>';
+        } else if (ent == "quot") {
+            out += '"';
+        } else if (ent == "apos") {
+            out += '\'';
+        } else if (ent.size() > 1 && ent[0] == '#') {
+            if (ent[1] == 'x' || ent[1] == 'X') {
+                appendutf8(out, strtoul(ent.c_str() + 2, 0, 16));
+            } else {
+                appendutf8(out, strtoul(ent.c_str() + 1, 0, 10));
+            }
+        } else {
+            // Unknown: keep as is
+            out.append(amp, semi - amp + 1);
+        }
+        cp = semi + 1;
+    }
+}
+
+// Local part of a qualified element or attribute name ("upnp:artist"
+// -> "artist"). We do not check the namespaces: the DIDL we receive
+// always uses the standard prefixes, and the local names we look at
+// are not ambiguous.
+static inline const char *localname(const char *nm, const char *end)
+{
+    const char *colon = (const char *)memchr(nm, ':', end - nm);
+    return colon ? colon + 1 : nm;
+}
+
+static inline bool nameis(const char *nm, const char *end, const char *what)
+{
+    size_t len = strlen(what);
+    return size_t(end - nm) == len && !memcmp(nm, what, len);
+}
+
+static inline bool isspacechar(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+namespace {
+// An element tag, as found by the scanner
+struct Tag {
+    const char *name;
+    const char *nameend;
+    // Attributes text (between the name and the end of the tag)
+    const char *attrs;
+    const char *attrsend;
+    bool closing;
+    bool empty;
+
+    // Look for an attribute by local name and return its decoded value.
+    bool attr(const char *what, string& value) const {
+        const char *cp = attrs;
+        while (cp < attrsend) {
+            while (cp < attrsend && isspacechar(*cp)) {
+                cp++;
+            }
+            const char *nm = cp;
+            while (cp < attrsend && *cp != '=' && !isspacechar(*cp)) {
+                cp++;
+            }
+            const char *nmend = cp;
+            while (cp < attrsend && *cp != '\'' && *cp != '"') {
+                cp++;
+            }
+            if (cp >= attrsend) {
+                return false;
+            }
+            char quote = *cp++;
+            const char *val = cp;
+            cp = (const char *)memchr(cp, quote, attrsend - cp);
+            if (cp == nullptr) {
+                return false;
+            }
+            if (nmend > nm && nameis(localname(nm, nmend), nmend, what)) {
+                value.clear();
+                appenddecoded(value, val, cp);
+                return true;
+            }
+            cp++;
+        }
+        return false;
+    }
+};
+}
+
+// Scan the tag beginning at cp ('<'). Returns a pointer after it, or
+// null if it is not terminated.
+static const char *scantag(const char *cp, const char *end, Tag& tag)
+{
+    cp++;
+    tag.closing = cp < end && *cp == '/';
+    if (tag.closing) {
+        cp++;
+    }
+    tag.name = cp;
+    while (cp < end && *cp != '>' && *cp != '/' && !isspacechar(*cp)) {
+        cp++;
+    }
+    tag.nameend = cp;
+    tag.attrs = cp;
+    // Look for the closing '>', skipping quoted values
+    char quote = 0;
+    while (cp < end) {
+        if (quote) {
+            if (*cp == quote) {
+                quote = 0;
+            }
+        } else if (*cp == '"' || *cp == '\'') {
+            quote = *cp;
+        } else if (*cp == '>') {
+            break;
+        }
+        cp++;
+    }
+    if (cp >= end) {
+        return nullptr;
+    }
+    tag.empty = cp > tag.attrs && cp[-1] == '/';
+    tag.attrsend = tag.empty ? cp - 1 : cp;
+    return cp + 1;
+}
+
+void DidlItem::clear()
+{
+    id.clear();
+    title.clear();
+    artist.clear();
+    album.clear();
+    tracknum.clear();
+    upnpclass.clear();
+    resources.clear();
+}
+
+bool DidlItem::parse(const string& didl)
+{
+    clear();
+    const char *cp = didl.c_str();
+    const char *end = cp + didl.size();
+
+    // Element nesting depth inside the item (1: direct child)
+    int depth = 0;
+    bool initem = false;
+    // Target for the text of the current property element, if we want it
+    string *target = nullptr;
+    // Set if the target is the uri of the last resource
+    bool inres = false;
+    string text;
+
+    while (cp < end) {
+        if (*cp != '<') {
+            const char *lt = (const char *)memchr(cp, '<', end - cp);
+            if (lt == nullptr) {
+                lt = end;
+            }
+            if (target) {
+                appenddecoded(text, cp, lt);
+            }
+            cp = lt;
+            continue;
+        }
+        if (end - cp >= 4 && !memcmp(cp, "<!--", 4)) {
+            const char *ce = strstr(cp + 4, "-->");
+            if (ce == nullptr) {
+                return false;
+            }
+            cp = ce + 3;
+            continue;
+        }
+        if (end - cp >= 9 && !memcmp(cp, "<![CDATA[", 9)) {
+            const char *ce = strstr(cp + 9, "]]>");
+            if (ce == nullptr) {
+                return false;
+            }
+            if (target) {
+                text.append(cp + 9, ce - cp - 9);
+            }
+            cp = ce + 3;
+            continue;
+        }
+        if (end - cp >= 2 && (cp[1] == '?' || cp[1] == '!')) {
+            const char *gt = (const char *)memchr(cp, '>', end - cp);
+            if (gt == nullptr) {
+                return false;
+            }
+            cp = gt + 1;
+            continue;
+        }
+
+        Tag tag;
+        cp = scantag(cp, end, tag);
+        if (cp == nullptr) {
+            return false;
+        }
+        const char *nm = localname(tag.name, tag.nameend);
+
+        if (!initem) {
+            if (!tag.closing && nameis(nm, tag.nameend, "item")) {
+                tag.attr("id", id);
+                if (tag.empty) {
+                    return true;
+                }
+                initem = true;
+                depth = 0;
+            }
+            continue;
+        }
+
+        if (tag.closing) {
+            if (depth == 0) {
+                // End of the item: we are done.
+                return true;
+            }
+            if (depth == 1 && target) {
+                if (target == &artist && !artist.empty()) {
+                    artist += ", ";
+                }
+                if (inres) {
+                    trimstring(text, " \t\r\n");
+                }
+                *target += text;
+                target = nullptr;
+                inres = false;
+            }
+            depth--;
+            continue;
+        }
+
+        if (tag.empty) {
+            if (depth == 0 && nameis(nm, tag.nameend, "res")) {
+                Res res;
+                tag.attr("protocolInfo", res.protocolinfo);
+                tag.attr("duration", res.duration);
+                resources.push_back(res);
+            }
+            continue;
+        }
+
+        depth++;
+        if (depth != 1) {
+            continue;
+        }
+        // Only the first value is kept, except for the artist.
+        text.clear();
+        target = nullptr;
+        inres = false;
+        if (nameis(nm, tag.nameend, "title")) {
+            target = &title;
+        } else if (nameis(nm, tag.nameend, "artist")) {
+            target = &artist;
+        } else if (nameis(nm, tag.nameend, "album")) {
+            target = &album;
+        } else if (nameis(nm, tag.nameend, "originalTrackNumber")) {
+            target = &tracknum;
+        } else if (nameis(nm, tag.nameend, "class")) {
+            target = &upnpclass;
+        } else if (nameis(nm, tag.nameend, "res")) {
+            Res res;
+            tag.attr("protocolInfo", res.protocolinfo);
+            tag.attr("duration", res.duration);
+            resources.push_back(res);
+            target = &resources[resources.size() - 1].uri;
+            inres = true;
+        }
+        if (target && target != &artist && !target->empty()) {
+            target = nullptr;
+        }
+    }
+    // No item, or not terminated.
+    return false;
+}
+
+bool DidlItem::toUpSong(UpSong *ups) const
+{
+    ups->artist = artist;
+    ups->album = album;
+    ups->title = title;
+    if (!resources.empty() && !resources[0].duration.empty()) {
+        ups->duration_secs = upnpdurationtos(resources[0].duration);
+    } else {
+        ups->duration_secs = 0;
+    }
+    ups->tracknum = tracknum;
+    return true;
+}
+
+#ifdef DIDLPARSE_TEST
+// Compare DidlItem with the libupnpp UPnPDirContent::parse() which it
+// replaces: extracted values and time per parse. The samples are
+// track metadata as sent by control points for the upmpdcli Qobuz
+// plugin, for Tidal, and for minidlna. Files given as arguments are
+// used instead.
+
+#include <stdio.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "libupnpp/control/cdircontent.hxx"
+
+#include "readfile.h"
+
+using namespace UPnPClient;
+
+static const char *samples[][2] = {
+    {"qobuz",
+     "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+     "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+     "xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+     "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+     "xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">\n"
+     "<item restricted=\"1\" "
+     "id=\"0$qobuz$albums$0060254735375$tracks$12345\" "
+     "parentID=\"0$qobuz$albums$0060254735375\">"
+     "<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+     "<dc:title>Kind of Blue (Take 2) &amp; Other</dc:title>"
+     "<upnp:genre>Jazz</upnp:genre><dc:creator>Miles Davis</dc:creator>"
+     "<upnp:artist>Miles Davis</upnp:artist>"
+     "<upnp:album>Kind Of Blue (Legacy Edition)</upnp:album>"
+     "<upnp:originalTrackNumber>3</upnp:originalTrackNumber>"
+     "<upnp:albumArtURI>https://static.qobuz.com/images/covers/75/53/"
+     "0060254735375_600.jpg</upnp:albumArtURI>"
+     "<res duration=\"0:09:25\" sampleFrequency=\"44100\" "
+     "audioChannels=\"2\" protocolInfo=\"http-get:*:audio/flac:*\">"
+     "http://192.168.1.10:49149/qobuzprefix/track?version=1&amp;"
+     "trackId=12345</res></item></DIDL-Lite>"},
+    {"tidal",
+     "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+     "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+     "xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+     "xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">"
+     "<item id=\"0$tidal$album$55391449$65093041\" "
+     "parentID=\"0$tidal$album$55391449\" restricted=\"1\">"
+     "<dc:title>Bohemian Rhapsody - Remastered 2011</dc:title>"
+     "<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+     "<upnp:artist role=\"AlbumArtist\">Queen</upnp:artist>"
+     "<upnp:artist>Queen</upnp:artist>"
+     "<upnp:album>A Night At The Opera (2011 Remaster)</upnp:album>"
+     "<upnp:originalTrackNumber>11</upnp:originalTrackNumber>"
+     "<upnp:albumArtURI dlna:profileID=\"JPEG_TN\">"
+     "https://resources.tidal.com/images/6d4a4fdc/2d8a/4f0e/a3e1/"
+     "3b3e8f4c3f6f/1280x1280.jpg</upnp:albumArtURI>"
+     "<res protocolInfo=\"http-get:*:audio/flac:DLNA.ORG_PN=FLAC;"
+     "DLNA.ORG_OP=01;DLNA.ORG_FLAGS=01700000000000000000000000000000\" "
+     "duration=\"0:05:54.000\" bitrate=\"176400\" sampleFrequency=\"44100\" "
+     "nrAudioChannels=\"2\">http://192.168.1.10:49149/tidal/track?"
+     "version=1&amp;trackId=65093041</res></item></DIDL-Lite>"},
+    {"minidlna",
+     "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+     "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+     "xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+     "xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">\n"
+     "<item id=\"64$0$1$3\" parentID=\"64$0$1\" restricted=\"1\">"
+     "<dc:title>So What</dc:title>"
+     "<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+     "<dc:creator>Miles Davis</dc:creator><dc:date>1959-01-01</dc:date>"
+     "<upnp:artist>Miles Davis</upnp:artist>"
+     "<upnp:album>Kind of Blue</upnp:album><upnp:genre>Jazz</upnp:genre>"
+     "<upnp:originalTrackNumber>1</upnp:originalTrackNumber>"
+     "<upnp:albumArtURI dlna:profileID=\"JPEG_TN\">"
+     "http://192.168.1.5:8200/AlbumArt/123-4567.jpg</upnp:albumArtURI>"
+     "<res size=\"61234567\" duration=\"0:09:22.000\" bitrate=\"176400\" "
+     "sampleFrequency=\"44100\" nrAudioChannels=\"2\" "
+     "protocolInfo=\"http-get:*:audio/x-flac:*\">"
+     "http://192.168.1.5:8200/MediaItems/4567.flac</res>"
+     "<res size=\"8912345\" duration=\"0:09:22.000\" bitrate=\"40000\" "
+     "sampleFrequency=\"44100\" nrAudioChannels=\"2\" "
+     "protocolInfo=\"http-get:*:audio/mpeg:DLNA.ORG_PN=MP3;DLNA.ORG_OP=01;"
+     "DLNA.ORG_CI=1\">http://192.168.1.5:8200/MediaItems/4567.mp3?"
+     "transcode=1</res></item></DIDL-Lite>"},
+};
+
+static void compare(const char *what, const string& ours, const string& ref,
+                    bool& same)
+{
+    if (ours != ref) {
+        cout << "  " << what << " differs: [" << ours << "] [" << ref <<
+            "]" << endl;
+        same = false;
+    }
+}
+
+// Returns false if DidlItem fails where UPnPDirContent succeeds.
+static bool runsample(const string& name, const string& didl, int count)
+{
+    DidlItem item;
+    bool ok = item.parse(didl);
+    UPnPDirContent dirc;
+    bool refok = dirc.parse(didl) && !dirc.m_items.empty();
+    cout << name << ": DidlItem " << (ok ? "ok" : "failed") <<
+        ", UPnPDirContent " << (refok ? "ok" : "failed") << endl;
+    if (!ok || !refok) {
+        return ok || !refok;
+    }
+
+    const UPnPDirObject& dobj = dirc.m_items[0];
+    bool same = true;
+    compare("id", item.id, dobj.m_id, same);
+    compare("title", item.title, dobj.m_title, same);
+    compare("artist", item.artist, dobj.getprop("upnp:artist"), same);
+    compare("album", item.album, dobj.getprop("upnp:album"), same);
+    compare("tracknum", item.tracknum,
+            dobj.getprop("upnp:originalTrackNumber"), same);
+    if (item.resources.size() != dobj.m_resources.size()) {
+        cout << "  resource counts differ: " << item.resources.size() <<
+            " " << dobj.m_resources.size() << endl;
+        same = false;
+    } else {
+        for (unsigned int i = 0; i < item.resources.size(); i++) {
+            string pi, dur;
+            dobj.getrprop(i, "protocolInfo", pi);
+            dobj.getrprop(i, "duration", dur);
+            compare("res uri", item.resources[i].uri,
+                    dobj.m_resources[i].m_uri, same);
+            compare("res protocolInfo", item.resources[i].protocolinfo, pi,
+                    same);
+            compare("res duration", item.resources[i].duration, dur, same);
+        }
+    }
+    cout << "  title [" << item.title << "] artist [" << item.artist <<
+        "] " << item.resources.size() << " res, values " <<
+        (same ? "identical" : "differ") << endl;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        DidlItem it;
+        it.parse(didl);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        UPnPDirContent dc;
+        dc.parse(didl);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::micro> ours = t1 - t0, ref = t2 - t1;
+    printf("  DidlItem %.2f us, UPnPDirContent %.2f us per parse\n",
+           ours.count() / count, ref.count() / count);
+    return true;
+}
+
+static char *thisprog;
+
+static char usage [] =
+"didlparse [-c count] [file ...]\n"
+"  Parse the built-in samples, or the DIDL-Lite files, with DidlItem and\n"
+"  UPnPDirContent, compare the values and time count parses (default\n"
+"  100000).\n"
+;
+static void
+Usage(void)
+{
+    fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int count = 100000;
+
+    thisprog = argv[0];
+    argc--; argv++;
+
+    while (argc > 0 && **argv == '-') {
+        (*argv)++;
+        if (!(**argv))
+            Usage();
+        while (**argv)
+            switch (*(*argv)++) {
+            case 'c': if (argc < 2)  Usage();
+                if ((sscanf(*(++argv), "%d", &count)) != 1 || count < 1)
+                    Usage();
+                argc--;
+                goto b1;
+            default: Usage(); break;
+            }
+    b1: argc--; argv++;
+    }
+
+    bool ok = true;
+    if (argc == 0) {
+        for (const auto& sample : samples) {
+            ok = runsample(sample[0], sample[1], count) && ok;
+        }
+    }
+    for (; argc > 0; argc--, argv++) {
+        string didl, reason;
+        if (!file_to_string(*argv, didl, &reason)) {
+            cerr << *argv << ": " << reason << endl;
+            return 1;
+        }
+        ok = runsample(*argv, didl, count) && ok;
+    }
+    return ok ? 0 : 1;
+}
+#endif // DIDLPARSE_TEST
@@ -0,0 +1,58 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _DIDLPARSE_H_INCLUDED_
+#define _DIDLPARSE_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+class UpSong;
+
+/// Values extracted from the DIDL-Lite metadata which control points
+/// send with a track (SetAVTransportURI, OHPlaylist Insert...).
+///
+/// This is a single pass over the text, which only looks at the first
+/// item element and at the few properties that we use, without
+/// building a tree. It is much cheaper than UPnPDirContent::parse()
+/// for this purpose. It is not a validating parser: it only fails if
+/// no item is found or the item is not terminated.
+class DidlItem {
+public:
+    struct Res {
+        std::string uri;
+        std::string protocolinfo;
+        std::string duration;
+    };
+
+    bool parse(const std::string& didl);
+    void clear();
+
+    /// Set the UpSong fields used by the renderer (title, artist,
+    /// album, tracknum, duration).
+    bool toUpSong(UpSong *ups) const;
+
+    std::string id;
+    std::string title;
+    // Multiple values are joined with ", "
+    std::string artist;
+    std::string album;
+    std::string tracknum;
+    std::string upnpclass;
+    std::vector<Res> resources;
+};
+
+#endif /* _DIDLPARSE_H_INCLUDED_ */
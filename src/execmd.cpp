@@ -38,7 +38,7 @@
 #include <vector>
 #include <string>
 #include <stdexcept>
-#ifdef HAVE_SPAWN_H
+#ifdef HAVE_POSIX_SPAWN
 #ifndef __USE_GNU
 #define __USE_GNU
 #define undef__USE_GNU
@@ -67,6 +67,7 @@ public:
     }
 
     static bool      o_useVfork;
+    static bool      o_usePosixSpawn;
 
     std::vector<std::string>   m_env;
     ExecCmdAdvise   *m_advise;
@@ -97,8 +98,13 @@ public:
     // Child process code
     inline void dochild(const std::string& cmd, const char **argv,
                         const char **envv, bool has_input, bool has_output);
+#ifdef HAVE_POSIX_SPAWN
+    int spawn(const std::string& exe, const char **argv,
+              const char **envv, bool has_input, bool has_output);
+#endif
 };
 bool ExecCmd::Internal::o_useVfork = false;
+bool ExecCmd::Internal::o_usePosixSpawn = true;
 
 ExecCmd::ExecCmd(int)
 {
@@ -215,6 +221,11 @@ void ExecCmd::useVfork(bool on)
     Internal::o_useVfork  = on;
 }
 
+void ExecCmd::usePosixSpawn(bool on)
+{
+    Internal::o_usePosixSpawn = on;
+}
+
 void ExecCmd::putenv(const string& ea)
 {
     m->m_env.push_back(ea);
@@ -348,6 +359,10 @@ inline void ExecCmd::Internal::dochild(const string& cmd, const char **argv,
     if (signal(SIGTERM, SIG_DFL) == SIG_ERR) {
         //LOGERR("ExecCmd::DOCHILD: signal() failed, errno " << errno << "\n");
     }
+    // An ignored disposition survives exec, and upmpdcli ignores
+    // SIGPIPE. The commands (e.g. shell pipelines in user scripts)
+    // expect the default.
+    signal(SIGPIPE, SIG_DFL);
     sigset_t sset;
     sigfillset(&sset);
     pthread_sigmask(SIG_UNBLOCK, &sset, 0);
@@ -435,6 +450,113 @@ inline void ExecCmd::Internal::dochild(const string& cmd, const char **argv,
     _exit(127);
 }
 
+#ifdef HAVE_POSIX_SPAWN
+// Start the command with posix_spawn(). This does the same as fork()
+// and dochild(), except for the resource limit. With glibc and musl,
+// the child shares our memory until the exec, like with vfork, so
+// that the cost does not depend on the size of our process.
+int ExecCmd::Internal::spawn(const string& exe, const char **argv,
+                             const char **envv,
+                             bool has_input, bool has_output)
+{
+    posix_spawnattr_t attrs;
+    posix_spawnattr_init(&attrs);
+    short flags;
+    posix_spawnattr_getflags(&attrs, &flags);
+
+#ifdef POSIX_SPAWN_USEVFORK
+    // glibc extension. Recent versions always behave like this.
+    flags |=  POSIX_SPAWN_USEVFORK;
+#endif
+
+    posix_spawnattr_setpgroup(&attrs, 0);
+    flags |= POSIX_SPAWN_SETPGROUP;
+
+    sigset_t sset;
+    sigemptyset(&sset);
+    posix_spawnattr_setsigmask(&attrs, &sset);
+    flags |= POSIX_SPAWN_SETSIGMASK;
+
+    // Same as dochild(): SIGPIPE may be ignored by the parent.
+    sigemptyset(&sset);
+    sigaddset(&sset, SIGTERM);
+    sigaddset(&sset, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attrs, &sset);
+    flags |= POSIX_SPAWN_SETSIGDEF;
+
+    posix_spawnattr_setflags(&attrs, flags);
+
+    posix_spawn_file_actions_t facts;
+    posix_spawn_file_actions_init(&facts);
+
+    if (has_input) {
+        posix_spawn_file_actions_addclose(&facts, m_pipein[1]);
+        if (m_pipein[0] != 0) {
+            posix_spawn_file_actions_adddup2(&facts, m_pipein[0], 0);
+            posix_spawn_file_actions_addclose(&facts, m_pipein[0]);
+        }
+    }
+    if (has_output) {
+        posix_spawn_file_actions_addclose(&facts, m_pipeout[0]);
+        if (m_pipeout[1] != 1) {
+            posix_spawn_file_actions_adddup2(&facts, m_pipeout[1], 1);
+            posix_spawn_file_actions_addclose(&facts, m_pipeout[1]);
+        }
+    }
+
+    // Do we need to redirect stderr ? As in dochild(), the command
+    // is started with stderr closed if the file can't be opened. We
+    // open it here because a failed addopen would fail the spawn.
+    int errfd = -1;
+    if (!m_stderrFile.empty()) {
+        int oflags = O_WRONLY | O_CREAT;
+#ifdef O_APPEND
+        oflags |= O_APPEND;
+#endif
+#ifdef O_CLOEXEC
+        // Don't leak it to commands started by other threads
+        oflags |= O_CLOEXEC;
+#endif
+        errfd = open(m_stderrFile.c_str(), oflags, 0600);
+        if (errfd < 0) {
+            posix_spawn_file_actions_addclose(&facts, 2);
+        } else {
+            // errfd is closed in the child by the loop below
+            posix_spawn_file_actions_adddup2(&facts, errfd, 2);
+        }
+    }
+    LOGDEB1("using SPAWN\n");
+
+    // Close all descriptors except 0,1,2
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+    posix_spawn_file_actions_addclosefrom_np(&facts, 3);
+#else
+    // Closing a descriptor which is not open is not an error for
+    // posix_spawn. There is a window where another thread could open
+    // a descriptor which would not be closed, as with fork.
+    int maxfd = libclf_maxfd();
+    for (int i = 3; i < maxfd; i++) {
+        posix_spawn_file_actions_addclose(&facts, i);
+    }
+#endif
+
+    int ret = posix_spawn(&m_pid, exe.c_str(), &facts, &attrs,
+                          (char *const *)argv, (char *const *)envv);
+    posix_spawnattr_destroy(&attrs);
+    posix_spawn_file_actions_destroy(&facts);
+    if (errfd >= 0) {
+        close(errfd);
+    }
+    if (ret) {
+        LOGERR("ExecCmd::startExec: posix_spawn() failed. errno " << ret <<
+               "\n");
+        m_pid = -1;
+        return -1;
+    }
+    return 0;
+}
+#endif /* HAVE_POSIX_SPAWN */
+
 void ExecCmd::setrlimit_as(int mbytes)
 {
     m->m_rlimit_as_mbytes = mbytes;
@@ -522,100 +644,42 @@ int ExecCmd::startExec(const string& cmd, const vector<string>& args,
     }
 //////////////////////////////// End vfork child prepare section.
 
-#if HAVE_POSIX_SPAWN && USE_POSIX_SPAWN
-    // Note that posix_spawn provides no way to setrlimit() the child.
-    {
-        posix_spawnattr_t attrs;
-        posix_spawnattr_init(&attrs);
-        short flags;
-        posix_spawnattr_getflags(&attrs, &flags);
-
-        flags |=  POSIX_SPAWN_USEVFORK;
-
-        posix_spawnattr_setpgroup(&attrs, 0);
-        flags |= POSIX_SPAWN_SETPGROUP;
-
-        sigset_t sset;
-        sigemptyset(&sset);
-        posix_spawnattr_setsigmask(&attrs, &sset);
-        flags |= POSIX_SPAWN_SETSIGMASK;
-
-        sigemptyset(&sset);
-        sigaddset(&sset, SIGTERM);
-        posix_spawnattr_setsigdefault(&attrs, &sset);
-        flags |= POSIX_SPAWN_SETSIGDEF;
-
-        posix_spawnattr_setflags(&attrs, flags);
-
-        posix_spawn_file_actions_t facts;
-        posix_spawn_file_actions_init(&facts);
-
-        if (has_input) {
-            posix_spawn_file_actions_addclose(&facts, m->m_pipein[1]);
-            if (m->m_pipein[0] != 0) {
-                posix_spawn_file_actions_adddup2(&facts, m->m_pipein[0], 0);
-                posix_spawn_file_actions_addclose(&facts, m->m_pipein[0]);
-            }
-        }
-        if (has_output) {
-            posix_spawn_file_actions_addclose(&facts, m->m_pipeout[0]);
-            if (m->m_pipeout[1] != 1) {
-                posix_spawn_file_actions_adddup2(&facts, m->m_pipeout[1], 1);
-                posix_spawn_file_actions_addclose(&facts, m->m_pipeout[1]);
-            }
+#ifdef HAVE_POSIX_SPAWN
+    // posix_spawn provides no way to setrlimit() the child, use fork
+    // in this case.
+    if (Internal::o_usePosixSpawn && m->m_rlimit_as_mbytes <= 0) {
+        if (m->spawn(exe, argv, envv, has_input, has_output) < 0) {
+            free(argv);
+            free(envv);
+            return -1;
         }
-
-        // Do we need to redirect stderr ?
-        if (!m->m_stderrFile.empty()) {
-            int oflags = O_WRONLY | O_CREAT;
-#ifdef O_APPEND
-            oflags |= O_APPEND;
+    } else
 #endif
-            posix_spawn_file_actions_addopen(&facts, 2, m->m_stderrFile.c_str(),
-                                             oflags, 0600);
-        }
-        LOGDEB1("using SPAWN\n");
-
-        // posix_spawn() does not have any standard way to ask for
-        // calling closefrom(). Afaik there is a solaris extension for this,
-        // but let's just add all fds
-        for (int i = 3; i < libclf_maxfd(); i++) {
-            posix_spawn_file_actions_addclose(&facts, i);
+    {
+        if (Internal::o_useVfork) {
+            LOGDEB1("using VFORK\n");
+            m->m_pid = vfork();
+        } else {
+            LOGDEB1("using FORK\n");
+            m->m_pid = fork();
         }
-
-        int ret = posix_spawn(&m->m_pid, exe.c_str(), &facts, &attrs,
-                              (char *const *)argv, (char *const *)envv);
-        posix_spawnattr_destroy(&attrs);
-        posix_spawn_file_actions_destroy(&facts);
-        if (ret) {
-            LOGERR("ExecCmd::startExec: posix_spawn() failed. errno " << ret <<
+        if (m->m_pid < 0) {
+            LOGERR("ExecCmd::startExec: fork(2) failed. errno " << errno <<
                    "\n");
+            free(argv);
+            free(envv);
             return -1;
         }
+        if (m->m_pid == 0) {
+            // e.inactivate() is not needed. As we do not return, the call
+            // stack won't be unwound and destructors of local objects
+            // won't be called.
+            m->dochild(exe, argv, envv, has_input, has_output);
+            // dochild does not return. Just in case...
+            _exit(1);
+        }
     }
 
-#else
-    if (Internal::o_useVfork) {
-        LOGDEB1("using VFORK\n");
-        m->m_pid = vfork();
-    } else {
-        LOGDEB1("using FORK\n");
-        m->m_pid = fork();
-    }
-    if (m->m_pid < 0) {
-        LOGERR("ExecCmd::startExec: fork(2) failed. errno " << errno << "\n");
-        return -1;
-    }
-    if (m->m_pid == 0) {
-        // e.inactivate() is not needed. As we do not return, the call
-        // stack won't be unwound and destructors of local objects
-        // won't be called.
-        m->dochild(exe, argv, envv, has_input, has_output);
-        // dochild does not return. Just in case...
-        _exit(1);
-    }
-#endif
-
     // Father process
 
 ////////////////////
@@ -840,7 +904,7 @@ int ExecCmd::send(const string& data)
     return nwritten;
 }
 
-int ExecCmd::receive(string& data, int cnt)
+int ExecCmd::receive(string& data, int cnt, int timeosecs)
 {
     NetconCli *con = m->m_fromcmd.get();
     if (con == 0) {
@@ -852,8 +916,12 @@ int ExecCmd::receive(string& data, int cnt)
     int ntot = 0;
     do {
         int toread = cnt > 0 ? MIN(cnt - ntot, BS) : BS;
-        int n = con->receive(buf, toread);
+        int n = con->receive(buf, toread, timeosecs);
         if (n < 0) {
+            if (con->timedout()) {
+                LOGERR("ExecCmd::receive: timeout\n");
+                return -1;
+            }
             LOGERR("ExecCmd::receive: error\n");
             return -1;
         } else if (n > 0) {
@@ -919,11 +987,15 @@ int ExecCmd::getline(string& data, int timeosecs)
 {
     GetlineWatchdog gwd(timeosecs);
     setAdvise(&gwd);
+    int ret;
     try {
-        return getline(data);
+        ret = getline(data);
     } catch (...) {
-        return -1;
+        ret = -1;
     }
+    // Don't leave a pointer to the local object
+    setAdvise(0);
+    return ret;
 }
 
 
@@ -1130,6 +1202,7 @@ void ReExec::reexec()
 #include <string.h>
 #include <signal.h>
 
+#include <chrono>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -1255,6 +1328,8 @@ static char usage [] =
     "     <mimetype> the type of the file parameters\n"
     "trexecmd -w cmd : do the 'which' thing\n"
     "trexecmd -l cmd test getline\n"
+    "trexecmd -b <heapmb> cmd [arg1 arg2 ...] : spawns per second with\n"
+    "     fork, vfork and posix_spawn, with a heap of heapmb MB\n"
     ;
 
 static void Usage(void)
@@ -1265,6 +1340,7 @@ static void Usage(void)
 
 static int     op_flags;
 #define OPT_MOINS 0x1
+#define OPT_b     0x2
 #define OPT_i     0x4
 #define OPT_w     0x8
 #define OPT_c     0x10
@@ -1319,6 +1395,43 @@ public:
 };
 
 
+// Run the command repeatedly for 2 S with each process creation
+// method. The heap is touched so that fork has the page tables to copy.
+static int spawnbench(const string& cmd, const vector<string>& args,
+                      int heapmb)
+{
+    size_t heapsize = size_t(heapmb) * 1024 * 1024;
+    char *heap = (char *)malloc(heapsize + 1);
+    if (nullptr == heap) {
+        cerr << "Can't allocate " << heapmb << " MB\n";
+        return 1;
+    }
+    memset(heap, 1, heapsize + 1);
+    const char *methods[] = {"fork", "vfork", "posix_spawn"};
+    for (int method = 0; method < 3; method++) {
+        ExecCmd::useVfork(method == 1);
+        ExecCmd::usePosixSpawn(method == 2);
+        int count = 0;
+        double secs;
+        auto start = std::chrono::steady_clock::now();
+        do {
+            ExecCmd mexec;
+            string output;
+            if (mexec.doexec(cmd, args, 0, &output) != 0) {
+                cerr << "doexec failed\n";
+                return 1;
+            }
+            count++;
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            secs = elapsed.count();
+        } while (secs < 2);
+        cout << heapmb << " MB heap, " << methods[method] << ": " <<
+            int(count / secs) << " spawns/s" << endl;
+    }
+    free(heap);
+    return 0;
+}
 
 ReExec reexec;
 int main(int argc, char *argv[])
@@ -1336,6 +1449,7 @@ int main(int argc, char *argv[])
         reexec.insertArgs(newargs, 2);
     }
 
+    int heapmb = 0;
     thisprog = argv[0];
     argc--;
     argv++;
@@ -1349,6 +1463,16 @@ int main(int argc, char *argv[])
         }
         while (**argv)
             switch (*(*argv)++) {
+            case 'b':
+                op_flags |= OPT_b;
+                if (argc < 2) {
+                    Usage();
+                }
+                if (sscanf(*(++argv), "%d", &heapmb) != 1 || heapmb < 0) {
+                    Usage();
+                }
+                argc--;
+                goto b1;
             case 'c':
                 op_flags |= OPT_c;
                 break;
@@ -1376,6 +1500,7 @@ int main(int argc, char *argv[])
                 Usage();
                 break;
             }
+b1:
         argc--;
         argv++;
     }
@@ -1412,7 +1537,9 @@ int main(int argc, char *argv[])
         reexec.reexec();
     }
 
-    if (op_flags & OPT_w) {
+    if (op_flags & OPT_b) {
+        return spawnbench(arg1, l, heapmb);
+    } else if (op_flags & OPT_w) {
         // Test "which" method
         string path;
         if (ExecCmd::which(arg1, path)) {
@@ -70,6 +70,11 @@ public:
     // far as I can see, but just in case...
     static void useVfork(bool on);
 
+    // Use posix_spawn() to start the commands, if available. This is
+    // the default. fork() or vfork() are used if this is off, or a
+    // memory limit is set (setrlimit_as()).
+    static void usePosixSpawn(bool on);
+
     /**
      * Add/replace environment variable before executing command. This must
      * be called before doexec() to have an effect (possibly multiple
@@ -156,7 +161,9 @@ public:
     int startExec(const std::string& cmd, const std::vector<std::string>& args,
                   bool has_input, bool has_output);
     int send(const std::string& data);
-    int receive(std::string& data, int cnt = -1);
+    /** Read data. If timeosecs is > 0, fail if no data arrives within
+        this delay for any read */
+    int receive(std::string& data, int cnt = -1, int timeosecs = -1);
 
     /** Read line. Will call back periodically to check for cancellation */
     int getline(std::string& data);
@@ -0,0 +1,268 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "extvolpoller.hxx"
+
+#include <stdlib.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+#include "execmd.h"
+#include "hookrunner.hxx"
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+// Max time for one execution of the command in polling mode
+static const int pollTimeoutMs = 10000;
+// Delay before restarting the command if it exits in watch mode
+static const int restartDelayMs = 10000;
+
+class ExtVolPoller::Internal {
+public:
+    Internal(const vector<string>& c, int ims, bool w, HookRunner *h)
+        : cmd(c), intervalms(ims), watch(w), hooks(h), stopping(false),
+          volume(-1), serial(0), failed(false) {}
+
+    void worker();
+    void poll();
+    void runWatch();
+    // Set the volume from the command output, if it makes sense.
+    void newValue(const string& out, unsigned int oserial);
+    bool volchangePending() {
+        return hooks && hooks->busy("onvolumechange");
+    }
+    bool isStopping() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return stopping;
+    }
+    // Sleep for ms or until we are stopped. Returns false if stopping.
+    bool sleep(int ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, std::chrono::milliseconds(ms),
+                    [this] {return stopping;});
+        return !stopping;
+    }
+    void error(const string& msg) {
+        // Only complain once while the command keeps failing
+        if (!failed) {
+            LOGERR("ExtVolPoller: " << cmd[0] << ": " << msg << endl);
+            failed = true;
+        } else {
+            LOGDEB("ExtVolPoller: " << cmd[0] << ": " << msg << endl);
+        }
+    }
+
+    vector<string> cmd;
+    int intervalms;
+    bool watch;
+    HookRunner *hooks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    bool stopping;
+    int volume;
+    // Incremented when the volume is set locally
+    unsigned int serial;
+    bool failed;
+};
+
+// Called periodically by ExecCmd while the command is running, for
+// interrupting it if we are stopping, or if it is too slow.
+class ExtVolWatchdog : public ExecCmdAdvise {
+public:
+    ExtVolWatchdog(ExtVolPoller::Internal *m, int maxms)
+        : m_m(m), m_maxms(maxms), m_start(Clock::now()) {}
+    void newData(int) {
+        if (m_m->isStopping()) {
+            throw std::runtime_error("stopping");
+        }
+        if (m_maxms > 0 &&
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                Clock::now() - m_start).count() >= m_maxms) {
+            throw std::runtime_error("timeout");
+        }
+    }
+    ExtVolPoller::Internal *m_m;
+    int m_maxms;
+    Clock::time_point m_start;
+};
+
+ExtVolPoller::ExtVolPoller(const vector<string>& cmd, int intervalms,
+                           bool watch, HookRunner *hooks)
+{
+    m = new Internal(cmd, intervalms > 0 ? intervalms : 1000, watch, hooks);
+    if (cmd.empty()) {
+        return;
+    }
+    if (!watch) {
+        // Get an initial value before the first status update.
+        m->poll();
+    }
+    m->thread = std::thread(&Internal::worker, m);
+}
+
+ExtVolPoller::~ExtVolPoller()
+{
+    {
+        std::unique_lock<std::mutex> lock(m->mutex);
+        m->stopping = true;
+        m->cv.notify_all();
+    }
+    if (m->thread.joinable()) {
+        m->thread.join();
+    }
+    delete m;
+}
+
+int ExtVolPoller::volume()
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    return m->volume;
+}
+
+void ExtVolPoller::setVolume(int volume)
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    m->volume = volume;
+    m->serial++;
+}
+
+void ExtVolPoller::Internal::worker()
+{
+    if (watch) {
+        while (!isStopping()) {
+            runWatch();
+            if (!sleep(restartDelayMs)) {
+                break;
+            }
+            LOGDEB("ExtVolPoller: restarting " << cmd[0] << endl);
+        }
+    } else {
+        while (sleep(intervalms)) {
+            poll();
+        }
+    }
+}
+
+void ExtVolPoller::Internal::newValue(const string& out,
+                                      unsigned int oserial)
+{
+    char *endp;
+    long val = strtol(out.c_str(), &endp, 10);
+    if (endp == out.c_str()) {
+        error(string("bad output [") + out + "]");
+        return;
+    }
+    if (val < 0) {
+        val = 0;
+    } else if (val > 100) {
+        val = 100;
+    }
+    // The value may predate a change we just made
+    if (volchangePending()) {
+        LOGDEB1("ExtVolPoller: volume change pending, ignoring " << val <<
+                endl);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (serial != oserial) {
+        LOGDEB1("ExtVolPoller: volume was set, ignoring " << val << endl);
+        return;
+    }
+    if (val != volume) {
+        LOGDEB("ExtVolPoller: volume now " << val << endl);
+    }
+    volume = int(val);
+    failed = false;
+}
+
+void ExtVolPoller::Internal::poll()
+{
+    if (volchangePending()) {
+        return;
+    }
+    unsigned int oserial;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        oserial = serial;
+    }
+    string out;
+    ExecCmd ecmd;
+    ExtVolWatchdog wd(this, pollTimeoutMs);
+    ecmd.setAdvise(&wd);
+    ecmd.setTimeout(500);
+    int status;
+    try {
+        status = ecmd.doexec1(cmd, 0, &out);
+    } catch (const std::exception& e) {
+        if (!isStopping()) {
+            error(string("interrupted: ") + e.what());
+        }
+        return;
+    }
+    if (status) {
+        error("failed");
+        return;
+    }
+    newValue(out, oserial);
+}
+
+void ExtVolPoller::Internal::runWatch()
+{
+    ExecCmd ecmd;
+    ExtVolWatchdog wd(this, 0);
+    ecmd.setAdvise(&wd);
+    ecmd.setTimeout(1000);
+    if (ecmd.startExec(cmd[0], vector<string>(cmd.begin() + 1, cmd.end()),
+                       false, true) < 0) {
+        error("can't execute");
+        return;
+    }
+    for (;;) {
+        string line;
+        int n;
+        try {
+            n = ecmd.getline(line);
+        } catch (...) {
+            // Stopping. The ExecCmd destructor kills the command.
+            return;
+        }
+        if (n <= 0) {
+            error("exited");
+            return;
+        }
+        // The watchdog only runs when no data arrives
+        if (isStopping()) {
+            return;
+        }
+        unsigned int oserial;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            oserial = serial;
+        }
+        newValue(line, oserial);
+    }
+}
@@ -0,0 +1,57 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _EXTVOLPOLLER_H_INCLUDED_
+#define _EXTVOLPOLLER_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+class HookRunner;
+
+/// Reads the external volume ('getexternalvolume' command) on a
+/// separate thread, so that the status updates just have to fetch
+/// the last known value instead of running the command every time.
+///
+/// The command is either run periodically, and should print the
+/// current volume, or, in watch mode, started once and should print
+/// a line with the new value each time the volume changes (and the
+/// current one when starting).
+///
+/// Values read while an 'onvolumechange' command is pending or
+/// executing are ignored, as they are probably obsolete.
+class ExtVolPoller {
+public:
+    /// @param cmd the command and its arguments.
+    /// @param intervalms polling period. Ignored in watch mode.
+    /// @param watch the command is long-running and prints changes.
+    /// @param hooks used to check for pending volume changes. May be null.
+    ExtVolPoller(const std::vector<std::string>& cmd, int intervalms,
+                 bool watch, HookRunner *hooks);
+    ~ExtVolPoller();
+
+    /// Return the last known volume, or -1 if it was never read.
+    int volume();
+
+    /// Record a volume which we just set.
+    void setVolume(int volume);
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _EXTVOLPOLLER_H_INCLUDED_ */
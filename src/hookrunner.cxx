@@ -0,0 +1,214 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "hookrunner.hxx"
+
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+#include "execmd.h"
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+static int msSince(const Clock::time_point& start)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::now() - start).count();
+}
+
+class HookRunner::Internal {
+public:
+    Internal(unsigned int maxq, int tmo)
+        : maxqueue(maxq), timeoutms(tmo), stopping(false) {}
+
+    struct Job {
+        string name;
+        vector<string> cmd;
+        bool coalesce;
+        Clock::time_point queued;
+    };
+
+    void worker();
+    void execute(const Job& job);
+    bool isStopping() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return stopping;
+    }
+
+    unsigned int maxqueue;
+    int timeoutms;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    deque<Job> queue;
+    // Name of the executing command, empty if none
+    string running;
+    bool stopping;
+};
+
+HookRunner::HookRunner(unsigned int maxqueue, int timeoutms)
+{
+    m = new Internal(maxqueue, timeoutms);
+}
+
+HookRunner::~HookRunner()
+{
+    {
+        std::unique_lock<std::mutex> lock(m->mutex);
+        m->stopping = true;
+        if (!m->queue.empty()) {
+            LOGDEB("HookRunner: dropping " << m->queue.size() <<
+                   " pending commands\n");
+        }
+        m->cv.notify_all();
+    }
+    if (m->thread.joinable()) {
+        m->thread.join();
+    }
+    delete m;
+}
+
+void HookRunner::run(const string& name, const vector<string>& cmd,
+                     bool coalesce)
+{
+    if (cmd.empty()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m->mutex);
+    if (coalesce) {
+        for (auto& job : m->queue) {
+            if (job.coalesce && job.name == name) {
+                LOGDEB1("HookRunner: " << name << ": replacing pending\n");
+                job.cmd = cmd;
+                return;
+            }
+        }
+    }
+    if (m->queue.size() >= m->maxqueue) {
+        LOGERR("HookRunner: queue full, dropping " << m->queue.front().name <<
+               endl);
+        m->queue.pop_front();
+    }
+    Internal::Job job;
+    job.name = name;
+    job.cmd = cmd;
+    job.coalesce = coalesce;
+    job.queued = Clock::now();
+    m->queue.push_back(job);
+    if (!m->thread.joinable()) {
+        m->thread = std::thread(&Internal::worker, m);
+    }
+    m->cv.notify_all();
+}
+
+void HookRunner::runShell(const string& name, const string& cmdline)
+{
+    run(name, vector<string>{"/bin/sh", "-c", cmdline});
+}
+
+bool HookRunner::busy(const string& name)
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    if (m->running == name) {
+        return true;
+    }
+    for (const auto& job : m->queue) {
+        if (job.name == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void HookRunner::Internal::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cv.wait(lock, [this] {return stopping || !queue.empty();});
+        if (stopping) {
+            return;
+        }
+        Job job = queue.front();
+        queue.pop_front();
+        running = job.name;
+        lock.unlock();
+        execute(job);
+        lock.lock();
+        running.clear();
+    }
+}
+
+// Run the command and wait for it, polling so that we can enforce the
+// timeout, and not delay our own shutdown. The ExecCmd destructor
+// kills the process group if the command is still running.
+void HookRunner::Internal::execute(const Job& job)
+{
+    int waitms = msSince(job.queued);
+    Clock::time_point start = Clock::now();
+    // For shell commands, show the command line
+    const string& what =
+        job.cmd[0] == "/bin/sh" ? job.cmd.back() : job.cmd[0];
+
+    ExecCmd ecmd;
+    if (ecmd.startExec(job.cmd[0],
+                       vector<string>(job.cmd.begin() + 1, job.cmd.end()),
+                       false, false) < 0) {
+        LOGERR("HookRunner: " << job.name << ": can't execute " <<
+               what << endl);
+        return;
+    }
+    int status;
+    int sleepms = 1;
+    while (!ecmd.maybereap(&status)) {
+        if (isStopping()) {
+            LOGDEB("HookRunner: " << job.name << ": stopping, killing " <<
+                   what << endl);
+            return;
+        }
+        if (timeoutms > 0 && msSince(start) >= timeoutms) {
+            LOGERR("HookRunner: " << job.name << ": " << what <<
+                   " timed out after " << timeoutms << " mS, killing it\n");
+            return;
+        }
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = sleepms * 1000 * 1000;
+        nanosleep(&ts, 0);
+        if (sleepms < 50) {
+            sleepms *= 2;
+        }
+    }
+    int runms = msSince(start);
+    if (status != 0) {
+        LOGERR("HookRunner: " << job.name << ": " << what <<
+               " failed, status 0x" << std::hex << status << std::dec <<
+               " (waited " << waitms << " mS, ran " << runms << " mS)\n");
+    } else {
+        LOGDEB("HookRunner: " << job.name << ": waited " << waitms <<
+               " mS, ran " << runms << " mS\n");
+    }
+}
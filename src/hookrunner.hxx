@@ -0,0 +1,59 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _HOOKRUNNER_H_INCLUDED_
+#define _HOOKRUNNER_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+/// Executes the user hook commands (onstart, onplay, onstop,
+/// onvolumechange) on a worker thread, in order, so that a slow
+/// script does not stall the control and eventing paths.
+///
+/// The queue is bounded: when it is full, the oldest command is
+/// dropped. A command can replace a pending one with the same name
+/// instead of being queued (e.g.: only the last volume value
+/// matters). Commands which run for too long are killed. The thread
+/// is started when the first command is queued.
+class HookRunner {
+public:
+    /// @param maxqueue max count of pending commands.
+    /// @param timeoutms kill commands which run longer than this. 0 for
+    ///   no limit.
+    HookRunner(unsigned int maxqueue, int timeoutms);
+    ~HookRunner();
+
+    /// Queue a command.
+    /// @param name hook name, for logging and coalescing.
+    /// @param cmd the command and its arguments.
+    /// @param coalesce replace a pending command with the same name if
+    ///   there is one.
+    void run(const std::string& name, const std::vector<std::string>& cmd,
+             bool coalesce = false);
+    /// Queue a shell command line, which will be executed like system()
+    /// does it.
+    void runShell(const std::string& name, const std::string& cmdline);
+
+    /// Check if a command with this name is pending or executing.
+    bool busy(const std::string& name);
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _HOOKRUNNER_H_INCLUDED_ */
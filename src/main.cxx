@@ -159,6 +159,7 @@ unordered_set<string> g_supportedFormats;
 static UpnpDevice *dev;
 
 string g_datadir(DATADIR "/");
+string g_cachedir;
 
 // Global
 string g_configfilename;
@@ -184,6 +185,9 @@ static void setupsigs()
                 perror("Sigaction failed");
             }
         }
+    // Writing to a child process which exited (e.g. the standby
+    // sc2mpd) must return an error, not kill us.
+    signal(SIGPIPE, SIG_IGN);
 }
 
 int main(int argc, char *argv[])
@@ -356,8 +360,16 @@ int main(int argc, char *argv[])
             opts.schttpport = atoi(value.c_str());
         g_config->get("scplaymethod", opts.scplaymethod);
         g_config->get("sc2mpd", sc2mpdpath);
+        if (g_config->get("scstandby", value))
+            opts.scstandby = atoi(value.c_str()) != 0;
+        if (g_config->get("scinternal", value))
+            opts.scinternal = atoi(value.c_str()) != 0;
+        if (g_config->get("scjitterms", value))
+            opts.scjitterms = atoi(value.c_str());
         if (g_config->get("ohmetasleep", value))
             opts.ohmetasleep = atoi(value.c_str());
+        if (g_config->get("ohtracksmax", value) && atoi(value.c_str()) > 0)
+            opts.ohtracksmax = atoi(value.c_str());
         g_config->get("ohmanufacturername", ohProductDesc.manufacturer.name);
         g_config->get("ohmanufacturerinfo", ohProductDesc.manufacturer.info);
         g_config->get("ohmanufacturerurl", ohProductDesc.manufacturer.url);
@@ -453,6 +465,7 @@ int main(int argc, char *argv[])
 	if (cachedir.empty())
             cachedir = path_cat(path_tildexpand("~") , "/.cache/upmpdcli");
     }
+    g_cachedir = cachedir;
 
     string& mcfn = opts.cachefn;
     // no cache access needed or desirable for a pure media renderer
@@ -641,6 +654,11 @@ int main(int argc, char *argv[])
     if (!sc2mpdpath.empty()) {
         opts.sc2mpdpath = sc2mpdpath;
         opts.options |= UpMpd::upmpdOhReceiver;
+    } else if (opts.scinternal && opts.scplaymethod.compare("alsa")) {
+        // Can still receive ohm/ohu streams
+        LOGINF("sc2mpd not found: Songcast receiver limited to ohm and ohu "
+               "senders, ohz (zone) senders are not supported\n");
+        opts.options |= UpMpd::upmpdOhReceiver;
     }
     if (!senderpath.empty()) {
         opts.options |= UpMpd::upmpdOhSenderReceiver;
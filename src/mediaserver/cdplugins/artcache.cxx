@@ -0,0 +1,312 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "artcache.hxx"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "libupnpp/log.hxx"
+
+#include "cachedir.hxx"
+#include "execmd.h"
+#include "main.hxx"
+#include "pathut.h"
+#include "smallut.h"
+
+using namespace std;
+using namespace std::placeholders;
+using namespace UPnPProvider;
+
+// Don't retry a failed fetch before this delay
+static const int failretrysecs = 60;
+// Max time for a fetch. This blocks a web server thread, and the
+// requests for the same image.
+static const int fetchtimeoutsecs = 5;
+// Max count of remembered remote URLs
+static const unsigned int maxknownurls = 20000;
+
+static string sniffmime(const string& path)
+{
+    char buf[8];
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return string();
+    }
+    ssize_t cnt = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (cnt >= 2 && !memcmp(buf, "\xff\xd8", 2)) {
+        return "image/jpeg";
+    } else if (cnt >= 4 && !memcmp(buf, "\x89PNG", 4)) {
+        return "image/png";
+    } else if (cnt >= 4 && !memcmp(buf, "GIF8", 4)) {
+        return "image/gif";
+    }
+    return "application/octet-stream";
+}
+
+class ArtCache::Internal {
+public:
+    Internal(const string& d, long long mx, int px)
+        : files(d, mx, "ArtCache"), maxpixels(px) {
+    }
+    bool runFetch(const string& url, const string& path);
+    string get(const string& vpath);
+    void addknown(const string& fn, const string& url);
+
+    // Open file handle for the virtual directory interface.
+    struct ArtFile {
+        int fd;
+    };
+    int getinfo(const string& vpath, VirtualDir::FileInfo *inf);
+    void *vopen(const string& vpath);
+    int vread(void *hdl, char *buf, size_t cnt);
+    off_t vseek(void *hdl, off_t offs, int whence);
+    void vclose(void *hdl);
+
+    CacheDir files;
+    int maxpixels;
+    // Remote URLs which we may fetch: file name -> url. knownorder
+    // is used to forget the oldest ones.
+    unordered_map<string, string> known;
+    deque<string> knownorder;
+    // Fetches in progress (file names). Concurrent requests for the
+    // same image wait for the first one.
+    set<string> fetching;
+    // Failed fetches: file name -> time
+    unordered_map<string, time_t> failed;
+    std::mutex mutex;
+    std::condition_variable fetchcv;
+};
+
+ArtCache::ArtCache(const string& dir, long long maxbytes, int maxpixels)
+{
+    m = new Internal(dir, maxbytes, maxpixels);
+}
+
+ArtCache::~ArtCache()
+{
+    delete m;
+}
+
+// Kill the helper if it runs for too long.
+class FetchWatchdog : public ExecCmdAdvise {
+public:
+    FetchWatchdog(int secs)
+        : m_deadline(std::chrono::steady_clock::now() +
+                     std::chrono::seconds(secs)) {}
+    void newData(int) {
+        if (std::chrono::steady_clock::now() >= m_deadline) {
+            throw std::runtime_error("timeout");
+        }
+    }
+    std::chrono::steady_clock::time_point m_deadline;
+};
+
+// Run the helper to download (and maybe downscale) the image to path.
+bool ArtCache::Internal::runFetch(const string& url, const string& path)
+{
+    string script = path_cat(g_datadir, "cdplugins/pycommon/artfetch.py");
+    string python;
+    if (!ExecCmd::which("python", python)) {
+        LOGERR("ArtCache: python not found\n");
+        return false;
+    }
+    ExecCmd cmd;
+    FetchWatchdog wd(fetchtimeoutsecs);
+    cmd.setAdvise(&wd);
+    cmd.setTimeout(500);
+    // Leave the helper some time for writing the file
+    vector<string> args{script, url, path, lltodecstr(maxpixels),
+            lltodecstr(fetchtimeoutsecs - 1)};
+    int status;
+    try {
+        status = cmd.doexec(python, args);
+    } catch (...) {
+        LOGERR("ArtCache: fetch timed out for " << url << endl);
+        return false;
+    }
+    if (status != 0) {
+        LOGERR("ArtCache: fetch failed for " << url << " status " <<
+               status << endl);
+        return false;
+    }
+    return true;
+}
+
+// Return the local file path for the virtual path, fetching the
+// image if needed. Returns an empty string in case of error.
+string ArtCache::Internal::get(const string& vpath)
+{
+    string fn = path_getsimple(vpath);
+    if (fn.size() != 16 ||
+        fn.find_first_not_of("0123456789abcdef") != string::npos) {
+        LOGERR("ArtCache: bad path " << vpath << endl);
+        return string();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!files.init()) {
+        return string();
+    }
+    while (fetching.find(fn) != fetching.end()) {
+        if (fetchcv.wait_for(lock, std::chrono::seconds(fetchtimeoutsecs)) ==
+            std::cv_status::timeout) {
+            return string();
+        }
+    }
+    string path = files.path(fn);
+    if (files.touch(fn)) {
+        return path;
+    }
+    auto kit = known.find(fn);
+    if (kit == known.end()) {
+        LOGDEB("ArtCache: unknown image " << vpath << endl);
+        return string();
+    }
+    string url = kit->second;
+    auto fit = failed.find(fn);
+    if (fit != failed.end()) {
+        if (time(0) - fit->second < failretrysecs) {
+            return string();
+        }
+        failed.erase(fit);
+    }
+
+    fetching.insert(fn);
+    lock.unlock();
+    string tpath = path + "-";
+    bool ok = runFetch(url, tpath);
+    struct stat st;
+    if (ok && (path_fileprops(tpath, &st) != 0 || st.st_size == 0 ||
+               rename(tpath.c_str(), path.c_str()) != 0)) {
+        LOGERR("ArtCache: no data for " << url << endl);
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tpath.c_str());
+    }
+    lock.lock();
+    fetching.erase(fn);
+    fetchcv.notify_all();
+    if (!ok) {
+        failed[fn] = time(0);
+        return string();
+    }
+    files.added(fn, st.st_size);
+    LOGDEB0("ArtCache: stored " << url << " " << st.st_size <<
+            " bytes. Total " << files.totalbytes() << endl);
+    return path;
+}
+
+int ArtCache::Internal::getinfo(const string& vpath,
+                                VirtualDir::FileInfo *inf)
+{
+    string path = get(vpath);
+    struct stat st;
+    if (path.empty() || path_fileprops(path, &st) != 0) {
+        return -1;
+    }
+    inf->file_length = st.st_size;
+    inf->last_modified = st.st_mtime;
+    inf->is_directory = false;
+    inf->is_readable = true;
+    inf->mime = sniffmime(path);
+    return 0;
+}
+
+void *ArtCache::Internal::vopen(const string& vpath)
+{
+    string path = get(vpath);
+    if (path.empty()) {
+        return nullptr;
+    }
+    // The file may be evicted while we serve it, this is not a
+    // problem once it is open.
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return new ArtFile{fd};
+}
+
+int ArtCache::Internal::vread(void *hdl, char *buf, size_t cnt)
+{
+    return read(((ArtFile *)hdl)->fd, buf, cnt);
+}
+
+off_t ArtCache::Internal::vseek(void *hdl, off_t offs, int whence)
+{
+    return lseek(((ArtFile *)hdl)->fd, offs, whence);
+}
+
+void ArtCache::Internal::vclose(void *hdl)
+{
+    ArtFile *file = (ArtFile *)hdl;
+    close(file->fd);
+    delete file;
+}
+
+void ArtCache::Internal::addknown(const string& fn, const string& url)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = known.find(fn);
+    if (it != known.end()) {
+        it->second = url;
+        return;
+    }
+    known[fn] = url;
+    knownorder.push_back(fn);
+    while (knownorder.size() > maxknownurls) {
+        known.erase(knownorder.front());
+        knownorder.pop_front();
+    }
+}
+
+string ArtCache::localPath(const string& vdir, const string& remoteurl)
+{
+    if (remoteurl.find("http://") != 0 && remoteurl.find("https://") != 0) {
+        return string();
+    }
+    string fn = CacheDir::hashname(remoteurl);
+    m->addknown(fn, remoteurl);
+    return vdir + fn;
+}
+
+VirtualDir::FileOps ArtCache::fileOps()
+{
+    VirtualDir::FileOps ops;
+    ops.getinfo = bind(&Internal::getinfo, m, _1, _2);
+    ops.open = bind(&Internal::vopen, m, _1);
+    ops.read = bind(&Internal::vread, m, _1, _2, _3);
+    ops.seek = bind(&Internal::vseek, m, _1, _2, _3);
+    ops.close = bind(&Internal::vclose, m, _1);
+    return ops;
+}
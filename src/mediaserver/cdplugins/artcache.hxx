@@ -0,0 +1,63 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _ARTCACHE_H_INCLUDED_
+#define _ARTCACHE_H_INCLUDED_
+
+#include <string>
+
+#include "libupnpp/device/vdir.hxx"
+
+/// Local copies of the album art images for a media server plugin.
+///
+/// The plugin replaces the remote art URLs with local ones, served
+/// through the libupnp virtual directory. The local path is a hash
+/// of the remote URL. Only the URLs which were registered by
+/// localPath() (i.e. appeared in the plugin results) can be fetched:
+/// we don't want to be an open proxy. Images already in the cache
+/// are served even if their URL is not registered, so that the local
+/// URLs stay valid across restarts.
+///
+/// An image is fetched on the first request for it by an external
+/// helper (artfetch.py), which downscales it if it can, and stored
+/// in the cache directory under the hash. The fetch time is bounded
+/// to a few seconds as it blocks a libupnp web server thread. The
+/// least recently used files are removed when the total size exceeds
+/// the cap. Failed fetches are not retried for a while.
+class ArtCache {
+public:
+    /// @param dir storage directory, created on first use.
+    /// @param maxbytes size cap for the directory contents.
+    /// @param maxpixels the images are downscaled to fit a square
+    ///    of this size. 0 to keep the original size.
+    ArtCache(const std::string& dir, long long maxbytes, int maxpixels);
+    ~ArtCache();
+
+    /// Compute the local path for a remote URL, and allow fetching it.
+    /// @param vdir the virtual directory path, e.g. "/tidal/art/"
+    /// @return the path, or an empty string if the URL is not http(s)
+    std::string localPath(const std::string& vdir,
+                          const std::string& remoteurl);
+
+    /// Return the file operations for serving the virtual directory.
+    UPnPProvider::VirtualDir::FileOps fileOps();
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _ARTCACHE_H_INCLUDED_ */
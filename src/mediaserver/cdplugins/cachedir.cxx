@@ -0,0 +1,154 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "cachedir.hxx"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "libupnpp/log.hxx"
+
+#include "pathut.h"
+
+using namespace std;
+
+CacheDir::CacheDir(const string& dir, long long maxbytes,
+                   const string& logname)
+    : m_dir(dir), m_maxbytes(maxbytes), m_logname(logname),
+      m_initdone(false), m_totalbytes(0), m_useserial(0)
+{
+}
+
+uint64_t CacheDir::fnvhash(const void *data, size_t len, uint64_t h)
+{
+    const unsigned char *cp = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= cp[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+string CacheDir::hashname(const string& key)
+{
+    uint64_t h = fnvhash(key.c_str(), key.size());
+    char buf[20];
+    sprintf(buf, "%016llx", (unsigned long long)h);
+    return buf;
+}
+
+string CacheDir::path(const string& fn) const
+{
+    return path_cat(m_dir, fn);
+}
+
+bool CacheDir::init()
+{
+    if (m_initdone) {
+        return !m_dir.empty();
+    }
+    m_initdone = true;
+    if (!path_makepath(m_dir, 0755)) {
+        LOGERR(m_logname << ": can't create " << m_dir << " errno " <<
+               errno << endl);
+        m_dir.clear();
+        return false;
+    }
+    string reason;
+    set<string> entries;
+    if (!readdir(m_dir, reason, entries)) {
+        LOGERR(m_logname << ": " << reason << endl);
+        m_dir.clear();
+        return false;
+    }
+    multimap<time_t, string> bymtime;
+    for (const auto& entry : entries) {
+        string fpath = path_cat(m_dir, entry);
+        struct stat st;
+        if (path_fileprops(fpath, &st) != 0) {
+            continue;
+        }
+        if (entry.back() == '-') {
+            unlink(fpath.c_str());
+            continue;
+        }
+        m_files[entry] = FileEnt{(long long)st.st_size, 0};
+        bymtime.insert(pair<time_t, string>(st.st_mtime, entry));
+        m_totalbytes += st.st_size;
+    }
+    for (const auto& it : bymtime) {
+        m_files[it.second].lastuse = ++m_useserial;
+    }
+    LOGDEB(m_logname << ": " << m_dir << " : " << m_files.size() <<
+           " entries, " << m_totalbytes << " bytes\n");
+    evict();
+    return true;
+}
+
+bool CacheDir::touch(const string& fn)
+{
+    auto it = m_files.find(fn);
+    if (it == m_files.end()) {
+        return false;
+    }
+    it->second.lastuse = ++m_useserial;
+    return true;
+}
+
+void CacheDir::added(const string& fn, long long size)
+{
+    auto it = m_files.find(fn);
+    if (it != m_files.end()) {
+        m_totalbytes -= it->second.size;
+    }
+    m_files[fn] = FileEnt{size, ++m_useserial};
+    m_totalbytes += size;
+    evict();
+}
+
+void CacheDir::forget(const string& fn)
+{
+    // fn may belong to the map entry, unlink before erasing
+    unlink(path_cat(m_dir, fn).c_str());
+    auto it = m_files.find(fn);
+    if (it != m_files.end()) {
+        m_totalbytes -= it->second.size;
+        m_files.erase(it);
+    }
+}
+
+// This walks the whole map for each eviction, but the number of
+// files is not big, and this only runs when we are over the limit.
+void CacheDir::evict()
+{
+    while (m_totalbytes > m_maxbytes && m_files.size() > 1) {
+        auto oldest = m_files.begin();
+        for (auto it = m_files.begin(); it != m_files.end(); it++) {
+            if (it->second.lastuse < oldest->second.lastuse) {
+                oldest = it;
+            }
+        }
+        LOGDEB1(m_logname << "::evict: " << oldest->first << endl);
+        forget(oldest->first);
+    }
+}
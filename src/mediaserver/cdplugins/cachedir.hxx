@@ -0,0 +1,95 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _CACHEDIR_H_INCLUDED_
+#define _CACHEDIR_H_INCLUDED_
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+/// A directory of cache files with a total size cap, shared by the
+/// plugin result cache and the art cache.
+///
+/// The directory is scanned on first use (init()): leftover temporary
+/// files (name ending with '-') are removed, and the existing files
+/// are ordered by modification time for initializing the LRU state.
+/// The least recently used files are removed when the total size
+/// exceeds the cap, but the last one is kept even if it is too big:
+/// it was just added and is about to be used.
+///
+/// The object only tracks the files: writing and reading them is up
+/// to the caller. There is no locking, the caller must serialize the
+/// calls.
+class CacheDir {
+public:
+    /// @param dir storage directory, created if it does not exist.
+    /// @param maxbytes size cap for the directory contents.
+    /// @param logname prefix for log messages.
+    CacheDir(const std::string& dir, long long maxbytes,
+             const std::string& logname);
+
+    /// Initialize on first call, then just return the status.
+    /// @return false if the directory can't be used.
+    bool init();
+    const std::string& dir() const {
+        return m_dir;
+    }
+    std::string path(const std::string& fn) const;
+    bool contains(const std::string& fn) const {
+        return m_files.find(fn) != m_files.end();
+    }
+    /// Mark a file as used. @return false if it is not in the cache.
+    bool touch(const std::string& fn);
+    /// Record a new or replaced file as the most recently used one,
+    /// and evict the old ones if needed.
+    void added(const std::string& fn, long long size);
+    /// Remove a file.
+    void forget(const std::string& fn);
+    size_t count() const {
+        return m_files.size();
+    }
+    long long totalbytes() const {
+        return m_totalbytes;
+    }
+
+    /// FNV-1a. The file names must be stable across runs and builds,
+    /// which std::hash does not guarantee.
+    static const uint64_t fnvinit = 14695981039346656037ULL;
+    static uint64_t fnvhash(const void *data, size_t len,
+                            uint64_t h = fnvinit);
+    /// File name for a key: the hash as 16 hexadecimal digits.
+    static std::string hashname(const std::string& key);
+
+private:
+    void evict();
+
+    struct FileEnt {
+        long long size;
+        // Value of m_useserial when last accessed.
+        unsigned long long lastuse;
+    };
+    std::string m_dir;
+    long long m_maxbytes;
+    std::string m_logname;
+    bool m_initdone;
+    long long m_totalbytes;
+    unsigned long long m_useserial;
+    std::unordered_map<std::string, FileEnt> m_files;
+};
+
+#endif /* _CACHEDIR_H_INCLUDED_ */
@@ -48,6 +48,13 @@ public:
     /// Access the main configuration file.
     virtual ConfSimple *getconfig(CDPlugin *)= 0;
     virtual std::string getexecpath(CDPlugin *)= 0;
+
+    /// Signal that the content of a container changed since it was
+    /// last returned, so that the change can be evented.
+    /// @param objid the container object id.
+    /// @param updateid the new container update id.
+    virtual void containerUpdated(CDPlugin *, const std::string& objid,
+                                  unsigned int updateid) = 0;
 };
 
 /// Interface to media server modules
@@ -102,7 +109,7 @@ public:
     /// @param stidx first entry to return.
     /// @param cnt number of entries.
     /// @param[output] entries output content.
-    /// @param sortcrits csv list of sort criteria.
+    /// @param sortcrits sort criteria, e.g. "+dc:title", "-upnp:artist".
     /// @param flg browse flag
     /// @return total number of matched entries in container
     virtual int browse(
@@ -122,7 +129,7 @@ public:
     /// @param stidx first entry to return.
     /// @param cnt number of entries.
     /// @param[output] entries output content.
-    /// @param sortcrits csv list of sort criteria.
+    /// @param sortcrits sort criteria, e.g. "+dc:title", "-upnp:artist".
     /// @return total number of matched entries in container
     virtual int search(
 	const std::string& ctid, int stidx, int cnt,
@@ -131,6 +138,17 @@ public:
 	const std::vector<std::string>& sortcrits = std::vector<std::string>())
     = 0;
 
+    /// Prepare the plugin for use: this may for example start a
+    /// helper process and log in to the service. Called from a
+    /// worker thread when the media server starts, so that the first
+    /// browse does not have to wait. Browse/search requests for the
+    /// plugin are held until this returns.
+    /// @return false if the initialization failed. The plugin will
+    ///    try again when it is used.
+    virtual bool startInit() {
+        return true;
+    }
+
     const std::string& getname() {
         return m_name;
     }
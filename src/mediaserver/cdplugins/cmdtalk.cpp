@@ -31,7 +31,7 @@ using namespace std;
 class CmdTalk::Internal {
 public:
     Internal()
-	: cmd(0) {
+	: cmd(0), timeosecs(-1) {
     }
     ~Internal() {
 	delete cmd;
@@ -42,6 +42,7 @@ public:
 	      const unordered_map<string, string>& args,
 	      unordered_map<string, string>& rep);
     ExecCmd *cmd;
+    int timeosecs;
     std::mutex mmutex;
 };
 
@@ -97,7 +98,9 @@ bool CmdTalk::Internal::readDataElement(string& name, string &data)
     string ibuf;
 
     // Read name and length
-    if (cmd->getline(ibuf) <= 0) {
+    int ret = timeosecs > 0 ? cmd->getline(ibuf, timeosecs) :
+        cmd->getline(ibuf);
+    if (ret <= 0) {
         LOGERR("CmdTalk: getline error\n" );
         return false;
     }
@@ -128,7 +131,7 @@ bool CmdTalk::Internal::readDataElement(string& name, string &data)
 
     // Read element data
     data.erase();
-    if (len > 0 && cmd->receive(data, len) != len) {
+    if (len > 0 && cmd->receive(data, len, timeosecs) != len) {
         LOGERR("CmdTalk: expected " << len << " bytes of data, got " <<
 	       data.length() << "\n");
         return false;
@@ -186,6 +189,11 @@ bool CmdTalk::Internal::talk(const pair<string, string>& arg0,
     }
 }
 
+void CmdTalk::setTimeout(int secs)
+{
+    m->timeosecs = secs;
+}
+
 bool CmdTalk::running()
 {
     return m && m->cmd && m->cmd->getChildPid() > 0;
@@ -83,6 +83,10 @@ class CmdTalk {
 			  std::vector<std::string>()
 	);
     virtual bool running();
+
+    // Set a timeout for reading each part of the answer. The
+    // process is killed if it expires. The default is to wait forever.
+    virtual void setTimeout(int secs);
     
     // Single exchange: send and receive data.
     virtual bool talk(const std::unordered_map<std::string, std::string>& args,
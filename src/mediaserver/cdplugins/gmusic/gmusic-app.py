@@ -96,6 +96,12 @@ def get_mimeandkbs():
         return ('audio/mpeg', str(128))
 
 
+@dispatcher.record('login')
+def login(a):
+    msgproc.log("login")
+    maybelogin()
+    return {'ok' : '1' if is_logged_in else '0'}
+
 @dispatcher.record('trackuri')
 def trackuri(a):
     global quality
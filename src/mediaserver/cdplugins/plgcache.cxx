@@ -0,0 +1,321 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "plgcache.hxx"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+#include "cachedir.hxx"
+
+using namespace std;
+
+// The string fields of UpSong, in storage order. Changing this
+// requires changing the file format version.
+static string UpSong::* const strfields[] = {
+    &UpSong::id, &UpSong::parentid, &UpSong::uri, &UpSong::name,
+    &UpSong::artist, &UpSong::album, &UpSong::title, &UpSong::tracknum,
+    &UpSong::genre, &UpSong::artUri, &UpSong::upnpClass, &UpSong::mime
+};
+static const int nstrfields = sizeof(strfields) / sizeof(strfields[0]);
+
+static const char cachemagic[8] = {'U','P','M','P','L','G','C','\0'};
+static const uint32_t cacheversion = 2;
+
+// File layout: header, nentries records, key (nul-terminated), string
+// table. The file is written and read on the same host, so we use
+// native byte order.
+struct CacheFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nentries;
+    int64_t ctime;
+    uint32_t keylen;
+    uint32_t strtabsize;
+    // Incremented each time the stored content changes.
+    uint32_t updateid;
+    uint32_t reserved;
+    // Hash of the records and string table, for detecting changes.
+    uint64_t datahash;
+};
+
+enum CacheRecordFlags {CRF_CONTAINER = 1, CRF_SEARCHABLE = 2};
+struct CacheRecord {
+    uint32_t stroffs[nstrfields];
+    uint32_t duration_secs;
+    uint32_t bitrate;
+    uint32_t samplefreq;
+    uint32_t flags;
+};
+
+class PlgCache::Internal {
+public:
+    Internal(const string& d, int ttl, long long mx)
+        : files(d, mx, "PlgCache"), ttlsecs(ttl) {
+    }
+    bool readHeader(const string& fn, const string& key,
+                    CacheFileHeader& hdr);
+
+    // Expired files are kept: they may still be used if the service
+    // is not responding.
+    CacheDir files;
+    int ttlsecs;
+    std::mutex mutex;
+};
+
+PlgCache::PlgCache(const string& dir, int ttlsecs, long long maxbytes)
+{
+    m = new Internal(dir, ttlsecs, maxbytes);
+}
+
+PlgCache::~PlgCache()
+{
+    delete m;
+}
+
+// Read the header of an existing file for key, checking that it is
+// valid and that the key matches.
+bool PlgCache::Internal::readHeader(const string& fn, const string& key,
+                                    CacheFileHeader& hdr)
+{
+    if (!files.contains(fn)) {
+        return false;
+    }
+    int fd = open(files.path(fn).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = false;
+    string skey(key.size(), 0);
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        !memcmp(hdr.magic, cachemagic, sizeof(cachemagic)) &&
+        hdr.version == cacheversion && hdr.keylen == key.size() &&
+        pread(fd, &skey[0], key.size(), sizeof(hdr) +
+              (off_t)hdr.nentries * sizeof(CacheRecord)) ==
+        ssize_t(key.size()) && skey == key) {
+        ok = true;
+    }
+    close(fd);
+    return ok;
+}
+
+int PlgCache::get(const string& key, int stidx, int cnt,
+                  vector<UpSong>& entries, bool stale)
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    if (!m->files.init()) {
+        return -1;
+    }
+    string fn = CacheDir::hashname(key);
+    if (!m->files.contains(fn)) {
+        return -1;
+    }
+    string path = m->files.path(fn);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        m->files.forget(fn);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheFileHeader)) {
+        close(fd);
+        m->files.forget(fn);
+        return -1;
+    }
+    size_t sz = st.st_size;
+    void *addr = mmap(0, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOGERR("PlgCache::get: mmap failed for " << path << " errno " <<
+               errno << endl);
+        return -1;
+    }
+
+    int total = -1;
+    const char *base = (const char *)addr;
+    const CacheFileHeader *hdr = (const CacheFileHeader *)base;
+    const CacheRecord *recs = (const CacheRecord *)(base + sizeof(*hdr));
+    const char *skey = (const char *)(recs + hdr->nentries);
+    const char *strtab = skey + hdr->keylen + 1;
+    if (memcmp(hdr->magic, cachemagic, sizeof(cachemagic)) ||
+        hdr->version != cacheversion ||
+        hdr->nentries > sz / sizeof(CacheRecord) ||
+        sizeof(*hdr) + (size_t)hdr->nentries * sizeof(CacheRecord) +
+        hdr->keylen + 1 + hdr->strtabsize != sz ||
+        hdr->strtabsize == 0 || strtab[hdr->strtabsize - 1] != 0) {
+        LOGERR("PlgCache::get: bad cache file " << path << endl);
+        m->files.forget(fn);
+        goto out;
+    }
+    if (key.size() != hdr->keylen || key.compare(0, key.size(), skey,
+                                                 hdr->keylen)) {
+        // Hash collision. Let the caller fetch the data, the file
+        // will be replaced by the next put().
+        LOGDEB("PlgCache::get: key mismatch for " << key << endl);
+        goto out;
+    }
+    if (!stale && time(0) - hdr->ctime > m->ttlsecs) {
+        LOGDEB0("PlgCache::get: expired: " << key << endl);
+        goto out;
+    }
+
+    total = hdr->nentries;
+    if (stidx < 0) {
+        stidx = 0;
+    }
+    for (int i = stidx; i < total; i++) {
+        if (cnt > 0 && i - stidx >= cnt) {
+            break;
+        }
+        const CacheRecord& rec = recs[i];
+        UpSong song;
+        for (int f = 0; f < nstrfields; f++) {
+            if (rec.stroffs[f] < hdr->strtabsize) {
+                song.*strfields[f] = strtab + rec.stroffs[f];
+            }
+        }
+        song.duration_secs = rec.duration_secs;
+        song.bitrate = rec.bitrate;
+        song.samplefreq = rec.samplefreq;
+        song.iscontainer = (rec.flags & CRF_CONTAINER) != 0;
+        song.searchable = (rec.flags & CRF_SEARCHABLE) != 0;
+        entries.push_back(song);
+    }
+    m->files.touch(fn);
+    LOGDEB0("PlgCache::get: " << key << " total " << total << " returned " <<
+            entries.size() << endl);
+
+out:
+    munmap(addr, sz);
+    return total;
+}
+
+bool PlgCache::put(const string& key, const vector<UpSong>& entries,
+                   bool *changed, unsigned int *updateid)
+{
+    if (changed) {
+        *changed = false;
+    }
+    // Build the records and string table. Identical strings (parent
+    // ids, classes, artists, art uris...) are stored once.
+    string strtab;
+    unordered_map<string, uint32_t> stroffs;
+    vector<CacheRecord> recs(entries.size());
+    for (unsigned int i = 0; i < entries.size(); i++) {
+        const UpSong& song = entries[i];
+        CacheRecord& rec = recs[i];
+        for (int f = 0; f < nstrfields; f++) {
+            const string& val = song.*strfields[f];
+            auto it = stroffs.find(val);
+            if (it != stroffs.end()) {
+                rec.stroffs[f] = it->second;
+            } else {
+                rec.stroffs[f] = strtab.size();
+                stroffs[val] = strtab.size();
+                strtab.append(val.c_str());
+                strtab.push_back(0);
+            }
+        }
+        rec.duration_secs = song.duration_secs;
+        rec.bitrate = song.bitrate;
+        rec.samplefreq = song.samplefreq;
+        rec.flags = (song.iscontainer ? CRF_CONTAINER : 0) |
+            (song.searchable ? CRF_SEARCHABLE : 0);
+    }
+    if (strtab.empty()) {
+        strtab.push_back(0);
+    }
+
+    CacheFileHeader hdr;
+    memcpy(hdr.magic, cachemagic, sizeof(cachemagic));
+    hdr.version = cacheversion;
+    hdr.nentries = recs.size();
+    hdr.ctime = time(0);
+    hdr.keylen = key.size();
+    hdr.strtabsize = strtab.size();
+    hdr.reserved = 0;
+    hdr.datahash = CacheDir::fnvhash(
+        strtab.c_str(), strtab.size(), recs.empty() ? CacheDir::fnvinit :
+        CacheDir::fnvhash(&recs[0], recs.size() * sizeof(CacheRecord)));
+    hdr.updateid = 1;
+
+    std::unique_lock<std::mutex> lock(m->mutex);
+    if (!m->files.init()) {
+        return false;
+    }
+    string fn = CacheDir::hashname(key);
+    // Keep the update id if the content is the same as the previous
+    // version (even expired), else increment it.
+    CacheFileHeader ohdr;
+    if (m->readHeader(fn, key, ohdr)) {
+        if (ohdr.datahash == hdr.datahash) {
+            hdr.updateid = ohdr.updateid;
+        } else {
+            hdr.updateid = ohdr.updateid + 1;
+            if (changed) {
+                *changed = true;
+            }
+        }
+    }
+    if (updateid) {
+        *updateid = hdr.updateid;
+    }
+    string path = m->files.path(fn);
+    string tpath = path + "-";
+    int fd = open(tpath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGERR("PlgCache::put: can't open " << tpath << " errno " << errno <<
+               endl);
+        return false;
+    }
+    size_t sz = sizeof(hdr) + recs.size() * sizeof(CacheRecord) +
+        key.size() + 1 + strtab.size();
+    bool ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        (recs.empty() ||
+         write(fd, &recs[0], recs.size() * sizeof(CacheRecord)) ==
+         ssize_t(recs.size() * sizeof(CacheRecord))) &&
+        write(fd, key.c_str(), key.size() + 1) == ssize_t(key.size() + 1) &&
+        write(fd, strtab.c_str(), strtab.size()) == ssize_t(strtab.size());
+    if (close(fd) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tpath.c_str(), path.c_str()) != 0) {
+        LOGERR("PlgCache::put: write error for " << tpath << " errno " <<
+               errno << endl);
+        unlink(tpath.c_str());
+        return false;
+    }
+
+    m->files.added(fn, sz);
+    LOGDEB0("PlgCache::put: " << key << " " << entries.size() <<
+            " entries, " << sz << " bytes, updateid " << hdr.updateid <<
+            ". Total " << m->files.totalbytes() << endl);
+    return true;
+}
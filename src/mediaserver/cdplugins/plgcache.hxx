@@ -0,0 +1,72 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _PLGCACHE_H_INCLUDED_
+#define _PLGCACHE_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+#include "upmpdutils.hxx"
+
+/// Persistent storage for the browse and search results of a media
+/// server plugin, so that they survive a restart.
+///
+/// Each result set is stored in its own file, named after a hash of
+/// the key. The file has a fixed size header, an array of fixed size
+/// records holding offsets into a string table, and the string table
+/// itself (nul-terminated strings). The file is mapped on access, and
+/// only the requested slice of the records is converted to UpSong.
+///
+/// Entries older than the time to live are not returned, except if
+/// explicitly requested (for use when the service does not
+/// respond). The least recently used files are removed when the total
+/// size exceeds the cap. The directory is only scanned on first use.
+class PlgCache {
+public:
+    /// @param dir storage directory, created if it does not exist.
+    /// @param ttlsecs entry lifetime in seconds.
+    /// @param maxbytes size cap for the directory contents.
+    PlgCache(const std::string& dir, int ttlsecs, long long maxbytes);
+    ~PlgCache();
+
+    /// Retrieve a result set or a slice of it.
+    /// @param key identifies the request, e.g. "browse:children:<objid>".
+    /// @param stidx first entry to return.
+    /// @param cnt max number of entries to return, <= 0 for all.
+    /// @param[output] entries the slice is appended to this.
+    /// @param stale return the data even if it is expired.
+    /// @return the total size of the set, or -1 if the key was not
+    ///    found or the entry was expired.
+    int get(const std::string& key, int stidx, int cnt,
+            std::vector<UpSong>& entries, bool stale = false);
+
+    /// Store a result set, replacing any previous one for the key.
+    ///
+    /// Each stored set has an update id, starting at 1 and
+    /// incremented when the set is replaced by different content.
+    /// @param[output] changed set if a previous version existed (even
+    ///    expired) and the content differs.
+    /// @param[output] updateid the update id of the new version.
+    bool put(const std::string& key, const std::vector<UpSong>& entries,
+             bool *changed = 0, unsigned int *updateid = 0);
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _PLGCACHE_H_INCLUDED_ */
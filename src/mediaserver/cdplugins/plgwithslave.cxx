@@ -20,7 +20,14 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <sstream>
 #include <string.h>
@@ -28,7 +35,11 @@
 #include <microhttpd.h>
 #include <json/json.h>
 
+#include "artcache.hxx"
 #include "cmdtalk.h"
+#include "plgcache.hxx"
+#include "searchcrit.hxx"
+#include "sortcrit.hxx"
 #include "pathut.h"
 #include "smallut.h"
 #include "libupnpp/log.hxx"
@@ -62,15 +73,48 @@ public:
     time_t opentime;
 };
 
+// A call to the slave process, executed by the worker thread. The
+// data is owned by this object, which may outlive the caller if it
+// gave up waiting.
+struct SlaveCall {
+    SlaveCall(const string& p, const unordered_map<string, string>& a)
+        : proc(p), args(a), ok(false), done(false), abandoned(false) {
+    }
+    string proc;
+    unordered_map<string, string> args;
+    unordered_map<string, string> res;
+    bool ok;
+    bool done;
+    bool abandoned;
+};
+
 class PlgWithSlave::Internal {
 public:
     Internal(PlgWithSlave *_plg, const string& exe, const string& hst,
              int prt, const string& pp)
 	: plg(_plg), exepath(exe), upnphost(hst), upnpport(prt), pathprefix(pp), 
-          laststream(this) {
+          laststream(this), diskcache(nullptr), artcache(nullptr),
+          timeoutsecs(0),
+          stopping(false) {
+    }
+    ~Internal() {
+        {
+            std::unique_lock<std::mutex> lock(callmutex);
+            stopping = true;
+            callcv.notify_all();
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+        delete diskcache;
+        delete artcache;
     }
 
     bool maybeStartCmd();
+    bool callproc(const string& proc, const unordered_map<string, string>& args,
+                  unordered_map<string, string>& res);
+    void workerLoop();
+    void rewriteArt(vector<UpSong>& entries);
 
     PlgWithSlave *plg;
     CmdTalk cmd;
@@ -85,6 +129,24 @@ public:
     
     // Cached uri translation
     StreamHandle laststream;
+
+    // Persistent browse/search results cache, or null if not configured.
+    PlgCache *diskcache;
+
+    // Local album art copies, or null if not configured. The images
+    // are served by the libupnp server under artvdir.
+    ArtCache *artcache;
+    string artvdir;
+
+    // The slave calls are executed by a dedicated thread, so that a
+    // hung slave does not block the libupnp threads for more than
+    // timeoutsecs (if it is > 0).
+    int timeoutsecs;
+    std::thread worker;
+    std::mutex callmutex;
+    std::condition_variable callcv;
+    std::deque<std::shared_ptr<SlaveCall> > calls;
+    bool stopping;
 };
 
 // microhttpd daemon handle. There is only one of these, and one port, we find
@@ -229,6 +291,84 @@ bool PlgWithSlave::Internal::maybeStartCmd()
     return true;
 }
 
+// Queue a call for the worker thread and wait for the result, or for
+// the deadline. In case of timeout, the call goes on in the
+// background: CmdTalk will kill the slave if it does not answer, and
+// it will be restarted.
+bool PlgWithSlave::Internal::callproc(
+    const string& proc, const unordered_map<string, string>& args,
+    unordered_map<string, string>& res)
+{
+    auto call = std::make_shared<SlaveCall>(proc, args);
+    std::unique_lock<std::mutex> lock(callmutex);
+    if (!worker.joinable()) {
+        worker = std::thread(&PlgWithSlave::Internal::workerLoop, this);
+    }
+    calls.push_back(call);
+    callcv.notify_all();
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::seconds(timeoutsecs);
+    while (!call->done) {
+        if (timeoutsecs <= 0) {
+            callcv.wait(lock);
+        } else if (callcv.wait_until(lock, deadline) ==
+                   std::cv_status::timeout && !call->done) {
+            LOGERR("PlgWithSlave::callproc: " << plg->m_name << ": " << proc <<
+                   " timed out after " << timeoutsecs << " S\n");
+            call->abandoned = true;
+            return false;
+        }
+    }
+    res.swap(call->res);
+    return call->ok;
+}
+
+void PlgWithSlave::Internal::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(callmutex);
+    for (;;) {
+        while (calls.empty() && !stopping) {
+            callcv.wait(lock);
+        }
+        if (stopping) {
+            return;
+        }
+        auto call = calls.front();
+        calls.pop_front();
+        if (call->abandoned) {
+            continue;
+        }
+        lock.unlock();
+        bool ok = maybeStartCmd() &&
+            cmd.callproc(call->proc, call->args, call->res);
+        if (!ok && !cmd.running()) {
+            // The slave died or was killed after a timeout: restart
+            // it now rather than on the next request.
+            LOGINF("PlgWithSlave: restarting " << plg->m_name << " slave\n");
+            maybeStartCmd();
+        }
+        lock.lock();
+        call->ok = ok;
+        call->done = true;
+        callcv.notify_all();
+    }
+}
+
+// Point the art URLs to our local copies.
+void PlgWithSlave::Internal::rewriteArt(vector<UpSong>& entries)
+{
+    if (nullptr == artcache) {
+        return;
+    }
+    for (auto& entry : entries) {
+        string path = artcache->localPath(artvdir, entry.artUri);
+        if (!path.empty()) {
+            entry.artUri = "http://" + upnphost + ":" +
+                lltodecstr(upnpport) + path;
+        }
+    }
+}
+
 // Translate the slave-generated HTTP URL (based on the trackid), to
 // an actual temporary service (e.g. tidal one), which will be an HTTP
 // URL pointing to either an AAC or a FLAC stream.
@@ -241,14 +381,11 @@ bool PlgWithSlave::Internal::maybeStartCmd()
 string PlgWithSlave::get_media_url(const string& path)
 {
     LOGDEB0("PlgWithSlave::get_media_url: " << path << endl);
-    if (!m->maybeStartCmd()) {
-	return string();
-    }
     time_t now = time(0);
     if (m->laststream.path.compare(path) ||
         (now - m->laststream.opentime > 10)) {
 	unordered_map<string, string> res;
-	if (!m->cmd.callproc("trackuri", {{"path", path}}, res)) {
+	if (!m->callproc("trackuri", {{"path", path}}, res)) {
 	    LOGERR("PlgWithSlave::get_media_url: slave failure\n");
 	    return string();
 	}
@@ -269,6 +406,17 @@ string PlgWithSlave::get_media_url(const string& path)
 }
 
 
+bool PlgWithSlave::startInit()
+{
+    unordered_map<string, string> res;
+    if (!m->callproc("login", {}, res)) {
+	LOGERR("PlgWithSlave::startInit: slave failure\n");
+	return false;
+    }
+    auto it = res.find("ok");
+    return it != res.end() && stringToBool(it->second);
+}
+
 PlgWithSlave::PlgWithSlave(const string& name, CDPluginServices *services)
     : CDPlugin(name, services)
 {
@@ -276,6 +424,49 @@ PlgWithSlave::PlgWithSlave(const string& name, CDPluginServices *services)
                      services->getupnpaddr(this),
                      services->getupnpport(this),
                      services->getpathprefix(this));
+
+    ConfSimple *conf = services->getconfig(this);
+    string value;
+    m->timeoutsecs = 20;
+    if (conf->get("plgtimeout", value)) {
+        m->timeoutsecs = atoi(value.c_str());
+    }
+    if (m->timeoutsecs > 0) {
+        m->cmd.setTimeout(m->timeoutsecs);
+    }
+
+    // The disk cache object is cheap. The directory will only be
+    // accessed when we first need it.
+    if (conf->get("plgdiskcache", value) && stringToBool(value)) {
+        int ttl = 3600;
+        if (conf->get("plgdiskcachettl", value)) {
+            ttl = atoi(value.c_str());
+        }
+        long long maxmbs = 20;
+        if (conf->get("plgdiskcachemaxmbs", value)) {
+            maxmbs = atoll(value.c_str());
+        }
+        string dir = path_cat(path_cat(g_cachedir, "plgcache"), name);
+        m->diskcache = new PlgCache(dir, ttl, maxmbs * 1024 * 1024);
+    }
+
+    if (conf->get("plgartcache", value) && stringToBool(value)) {
+        long long maxmbs = 50;
+        if (conf->get("plgartcachemaxmbs", value)) {
+            maxmbs = atoll(value.c_str());
+        }
+        int pixels = 300;
+        if (conf->get("plgartcachepixels", value)) {
+            pixels = atoi(value.c_str());
+        }
+        string dir = path_cat(path_cat(g_cachedir, "artcache"), name);
+        m->artcache = new ArtCache(dir, maxmbs * 1024 * 1024, pixels);
+        m->artvdir = m->pathprefix + "/art/";
+        if (!services->setfileops(this, m->artvdir, m->artcache->fileOps())) {
+            delete m->artcache;
+            m->artcache = nullptr;
+        }
+    }
 }
 
 PlgWithSlave::~PlgWithSlave()
@@ -340,6 +531,20 @@ static int resultToEntries(const string& encoded, int stidx, int cnt,
     return decoded.size();
 }
 
+// Extract the requested slice from a complete result set. Returns
+// totalmatches.
+static int sliceEntries(const vector<UpSong>& all, int stidx, int cnt,
+                        vector<UpSong>& entries)
+{
+    for (unsigned int i = stidx; i < all.size(); i++) {
+        if (cnt > 0 && int(i) - stidx >= cnt) {
+            break;
+        }
+        entries.push_back(all[i]);
+    }
+    return all.size();
+}
+
 // Better return a bogus informative entry than an outright error:
 static int errorEntries(const string& pid, vector<UpSong>& entries)
 {
@@ -349,42 +554,6 @@ static int errorEntries(const string& pid, vector<UpSong>& entries)
     return 1;
 }
 
-int PlgWithSlave::browse(const string& objid, int stidx, int cnt,
-                         vector<UpSong>& entries,
-                         const vector<string>& sortcrits,
-                         BrowseFlag flg)
-{
-    LOGDEB1("PlgWithSlave::browse\n");
-    entries.clear();
-    if (!m->maybeStartCmd()) {
-	return errorEntries(objid, entries);
-    }
-    string sbflg;
-    switch (flg) {
-    case CDPlugin::BFMeta:
-        sbflg = "meta";
-        break;
-    case CDPlugin::BFChildren:
-    default:
-        sbflg = "children";
-        break;
-    }
-
-    unordered_map<string, string> res;
-    if (!m->cmd.callproc("browse", {{"objid", objid}, {"flag", sbflg}}, res)) {
-	LOGERR("PlgWithSlave::browse: slave failure\n");
-	return errorEntries(objid, entries);
-    }
-
-    auto it = res.find("entries");
-    if (it == res.end()) {
-	LOGERR("PlgWithSlave::browse: no entries returned\n");
-        return errorEntries(objid, entries);
-    }
-    return resultToEntries(it->second, stidx, cnt, entries);
-}
-
-
 class SearchCacheEntry {
 public:
     SearchCacheEntry()
@@ -392,18 +561,25 @@ public:
     }
     time_t m_time;
     vector<UpSong> m_results;
+    // Collation keys and sorted orders (indices into m_results) for
+    // the sort specifications used so far.
+    SortKeys m_keys;
+    unordered_map<string, vector<unsigned int> > m_orders;
 };
 
 const int retention_secs = 300;
+// Shared by the browse and search calls, which may run concurrently:
+// the accesses are locked, and get() returns a copy.
 class SearchCache {
 public:
     SearchCache();
     SearchCacheEntry *get(const string& query);
     void set(const string& query, SearchCacheEntry &entry);
-    void flush();
 private:
+    void flush();
     time_t m_lastflush;
     unordered_map<string, SearchCacheEntry> m_cache;
+    std::mutex m_mutex;
 };
 
 SearchCache::SearchCache()
@@ -431,6 +607,7 @@ void SearchCache::flush()
 
 SearchCacheEntry *SearchCache::get(const string& key)
 {
+    std::unique_lock<std::mutex> lock(m_mutex);
     flush();
     auto it = m_cache.find(key);
     if (it != m_cache.end()) {
@@ -445,29 +622,62 @@ SearchCacheEntry *SearchCache::get(const string& key)
 void SearchCache::set(const string& key, SearchCacheEntry &entry)
 {
     LOGDEB0("SearchCache::set: " << key << endl);
+    std::unique_lock<std::mutex> lock(m_mutex);
     m_cache[key] = entry;
 }
 
 static SearchCache o_scache;
 
-int resultFromCacheEntry(const string& classfilter, int stidx, int cnt,
-                         const SearchCacheEntry& e,
-                         vector<UpSong>& entries)
+// Compute the sort order for the entry if it is not already there.
+// Returns true if it was computed (the entry should be stored again).
+static bool sortCacheEntry(SearchCacheEntry& e, const SortSpec& spec)
+{
+    if (spec.empty()) {
+        return false;
+    }
+    string skey = spec.canonical();
+    if (e.m_orders.find(skey) != e.m_orders.end()) {
+        return false;
+    }
+    spec.sort(e.m_results, e.m_keys, e.m_orders[skey]);
+    return true;
+}
+
+// Filter the cached results with the full search expression and
+// return the requested slice, in the sort order if one is
+// specified. sortCacheEntry() must have been called. A cnt of 0 means
+// all entries. Returns the total count of matching entries.
+static int resultFromCacheEntry(const SearchExp& exp, const SortSpec& spec,
+                                int stidx, int cnt, const SearchCacheEntry& e,
+                                vector<UpSong>& entries)
 {
     const vector<UpSong>& res = e.m_results;
-    LOGDEB0("resultFromCacheEntry: filter " << classfilter << " start " <<
-            stidx << " cnt " << cnt << " res.size " << res.size() << endl);
-    entries.reserve(cnt);
+    LOGDEB0("resultFromCacheEntry: exp " << exp.dump() << " sort " <<
+            spec.canonical() << " start " << stidx << " cnt " << cnt <<
+            " res.size " << res.size() << endl);
+    const vector<unsigned int> *order = nullptr;
+    if (!spec.empty()) {
+        auto it = e.m_orders.find(spec.canonical());
+        if (it != e.m_orders.end()) {
+            order = &it->second;
+        }
+    }
+    if (stidx < 0) {
+        stidx = 0;
+    }
+    int avail = std::max(int(res.size()) - stidx, 0);
+    entries.reserve(cnt > 0 ? std::min(cnt, avail) : avail);
     int total = 0;
-    for (unsigned int i = 0; i < res.size(); i++) {
-        if (!classfilter.empty() && res[i].upnpClass.find(classfilter) != 0) {
+    for (unsigned int j = 0; j < res.size(); j++) {
+        unsigned int i = order ? (*order)[j] : j;
+        if (!exp.match(res[i])) {
             continue;
         }
         total++;
-        if (stidx > int(i)) {
+        if (stidx >= total) {
             continue;
         }
-        if (int(entries.size()) >= cnt) {
+        if (cnt > 0 && int(entries.size()) >= cnt) {
             continue;
         }
         LOGDEB1("resultFromCacheEntry: pushing class "  << res[i].upnpClass <<
@@ -477,84 +687,303 @@ int resultFromCacheEntry(const string& classfilter, int stidx, int cnt,
     return total;
 }
 
+// The slave failed or did not answer in time: return expired data
+// from the disk cache if it is there, else the error placeholder.
+static int staleOrError(PlgCache *diskcache, const string& key,
+                        const string& pid, const SearchExp& exp,
+                        const SortSpec& spec, int stidx, int cnt,
+                        vector<UpSong>& entries)
+{
+    SearchCacheEntry e;
+    if (diskcache && diskcache->get(key, 0, 0, e.m_results, true) >= 0) {
+        LOGINF("PlgWithSlave: service failure, returning stale data for " <<
+               key << endl);
+        sortCacheEntry(e, spec);
+        return resultFromCacheEntry(exp, spec, stidx, cnt, e, entries);
+    }
+    return errorEntries(pid, entries);
+}
+
+int PlgWithSlave::browse(const string& objid, int stidx, int cnt,
+                         vector<UpSong>& entries,
+                         const vector<string>& sortcrits,
+                         BrowseFlag flg)
+{
+    int total = dobrowse(objid, stidx, cnt, entries, sortcrits, flg);
+    m->rewriteArt(entries);
+    return total;
+}
+
+// The caches store the original art URLs, which are only rewritten
+// on output, so that they do not depend on the configuration or on
+// our address.
+int PlgWithSlave::dobrowse(const string& objid, int stidx, int cnt,
+                           vector<UpSong>& entries,
+                           const vector<string>& sortcrits,
+                           BrowseFlag flg)
+{
+    LOGDEB1("PlgWithSlave::browse\n");
+    entries.clear();
+    string sbflg;
+    switch (flg) {
+    case CDPlugin::BFMeta:
+        sbflg = "meta";
+        break;
+    case CDPlugin::BFChildren:
+    default:
+        sbflg = "children";
+        break;
+    }
+
+    // Sorting needs the whole set, which we then keep in the memory
+    // cache with the sort order, for paging.
+    SortSpec spec;
+    if (flg == CDPlugin::BFChildren) {
+        spec.parse(sortcrits);
+    }
+    string memkey(m_name + ":browse:" + objid);
+    if (!spec.empty()) {
+        SearchCacheEntry *cep;
+        if ((cep = o_scache.get(memkey)) != nullptr) {
+            if (sortCacheEntry(*cep, spec)) {
+                o_scache.set(memkey, *cep);
+            }
+            int total = resultFromCacheEntry(SearchExp(), spec, stidx, cnt,
+                                             *cep, entries);
+            delete cep;
+            return total;
+        }
+    }
+
+    // Try the disk cache first, this does not need the slave.
+    string cachekey("browse:" + sbflg + ":" + objid);
+    SearchCacheEntry e;
+    if (m->diskcache) {
+        if (spec.empty()) {
+            int total = m->diskcache->get(cachekey, stidx, cnt, entries);
+            if (total >= 0) {
+                return total;
+            }
+        } else if (m->diskcache->get(cachekey, 0, 0, e.m_results) >= 0) {
+            sortCacheEntry(e, spec);
+            o_scache.set(memkey, e);
+            return resultFromCacheEntry(SearchExp(), spec, stidx, cnt, e,
+                                        entries);
+        }
+    }
+
+    unordered_map<string, string> res;
+    if (!m->callproc("browse", {{"objid", objid}, {"flag", sbflg}}, res)) {
+	LOGERR("PlgWithSlave::browse: slave failure\n");
+	return staleOrError(m->diskcache, cachekey, objid, SearchExp(), spec,
+                            stidx, cnt, entries);
+    }
+
+    auto it = res.find("entries");
+    if (it == res.end()) {
+	LOGERR("PlgWithSlave::browse: no entries returned\n");
+        return errorEntries(objid, entries);
+    }
+    if (nullptr == m->diskcache && spec.empty()) {
+        return resultToEntries(it->second, stidx, cnt, entries);
+    }
+    resultToEntries(it->second, 0, 0, e.m_results);
+    if (m->diskcache) {
+        bool changed;
+        unsigned int updateid;
+        m->diskcache->put(cachekey, e.m_results, &changed, &updateid);
+        if (changed && flg == CDPlugin::BFChildren) {
+            // The container content is different from what we
+            // previously returned: let the control points know.
+            m_services->containerUpdated(this, objid, updateid);
+        }
+    }
+    if (spec.empty()) {
+        return sliceEntries(e.m_results, stidx, cnt, entries);
+    }
+    sortCacheEntry(e, spec);
+    o_scache.set(memkey, e);
+    return resultFromCacheEntry(SearchExp(), spec, stidx, cnt, e, entries);
+}
+
+// Information about a clause which the slave may evaluate.
+struct SlaveClause {
+    SearchExp *exp;
+    // True if the clause is on the 'and' path from the top: the
+    // expression can't be true if it is not.
+    bool required;
+};
+
+// Walk the tree, collecting the candidate clauses for the slave, and
+// the object class values which any result must have.
+static void collectClauses(SearchExp& exp, bool required,
+                           vector<SlaveClause>& clauses,
+                           vector<string>& classes)
+{
+    switch (exp.type) {
+    case SearchExp::SE_ALL:
+        return;
+    case SearchExp::SE_AND:
+    case SearchExp::SE_OR:
+        for (auto& sub : exp.subs) {
+            collectClauses(sub, required && exp.type == SearchExp::SE_AND,
+                           clauses, classes);
+        }
+        return;
+    case SearchExp::SE_REL:
+        break;
+    }
+    if (!exp.prop.compare("upnp:class")) {
+        if (required && (exp.op == SearchExp::OP_EQ ||
+                         exp.op == SearchExp::OP_DERIVEDFROM)) {
+            classes.push_back(exp.lvalue);
+        }
+    } else if (exp.op == SearchExp::OP_EQ ||
+               exp.op == SearchExp::OP_CONTAINS) {
+        clauses.push_back({&exp, required});
+    }
+}
+
+// Slave search field for an UPnP property. dc:title designates the
+// kind of object we are looking for (e.g. album title when searching
+// for albums).
+static string slaveFieldForProp(const string& prop, const string& target)
+{
+    if (!prop.compare("upnp:artist") || !prop.compare("dc:creator") ||
+        !prop.compare("dc:author") || !prop.compare("upnp:albumArtist")) {
+        return "artist";
+    } else if (!prop.compare("upnp:album")) {
+        return "album";
+    } else if (!prop.compare("dc:title")) {
+        return target.empty() ? "track" : target;
+    }
+    return string();
+}
+
+// Choose the clause which will be sent to the slave, which can only
+// process one field search. We prefer required clauses (else the
+// result may be incomplete), then a field matching the object class
+// wanted, then an equality test, then a longer value. The chosen
+// clause is marked as delegated: the slave results are assumed to
+// satisfy it, and the rest of the expression is evaluated locally.
+static bool pickSlaveClause(SearchExp& exp, string& slavefield, string& value)
+{
+    vector<SlaveClause> clauses;
+    vector<string> classes;
+    collectClauses(exp, true, clauses, classes);
+
+    string target;
+    for (const auto& cls : classes) {
+        if (cls.find("object.container.person") == 0) {
+            target = "artist";
+        } else if (cls.find("object.container.album") == 0) {
+            target = "album";
+        } else if (cls.find("object.item") == 0) {
+            target = "track";
+        }
+    }
+
+    SearchExp *best = nullptr;
+    int bestscore = -1;
+    for (auto& clause : clauses) {
+        string field = slaveFieldForProp(clause.exp->prop, target);
+        if (field.empty()) {
+            continue;
+        }
+        int score = (clause.required ? 100000 : 0) +
+            (!field.compare(target) ? 10000 : 0) +
+            (clause.exp->op == SearchExp::OP_EQ ? 1000 : 0) +
+            std::min(int(clause.exp->value.size()), 999);
+        if (score > bestscore) {
+            bestscore = score;
+            best = clause.exp;
+            slavefield = field;
+        }
+    }
+    if (nullptr == best) {
+        return false;
+    }
+    if (bestscore < 100000) {
+        LOGINF("PlgWithSlave::search: no required clause usable by the "
+               "slave, results may be incomplete\n");
+    }
+    best->delegated = true;
+    value = best->value;
+    return true;
+}
+
 int PlgWithSlave::search(const string& ctid, int stidx, int cnt,
                          const string& searchstr,
                          vector<UpSong>& entries,
                          const vector<string>& sortcrits)
+{
+    int total = dosearch(ctid, stidx, cnt, searchstr, entries, sortcrits);
+    m->rewriteArt(entries);
+    return total;
+}
+
+int PlgWithSlave::dosearch(const string& ctid, int stidx, int cnt,
+                           const string& searchstr,
+                           vector<UpSong>& entries,
+                           const vector<string>& sortcrits)
 {
     LOGDEB1("PlgWithSlave::search\n");
     entries.clear();
-    if (!m->maybeStartCmd()) {
-	return errorEntries(ctid, entries);
-    }
-
-    // Ok, so the upnp query language is quite powerful, but us, not
-    // so much. We get rid of parenthesis and then try to find the
-    // first searchExp on a field we can handle, pretend the operator
-    // is "contains" and just do it. I so don't want to implement a
-    // parser for the query language when the services don't support
-    // anything complicated anyway, and the users don't even want it...
-    string ss;
-    neutchars(searchstr, ss, "()");
-
-    // The search had better be space-separated. no
-    // upnp:artist="beatles" for you
-    vector<string> vs;
-    stringToStrings(ss, vs);
 
-    // The sequence can now be either [field, op, value], or
-    // [field, op, value, and/or, field, op, value,...]
-    if ((vs.size() + 1) % 4 != 0) {
+    SearchExp exp;
+    string reason;
+    if (!exp.parse(searchstr, &reason)) {
 	LOGERR("PlgWithSlave::search: bad search string: [" << searchstr <<
-               "]\n");
+               "]: " << reason << endl);
 	return errorEntries(ctid, entries);
     }
+
+    // The services only support a search on a single field. Send
+    // them the most selective clause, and evaluate the full
+    // expression on the results.
     string slavefield;
     string value;
-    string classfilter;
-    for (unsigned int i = 0; i < vs.size()-2; i += 4) {
-        const string& upnpproperty = vs[i];
-        LOGDEB("PlgWithSlave::search:clause: " << vs[i] << " " << vs[i+1] <<
-               " " << vs[i+2] << endl);
-        if (!upnpproperty.compare("upnp:artist") ||
-            !upnpproperty.compare("dc:author")) {
-            slavefield = "artist";
-            value = vs[i+2];
-            break;
-        } else if (!upnpproperty.compare("upnp:album")) {
-            slavefield = "album";
-            value = vs[i+2];
-            break;
-        } else if (!upnpproperty.compare("dc:title")) {
-            slavefield = "track";
-            value = vs[i+2];
-            break;
-        } else if (!upnpproperty.compare("upnp:class")) {
-            classfilter = vs[i+2];
-        }
-    }
-    if (slavefield.empty()) {
+    if (!pickSlaveClause(exp, slavefield, value)) {
         LOGERR("PlgWithSlave: unsupported search: [" << searchstr << "]\n");
         return errorEntries(ctid, entries);
     }
+    LOGDEB("PlgWithSlave::search: " << exp.dump() << " slave field " <<
+           slavefield << " value " << value << endl);
+
+    SortSpec spec;
+    spec.parse(sortcrits);
 
     // In cache ?
     SearchCacheEntry *cep;
     string cachekey(m_name + ":" + slavefield + ":" + value);
     if ((cep = o_scache.get(cachekey)) != nullptr) {
-        int total = resultFromCacheEntry(classfilter, stidx,cnt, *cep, entries);
+        if (sortCacheEntry(*cep, spec)) {
+            o_scache.set(cachekey, *cep);
+        }
+        int total = resultFromCacheEntry(exp, spec, stidx, cnt, *cep, entries);
         delete cep;
         return total;
     }
+    // In disk cache ? Then also put the results in the memory cache.
+    string diskkey("search:" + slavefield + ":" + value);
+    if (m->diskcache) {
+        SearchCacheEntry e;
+        if (m->diskcache->get(diskkey, 0, 0, e.m_results) >= 0) {
+            sortCacheEntry(e, spec);
+            o_scache.set(cachekey, e);
+            return resultFromCacheEntry(exp, spec, stidx, cnt, e, entries);
+        }
+    }
 
     // Run query
     unordered_map<string, string> res;
-    if (!m->cmd.callproc("search", {
+    if (!m->callproc("search", {
 		{"objid", ctid},
                 {"field", slavefield},
 		{"value", value} },  res)) {
 	LOGERR("PlgWithSlave::search: slave failure\n");
-	return errorEntries(ctid, entries);
+	return staleOrError(m->diskcache, diskkey, ctid, exp, spec,
+                            stidx, cnt, entries);
     }
 
     auto it = res.find("entries");
@@ -565,6 +994,10 @@ int PlgWithSlave::search(const string& ctid, int stidx, int cnt,
     // Convert the whole set and store in cache
     SearchCacheEntry e;
     resultToEntries(it->second, 0, 0, e.m_results);
+    sortCacheEntry(e, spec);
     o_scache.set(cachekey, e);
-    return resultFromCacheEntry(classfilter, stidx, cnt, e, entries);
+    if (m->diskcache) {
+        m->diskcache->put(diskkey, e.m_results);
+    }
+    return resultFromCacheEntry(exp, spec, stidx, cnt, e, entries);
 }
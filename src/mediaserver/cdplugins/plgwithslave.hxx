@@ -43,8 +43,17 @@ public:
 
     virtual std::string get_media_url(const std::string& path);
 
+    // Start the slave and have it log in to the service.
+    virtual bool startInit();
+
     class Internal;
 private:
+    int dobrowse(const std::string& objid, int stidx, int cnt,
+                 std::vector<UpSong>& entries,
+                 const std::vector<std::string>& sortcrits, BrowseFlag flg);
+    int dosearch(const std::string& ctid, int stidx, int cnt,
+                 const std::string& searchstr, std::vector<UpSong>& entries,
+                 const std::vector<std::string>& sortcrits);
     Internal *m;
 };
 
@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+# Copyright (C) 2016 J.F.Dockes
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the
+#   Free Software Foundation, Inc.,
+#   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+#
+"""
+Fetch an album art image for the media server art cache.
+
+Usage: artfetch.py <url> <outpath> <maxpixels> <timeoutsecs>
+
+The image is downscaled to fit in a maxpixels square if PIL is
+available and maxpixels is not 0, else it is stored as is. The exit
+status is 0 on success.
+"""
+from __future__ import print_function
+
+import sys
+import io
+
+try:
+    from urllib.request import urlopen
+except ImportError:
+    from urllib2 import urlopen
+
+try:
+    from PIL import Image
+except ImportError:
+    Image = None
+
+def downscale(data, maxpixels):
+    if Image is None or maxpixels <= 0:
+        return data
+    try:
+        img = Image.open(io.BytesIO(data))
+        if img.size[0] <= maxpixels and img.size[1] <= maxpixels:
+            return data
+        resample = getattr(Image, 'LANCZOS', None) or Image.ANTIALIAS
+        img.thumbnail((maxpixels, maxpixels), resample)
+        if img.mode != 'RGB':
+            img = img.convert('RGB')
+        out = io.BytesIO()
+        img.save(out, 'JPEG', quality=85)
+        return out.getvalue()
+    except Exception as err:
+        print("artfetch: can't downscale: %s" % err, file=sys.stderr)
+        return data
+
+def main(args):
+    if len(args) != 5:
+        print("Usage: artfetch.py <url> <outpath> <maxpixels> <timeoutsecs>",
+              file=sys.stderr)
+        return 1
+    url, outpath, maxpixels, timeout = args[1], args[2], int(args[3]), \
+                                       int(args[4])
+    try:
+        data = urlopen(url, timeout=timeout).read()
+    except Exception as err:
+        print("artfetch: %s: %s" % (url, err), file=sys.stderr)
+        return 1
+    if not data:
+        return 1
+    data = downscale(data, maxpixels)
+    with open(outpath, 'wb') as f:
+        f.write(data)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -82,6 +82,12 @@ def maybelogin():
 
     is_logged_in = session.login(username, password)
     
+@dispatcher.record('login')
+def login(a):
+    msgproc.log("login")
+    maybelogin()
+    return {'ok' : '1' if is_logged_in else '0'}
+
 @dispatcher.record('trackuri')
 def trackuri(a):
     global formatid, pathprefix
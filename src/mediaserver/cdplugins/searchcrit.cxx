@@ -0,0 +1,398 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "searchcrit.hxx"
+
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include "smallut.h"
+
+using namespace std;
+
+// Token types. Words are property names, operators, 'and', 'or',
+// booleans or unquoted values (which are not allowed by the grammar,
+// but we accept them).
+enum TokType {TT_WORD, TT_QUOTED, TT_OPEN, TT_CLOSE, TT_OP};
+struct SCToken {
+    TokType tp;
+    string val;
+};
+
+static bool tokenize(const string& in, vector<SCToken>& tokens, string& reason)
+{
+    string::size_type i = 0;
+    while (i < in.size()) {
+        char c = in[i];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            i++;
+        } else if (c == '(') {
+            tokens.push_back({TT_OPEN, "("});
+            i++;
+        } else if (c == ')') {
+            tokens.push_back({TT_CLOSE, ")"});
+            i++;
+        } else if (c == '"') {
+            string val;
+            i++;
+            for (;;) {
+                if (i >= in.size()) {
+                    reason = "unterminated quoted value";
+                    return false;
+                }
+                if (in[i] == '\\' && i + 1 < in.size()) {
+                    val += in[i+1];
+                    i += 2;
+                } else if (in[i] == '"') {
+                    i++;
+                    break;
+                } else {
+                    val += in[i++];
+                }
+            }
+            tokens.push_back({TT_QUOTED, val});
+        } else if (c == '=' || c == '!' || c == '<' || c == '>') {
+            string op(1, c);
+            if (i + 1 < in.size() && in[i+1] == '=') {
+                op += '=';
+            }
+            if (!op.compare("!")) {
+                reason = "bad operator !";
+                return false;
+            }
+            tokens.push_back({TT_OP, op});
+            i += op.size();
+        } else {
+            string::size_type e = in.find_first_of(" \t\n\r()\"=!<>", i);
+            if (e == string::npos) {
+                e = in.size();
+            }
+            tokens.push_back({TT_WORD, in.substr(i, e - i)});
+            i = e;
+        }
+    }
+    return true;
+}
+
+// Recursive descent parser:
+//   orexp := andexp ('or' andexp)*
+//   andexp := primary ('and' primary)*
+//   primary := '(' orexp ')' | relexp
+//   relexp := property op value
+class SCParser {
+public:
+    SCParser(const vector<SCToken>& t, string& r)
+        : tokens(t), reason(r), pos(0) {
+    }
+    bool atkeyword(const char *kw) {
+        return pos < tokens.size() && tokens[pos].tp == TT_WORD &&
+            !stringicmp(tokens[pos].val, kw);
+    }
+    bool orexp(SearchExp& out);
+    bool andexp(SearchExp& out);
+    bool primary(SearchExp& out);
+    bool relexp(SearchExp& out);
+
+    const vector<SCToken>& tokens;
+    string& reason;
+    unsigned int pos;
+};
+
+bool SCParser::orexp(SearchExp& out)
+{
+    SearchExp first;
+    if (!andexp(first)) {
+        return false;
+    }
+    if (!atkeyword("or")) {
+        out = first;
+        return true;
+    }
+    out = SearchExp();
+    out.type = SearchExp::SE_OR;
+    out.subs.push_back(first);
+    while (atkeyword("or")) {
+        pos++;
+        SearchExp next;
+        if (!andexp(next)) {
+            return false;
+        }
+        out.subs.push_back(next);
+    }
+    return true;
+}
+
+bool SCParser::andexp(SearchExp& out)
+{
+    SearchExp first;
+    if (!primary(first)) {
+        return false;
+    }
+    if (!atkeyword("and")) {
+        out = first;
+        return true;
+    }
+    out = SearchExp();
+    out.type = SearchExp::SE_AND;
+    out.subs.push_back(first);
+    while (atkeyword("and")) {
+        pos++;
+        SearchExp next;
+        if (!primary(next)) {
+            return false;
+        }
+        out.subs.push_back(next);
+    }
+    return true;
+}
+
+bool SCParser::primary(SearchExp& out)
+{
+    if (pos >= tokens.size()) {
+        reason = "unexpected end of expression";
+        return false;
+    }
+    if (tokens[pos].tp == TT_OPEN) {
+        pos++;
+        if (!orexp(out)) {
+            return false;
+        }
+        if (pos >= tokens.size() || tokens[pos].tp != TT_CLOSE) {
+            reason = "missing closing parenthesis";
+            return false;
+        }
+        pos++;
+        return true;
+    }
+    return relexp(out);
+}
+
+static const struct {
+    const char *name;
+    SearchExp::Op op;
+} scops[] = {
+    {"=", SearchExp::OP_EQ},
+    {"!=", SearchExp::OP_NE},
+    {"<", SearchExp::OP_LT},
+    {"<=", SearchExp::OP_LE},
+    {">", SearchExp::OP_GT},
+    {">=", SearchExp::OP_GE},
+    {"contains", SearchExp::OP_CONTAINS},
+    {"doesNotContain", SearchExp::OP_DOESNOTCONTAIN},
+    {"derivedfrom", SearchExp::OP_DERIVEDFROM},
+    {"exists", SearchExp::OP_EXISTS},
+};
+
+bool SCParser::relexp(SearchExp& out)
+{
+    if (pos + 3 > tokens.size()) {
+        reason = "incomplete clause";
+        return false;
+    }
+    const SCToken& tprop = tokens[pos];
+    const SCToken& top = tokens[pos+1];
+    const SCToken& tval = tokens[pos+2];
+    if (tprop.tp != TT_WORD) {
+        reason = "expected property name, got: " + tprop.val;
+        return false;
+    }
+    out = SearchExp();
+    out.type = SearchExp::SE_REL;
+    out.prop = tprop.val;
+    bool found = false;
+    if (top.tp == TT_OP || top.tp == TT_WORD) {
+        for (const auto& scop : scops) {
+            if (!stringicmp(top.val, scop.name)) {
+                out.op = scop.op;
+                found = true;
+                break;
+            }
+        }
+    }
+    if (!found) {
+        reason = "unknown operator: " + top.val;
+        return false;
+    }
+    if (tval.tp != TT_QUOTED && tval.tp != TT_WORD) {
+        reason = "expected value after " + top.val;
+        return false;
+    }
+    out.value = tval.val;
+    out.lvalue = stringtolower(tval.val);
+    if (out.op == SearchExp::OP_EXISTS && out.lvalue.compare("true") &&
+        out.lvalue.compare("false")) {
+        reason = "exists needs true or false";
+        return false;
+    }
+    pos += 3;
+    return true;
+}
+
+bool SearchExp::parse(const string& crit, string *reasonp)
+{
+    string reason;
+    vector<SCToken> tokens;
+    *this = SearchExp();
+    if (!tokenize(crit, tokens, reason)) {
+        goto fail;
+    }
+    if (tokens.empty() ||
+        (tokens.size() == 1 && tokens[0].tp == TT_WORD &&
+         !tokens[0].val.compare("*"))) {
+        type = SE_ALL;
+        return true;
+    }
+    {
+        SCParser parser(tokens, reason);
+        if (!parser.orexp(*this)) {
+            goto fail;
+        }
+        if (parser.pos != tokens.size()) {
+            reason = "unexpected: " + tokens[parser.pos].val;
+            goto fail;
+        }
+    }
+    return true;
+fail:
+    if (reasonp) {
+        *reasonp = reason;
+    }
+    *this = SearchExp();
+    return false;
+}
+
+string SearchExp::songProp(const UpSong& song, const string& prop)
+{
+    if (!prop.compare("dc:title")) {
+        return song.title;
+    } else if (!prop.compare("upnp:artist") || !prop.compare("dc:creator") ||
+               !prop.compare("dc:author") ||
+               !prop.compare("upnp:albumArtist")) {
+        return song.artist;
+    } else if (!prop.compare("upnp:album")) {
+        return song.album;
+    } else if (!prop.compare("upnp:genre")) {
+        return song.genre;
+    } else if (!prop.compare("upnp:class")) {
+        if (!song.upnpClass.empty()) {
+            return song.upnpClass;
+        }
+        return song.iscontainer ? "object.container" :
+            "object.item.audioItem.musicTrack";
+    } else if (!prop.compare("upnp:originalTrackNumber")) {
+        // tracknum is used for annotations in containers
+        return song.iscontainer ? string() : song.tracknum;
+    } else if (!prop.compare("@id")) {
+        return song.id;
+    } else if (!prop.compare("@parentID")) {
+        return song.parentid;
+    } else if (!prop.compare("res")) {
+        return song.uri;
+    } else if (!prop.compare("upnp:albumArtURI")) {
+        return song.artUri;
+    }
+    return string();
+}
+
+// Compare numerically if both values are integers, else as strings.
+static int valcmp(const string& v1, const string& v2)
+{
+    if (!v1.empty() && !v2.empty()) {
+        char *e1, *e2;
+        long l1 = strtol(v1.c_str(), &e1, 10);
+        long l2 = strtol(v2.c_str(), &e2, 10);
+        if (*e1 == 0 && *e2 == 0) {
+            return l1 < l2 ? -1 : (l1 > l2 ? 1 : 0);
+        }
+    }
+    return v1.compare(v2);
+}
+
+bool SearchExp::match(const UpSong& song) const
+{
+    switch (type) {
+    case SE_ALL:
+        return true;
+    case SE_AND:
+        for (const auto& sub : subs) {
+            if (!sub.match(song)) {
+                return false;
+            }
+        }
+        return true;
+    case SE_OR:
+        for (const auto& sub : subs) {
+            if (sub.match(song)) {
+                return true;
+            }
+        }
+        return false;
+    case SE_REL:
+        break;
+    }
+
+    if (delegated) {
+        return true;
+    }
+    string val = stringtolower(songProp(song, prop));
+    switch (op) {
+    case OP_EQ: return valcmp(val, lvalue) == 0;
+    case OP_NE: return valcmp(val, lvalue) != 0;
+    case OP_LT: return valcmp(val, lvalue) < 0;
+    case OP_LE: return valcmp(val, lvalue) <= 0;
+    case OP_GT: return valcmp(val, lvalue) > 0;
+    case OP_GE: return valcmp(val, lvalue) >= 0;
+    case OP_CONTAINS: return val.find(lvalue) != string::npos;
+    case OP_DOESNOTCONTAIN: return val.find(lvalue) == string::npos;
+    case OP_DERIVEDFROM:
+        return val.compare(0, lvalue.size(), lvalue) == 0 &&
+            (val.size() == lvalue.size() || val[lvalue.size()] == '.');
+    case OP_EXISTS: return val.empty() == !lvalue.compare("false");
+    }
+    return false;
+}
+
+string SearchExp::dump() const
+{
+    switch (type) {
+    case SE_ALL:
+        return "*";
+    case SE_AND:
+    case SE_OR: {
+        string out("(");
+        for (unsigned int i = 0; i < subs.size(); i++) {
+            if (i) {
+                out += type == SE_AND ? " and " : " or ";
+            }
+            out += subs[i].dump();
+        }
+        return out + ")";
+    }
+    case SE_REL:
+        break;
+    }
+    string sop;
+    for (const auto& scop : scops) {
+        if (scop.op == op) {
+            sop = scop.name;
+            break;
+        }
+    }
+    return prop + " " + sop + " \"" + value + "\"" +
+        (delegated ? string("[D]") : string());
+}
@@ -0,0 +1,75 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _SEARCHCRIT_H_INCLUDED_
+#define _SEARCHCRIT_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+#include "upmpdutils.hxx"
+
+/// Expression tree for an UPnP ContentDirectory SearchCriteria string.
+///
+/// This implements the grammar from the ContentDirectory:1
+/// specification: relational clauses (=, !=, <, <=, >, >=, contains,
+/// doesNotContain, derivedfrom, exists) combined with 'and' (which
+/// has precedence) and 'or', with parentheses, double-quoted values
+/// with \" and \\ escapes, and the '*' wildcard.
+///
+/// The tree can be evaluated against UpSong entries. String
+/// comparisons are case-insensitive (ASCII only).
+class SearchExp {
+public:
+    enum Type {SE_ALL, SE_REL, SE_AND, SE_OR};
+    enum Op {OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_CONTAINS,
+             OP_DOESNOTCONTAIN, OP_DERIVEDFROM, OP_EXISTS};
+
+    SearchExp()
+        : type(SE_ALL), op(OP_EQ), delegated(false) {
+    }
+
+    /// Parse a SearchCriteria string into this. Returns false and
+    /// sets reason if the string is not syntactically correct.
+    bool parse(const std::string& crit, std::string *reason = 0);
+
+    /// Evaluate the expression for an entry.
+    bool match(const UpSong& song) const;
+
+    std::string dump() const;
+
+    /// Value of an UPnP property for an entry, empty if the property
+    /// is unknown or not set. The class is set to the default which
+    /// would be used in the DIDL output if the entry has none.
+    static std::string songProp(const UpSong& song, const std::string& prop);
+
+    Type type;
+
+    // Relational clause data.
+    Op op;
+    std::string prop;
+    std::string value;
+    // Lowercased value, for comparisons
+    std::string lvalue;
+    // Set by a search backend on a clause which it evaluated
+    // itself. match() considers it true.
+    bool delegated;
+
+    // Operands for SE_AND and SE_OR.
+    std::vector<SearchExp> subs;
+};
+
+#endif /* _SEARCHCRIT_H_INCLUDED_ */
@@ -0,0 +1,144 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "sortcrit.hxx"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+#include "searchcrit.hxx"
+#include "smallut.h"
+
+using namespace std;
+
+static const string sortcaps(
+    "dc:title,upnp:artist,upnp:album,upnp:originalTrackNumber");
+
+const string& SortSpec::capabilities()
+{
+    return sortcaps;
+}
+
+string SortSpec::collationKey(const UpSong& song, const string& prop)
+{
+    string val = SearchExp::songProp(song, prop);
+    if (!prop.compare("upnp:originalTrackNumber")) {
+        if (val.empty()) {
+            // Sort after the numbered tracks
+            return "~";
+        }
+        char buf[30];
+        sprintf(buf, "%010ld", atol(val.c_str()));
+        return buf;
+    }
+    stringtolower(val);
+    return val;
+}
+
+const vector<string>& SortKeys::get(const vector<UpSong>& entries,
+                                    const string& prop)
+{
+    auto it = m_keys.find(prop);
+    if (it != m_keys.end() && it->second.size() == entries.size()) {
+        return it->second;
+    }
+    vector<string>& keys = m_keys[prop];
+    keys.clear();
+    keys.reserve(entries.size());
+    for (const auto& entry : entries) {
+        keys.push_back(SortSpec::collationKey(entry, prop));
+    }
+    return keys;
+}
+
+void SortSpec::parse(const vector<string>& crits)
+{
+    m_crits.clear();
+    for (auto crit : crits) {
+        trimstring(crit);
+        if (crit.empty()) {
+            continue;
+        }
+        bool ascending = true;
+        if (crit[0] == '+' || crit[0] == '-') {
+            ascending = crit[0] == '+';
+            crit = crit.substr(1);
+        }
+        vector<string> caps;
+        stringToTokens(sortcaps, caps, ",");
+        if (find(caps.begin(), caps.end(), crit) == caps.end()) {
+            LOGDEB("SortSpec::parse: ignoring unsupported " << crit << endl);
+            continue;
+        }
+        m_crits.push_back({crit, ascending});
+    }
+}
+
+string SortSpec::canonical() const
+{
+    string out;
+    for (const auto& crit : m_crits) {
+        if (!out.empty()) {
+            out += ",";
+        }
+        out += (crit.ascending ? "+" : "-") + crit.prop;
+    }
+    return out;
+}
+
+void SortSpec::sort(const vector<UpSong>& entries, SortKeys& keys,
+                    vector<unsigned int>& order) const
+{
+    order.resize(entries.size());
+    for (unsigned int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    vector<const vector<string>*> vkeys;
+    for (const auto& crit : m_crits) {
+        vkeys.push_back(&keys.get(entries, crit.prop));
+    }
+    stable_sort(order.begin(), order.end(),
+                [this, &vkeys](unsigned int a, unsigned int b) {
+                    for (unsigned int i = 0; i < m_crits.size(); i++) {
+                        int c = (*vkeys[i])[a].compare((*vkeys[i])[b]);
+                        if (c != 0) {
+                            return m_crits[i].ascending ? c < 0 : c > 0;
+                        }
+                    }
+                    return false;
+                });
+}
+
+void SortSpec::sort(vector<UpSong>& entries) const
+{
+    if (empty()) {
+        return;
+    }
+    SortKeys keys;
+    vector<unsigned int> order;
+    sort(entries, keys, order);
+    vector<UpSong> sorted;
+    sorted.reserve(entries.size());
+    for (auto i : order) {
+        sorted.push_back(entries[i]);
+    }
+    entries.swap(sorted);
+}
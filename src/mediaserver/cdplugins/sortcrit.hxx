@@ -0,0 +1,79 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _SORTCRIT_H_INCLUDED_
+#define _SORTCRIT_H_INCLUDED_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "upmpdutils.hxx"
+
+/// Collation keys for a result set, computed once per property and
+/// kept with the results, so that sorting the same set again (e.g.
+/// in the other direction, or on several fields) does not need to
+/// recompute them.
+class SortKeys {
+public:
+    /// Return the keys for prop, one per entry, computing them if needed.
+    const std::vector<std::string>& get(const std::vector<UpSong>& entries,
+                                        const std::string& prop);
+    void clear() {
+        m_keys.clear();
+    }
+private:
+    std::unordered_map<std::string, std::vector<std::string> > m_keys;
+};
+
+/// Sort specification from a ContentDirectory SortCriteria list
+/// ("+dc:title", "-upnp:artist"...).
+class SortSpec {
+public:
+    struct Crit {
+        std::string prop;
+        bool ascending;
+    };
+
+    /// Parse the criteria. Unsupported properties are ignored.
+    void parse(const std::vector<std::string>& crits);
+    bool empty() const {
+        return m_crits.empty();
+    }
+    /// Normalized string form, usable as a cache key.
+    std::string canonical() const;
+
+    /// Compute the sorted order (indices into entries). The sort is
+    /// stable: the service order is kept for equal keys.
+    void sort(const std::vector<UpSong>& entries, SortKeys& keys,
+              std::vector<unsigned int>& order) const;
+
+    /// Sort a vector in place.
+    void sort(std::vector<UpSong>& entries) const;
+
+    /// The properties we can sort on, as returned by GetSortCapabilities.
+    static const std::string& capabilities();
+
+    /// Collation key for an entry property: case-folded string, or
+    /// zero-padded number for the track number.
+    static std::string collationKey(const UpSong& song,
+                                    const std::string& prop);
+
+private:
+    std::vector<Crit> m_crits;
+};
+
+#endif /* _SORTCRIT_H_INCLUDED_ */
@@ -103,6 +103,12 @@ def get_mimeandkbs():
     else:
         return ('audio/mpeg', str(96))
 
+@dispatcher.record('login')
+def login(a):
+    msgproc.log("login")
+    maybelogin()
+    return {'ok' : '1' if is_logged_in else '0'}
+
 @dispatcher.record('trackuri')
 def trackuri(a):
     msgproc.log("trackuri: [%s]" % a)
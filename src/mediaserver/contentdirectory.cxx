@@ -18,12 +18,18 @@
 #include "contentdirectory.hxx"
 
 #include <upnp/upnp.h>
+#include <stdlib.h>
 
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <thread>
 #include <utility>
 #include <unordered_map>
+#include <unordered_set>
 #include <sstream>
 
 #include "libupnpp/log.hxx"
@@ -35,6 +41,9 @@
 #include "upmpdutils.hxx"
 #include "main.hxx"
 #include "cdplugins/plgwithslave.hxx"
+#include "cdplugins/searchcrit.hxx"
+#include "cdplugins/sortcrit.hxx"
+#include "itemindex.hxx"
 #include "conftree.h"
 
 using namespace std;
@@ -44,12 +53,19 @@ using namespace UPnPProvider;
 class ContentDirectory::Internal {
 public:
     Internal (ContentDirectory *sv)
-	: service(sv), updateID("1") {
+	: service(sv), systemUpdateID(1), index(nullptr) {
     }
     ~Internal() {
+        for (auto& thr : initthreads) {
+            thr.join();
+        }
 	for (auto& it : plugins) {
 	    delete it.second;
 	}
+        if (index) {
+            LOGINF("ContentDirectory: local index: " << index->report() << endl);
+            delete index;
+        }
     }
     CDPlugin *pluginFactory(const string& appname) {
 	LOGDEB("ContentDirectory::pluginFactory: for " << appname << endl);
@@ -71,6 +87,7 @@ public:
         return new PlgWithSlave(appname, service);
     }
     CDPlugin *pluginForApp(const string& appname) {
+        std::unique_lock<std::mutex> lock(plgmutex);
 	auto it = plugins.find(appname);
 	if (it != plugins.end()) {
 	    return it->second;
@@ -82,13 +99,71 @@ public:
 	    return plug;
 	}
     }
+    // Start the initialization of all the configured plugins in
+    // parallel, in the background.
+    void startInit(const vector<string>& apps) {
+        for (const auto& app : apps) {
+            initpending[app] = true;
+        }
+        for (const auto& app : apps) {
+            initthreads.push_back(
+                std::thread(&Internal::initWorker, this, app));
+        }
+    }
+    void initWorker(string app) {
+        auto start = std::chrono::steady_clock::now();
+        CDPlugin *plg = pluginForApp(app);
+        bool ok = plg && plg->startInit();
+        int ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        LOGINF("ContentDirectory: " << app << " initialization " <<
+               (ok ? "done" : "failed") << " in " << ms << " mS\n");
+        std::unique_lock<std::mutex> lock(initmutex);
+        initpending[app] = false;
+        initcv.notify_all();
+    }
+    // Wait for the plugin initialization if it is in progress.
+    void waitInit(const string& app) {
+        std::unique_lock<std::mutex> lock(initmutex);
+        auto it = initpending.find(app);
+        if (it == initpending.end() || !it->second) {
+            return;
+        }
+        LOGDEB("ContentDirectory: waiting for " << app << " initialization\n");
+        while (initpending[app]) {
+            initcv.wait(lock);
+        }
+    }
+
+    string getSystemUpdateID() {
+        std::unique_lock<std::mutex> lock(updatemutex);
+        return ulltodecstr(systemUpdateID);
+    }
+
     unordered_map<string, CDPlugin *> plugins;
+    std::mutex plgmutex;
+    // Background initialization state: true while in progress.
+    unordered_map<string, bool> initpending;
+    std::mutex initmutex;
+    std::condition_variable initcv;
+    vector<std::thread> initthreads;
     ContentDirectory *service;
     string host;
     int port;
-    string updateID;
+    // Incremented each time a container change is signalled.
+    unsigned int systemUpdateID;
+    // Containers changed since the last event: objid -> update id
+    unordered_map<string, unsigned int> pendingupdates;
+    std::mutex updatemutex;
+    // Local index of the objects seen in browse/search results, or
+    // null if disabled.
+    ItemIndex *index;
 };
 
+static vector<UpSong> rootdir;
+static bool makerootdir();
+static string appForId(const string& id);
+
 static const string
 sTpContentDirectory("urn:schemas-upnp-org:service:ContentDirectory:1");
 static const string
@@ -113,6 +188,29 @@ ContentDirectory::ContentDirectory(UPnPProvider::UpnpDevice *dev)
     dev->addActionMapping(
         this, "Search",
         bind(&ContentDirectory::actSearch, this, _1, _2));
+
+    int maxitems = 50000;
+    string value;
+    if (g_config && g_config->get("msindexmaxitems", value)) {
+        maxitems = atoi(value.c_str());
+    }
+    if (maxitems > 0) {
+        m->index = new ItemIndex(maxitems);
+    }
+
+    // Start the plugins now, so that the first access does not have
+    // to wait for the service login.
+    if (rootdir.empty()) {
+        makerootdir();
+    }
+    vector<string> apps;
+    for (const auto& entry : rootdir) {
+        string app = appForId(entry.id);
+        if (!app.empty() && app.compare("none")) {
+            apps.push_back(app);
+        }
+    }
+    m->startInit(apps);
 }
 
 ContentDirectory::~ContentDirectory()
@@ -134,7 +232,7 @@ int ContentDirectory::actGetSortCapabilities(const SoapIncoming& sc, SoapOutgoin
 {
     LOGDEB("ContentDirectory::actGetSortCapabilities: " << endl);
 
-    std::string out_SortCaps;
+    std::string out_SortCaps(SortSpec::capabilities());
     data.addarg("SortCaps", out_SortCaps);
     return UPNP_E_SUCCESS;
 }
@@ -143,12 +241,11 @@ int ContentDirectory::actGetSystemUpdateID(const SoapIncoming& sc, SoapOutgoing&
 {
     LOGDEB("ContentDirectory::actGetSystemUpdateID: " << endl);
 
-    std::string out_Id = m->updateID;
+    std::string out_Id = m->getSystemUpdateID();
     data.addarg("Id", out_Id);
     return UPNP_E_SUCCESS;
 }
 
-static vector<UpSong> rootdir;
 static bool makerootdir()
 {
     rootdir.clear();
@@ -234,6 +331,15 @@ static string appForId(const string& id)
     return id.substr(dol0 + 1, dol1 - dol0 -1);
 }
 
+// The plugins return a single "$bogus" entry when the service can't
+// be reached.
+static bool isErrorResult(const vector<UpSong>& entries)
+{
+    return entries.size() == 1 &&
+        entries[0].id.size() > 6 &&
+        !entries[0].id.compare(entries[0].id.size() - 6, 6, "$bogus");
+}
+
 // Really preposterous: bubble (and maybe others) searches in root,
 // but we can't do this. So memorize the last browsed object ID and
 // use this as a replacement when root search is requested. Forget
@@ -290,7 +396,7 @@ int ContentDirectory::actBrowse(const SoapIncoming& sc, SoapOutgoing& data)
     last_objid = in_ObjectID;
     
     vector<string> sortcrits;
-    stringToStrings(in_SortCriteria, sortcrits);
+    stringToTokens(in_SortCriteria, sortcrits, ",");
 
     CDPlugin::BrowseFlag bf;
     if (!in_BrowseFlag.compare("BrowseMetadata")) {
@@ -312,11 +418,15 @@ int ContentDirectory::actBrowse(const SoapIncoming& sc, SoapOutgoing& data)
     } else {
 	// Pass off request to appropriate app, defined by 1st elt in id
 	string app = appForId(in_ObjectID);
+        m->waitInit(app);
 	CDPlugin *plg = m->pluginForApp(app);
 	if (plg) {
 	    totalmatches = plg->browse(in_ObjectID, in_StartingIndex,
                                        in_RequestedCount, entries,
                                        sortcrits, bf);
+            if (m->index && !isErrorResult(entries)) {
+                m->index->add(entries);
+            }
 	} else {
 	    LOGERR("ContentDirectory::Browse: unknown app: [" << app << "]\n");
             return UPNP_E_INVALID_PARAM;
@@ -324,12 +434,13 @@ int ContentDirectory::actBrowse(const SoapIncoming& sc, SoapOutgoing& data)
     }
 
     // Process and send out result
+    unsigned int didlprops = UpSong::didlFilter(in_Filter);
     out_NumberReturned = ulltodecstr(entries.size());
     out_TotalMatches = ulltodecstr(totalmatches);
-    out_UpdateID = m->updateID;
+    out_UpdateID = m->getSystemUpdateID();
     out_Result = headDIDL();
     for (unsigned int i = 0; i < entries.size(); i++) {
-	out_Result += entries[i].didl();
+	out_Result += entries[i].didl(didlprops);
     } 
     out_Result += tailDIDL();
     LOGDEB1("ContentDirectory::Browse: didl: " << out_Result << endl);
@@ -342,6 +453,70 @@ int ContentDirectory::actBrowse(const SoapIncoming& sc, SoapOutgoing& data)
     return UPNP_E_SUCCESS;
 }
 
+// Search the local index, and add the objects which the service did
+// not return after the remote results. If the service failed, the
+// local results are returned alone. Returns the new total.
+size_t ContentDirectory::mergeLocal(CDPlugin *plg, const string& app,
+                                    const string& ctid, int stidx, int cnt,
+                                    const string& crit,
+                                    const vector<string>& sortcrits,
+                                    vector<UpSong>& entries, size_t total)
+{
+    SearchExp exp;
+    if (!exp.parse(crit)) {
+        return total;
+    }
+    vector<UpSong> local;
+    m->index->search(exp, "0$" + app + "$", local);
+    LOGDEB0("ContentDirectory::actSearch: local index: " <<
+            m->index->report() << endl);
+
+    bool remoteok = !isErrorResult(entries);
+    if (remoteok) {
+        m->index->add(entries);
+    }
+    if (local.empty()) {
+        return total;
+    }
+
+    vector<UpSong> remote;
+    if (!remoteok) {
+        LOGINF("ContentDirectory::actSearch: service failed, returning " <<
+               local.size() << " results from the local index\n");
+        m->index->noteOffline();
+        entries.clear();
+        total = 0;
+    } else if (stidx == 0 && entries.size() >= total) {
+        remote = entries;
+    } else {
+        // Need the complete remote list to eliminate duplicates. The
+        // plugin caches it, so this is cheap.
+        plg->search(ctid, 0, total, crit, remote, sortcrits);
+    }
+    unordered_set<string> remoteids;
+    for (const auto& entry : remote) {
+        remoteids.insert(entry.id);
+    }
+    vector<UpSong> extra;
+    for (auto& entry : local) {
+        if (remoteids.find(entry.id) == remoteids.end()) {
+            extra.push_back(entry);
+        }
+    }
+    SortSpec spec;
+    spec.parse(sortcrits);
+    spec.sort(extra);
+
+    // The extra objects come after the remote ones: append the part
+    // which falls into the requested window.
+    size_t xstart = size_t(stidx) > total ? stidx - total : 0;
+    for (size_t i = xstart; i < extra.size() &&
+             (cnt <= 0 || int(entries.size()) < cnt); i++) {
+        entries.push_back(extra[i]);
+    }
+    return total + extra.size();
+}
+
 int ContentDirectory::actSearch(const SoapIncoming& sc, SoapOutgoing& data)
 {
     bool ok = false;
@@ -390,7 +565,7 @@ int ContentDirectory::actSearch(const SoapIncoming& sc, SoapOutgoing& data)
 	   " SortCriteria " << in_SortCriteria << endl);
 
     vector<string> sortcrits;
-    stringToStrings(in_SortCriteria, sortcrits);
+    stringToTokens(in_SortCriteria, sortcrits, ",");
 
     std::string out_Result;
     std::string out_NumberReturned = "0";
@@ -411,6 +586,7 @@ int ContentDirectory::actSearch(const SoapIncoming& sc, SoapOutgoing& data)
 
     // Pass off request to appropriate app, defined by 1st elt in id
     string app = appForId(in_ContainerID);
+    m->waitInit(app);
     CDPlugin *plg = m->pluginForApp(app);
     if (plg) {
         totalmatches = plg->search(in_ContainerID, in_StartingIndex,
@@ -420,14 +596,20 @@ int ContentDirectory::actSearch(const SoapIncoming& sc, SoapOutgoing& data)
         LOGERR("ContentDirectory::Search: unknown app: [" << app << "]\n");
         return UPNP_E_INVALID_PARAM;
     }
+    if (m->index) {
+        totalmatches = mergeLocal(plg, app, in_ContainerID, in_StartingIndex,
+                                  in_RequestedCount, in_SearchCriteria,
+                                  sortcrits, entries, totalmatches);
+    }
 
     // Process and send out result
+    unsigned int didlprops = UpSong::didlFilter(in_Filter);
     out_NumberReturned = ulltodecstr(entries.size());
     out_TotalMatches = ulltodecstr(totalmatches);
-    out_UpdateID = m->updateID;
+    out_UpdateID = m->getSystemUpdateID();
     out_Result = headDIDL();
     for (unsigned int i = 0; i < entries.size(); i++) {
-	out_Result += entries[i].didl();
+	out_Result += entries[i].didl(didlprops);
     } 
     out_Result += tailDIDL();
     
@@ -468,6 +650,7 @@ static string firstpathelt(const string& path)
 CDPlugin *ContentDirectory::getpluginforpath(const string& path)
 {
     string app = firstpathelt(path);
+    m->waitInit(app);
     return m->pluginForApp(app);
 }
 
@@ -509,6 +692,54 @@ ConfSimple *ContentDirectory::getconfig(CDPlugin *)
 }
 
 
+void ContentDirectory::containerUpdated(CDPlugin *, const string& objid,
+                                        unsigned int updateid)
+{
+    LOGDEB("ContentDirectory::containerUpdated: " << objid << " -> " <<
+           updateid << endl);
+    {
+        std::unique_lock<std::mutex> lock(m->updatemutex);
+        m->systemUpdateID++;
+        m->pendingupdates[objid] = updateid;
+    }
+    getDevice()->loopWakeup();
+}
+
+// The device event loop calls this periodically (and on
+// loopWakeup()). The changes are accumulated between calls, so the
+// event rate is naturally moderated.
+bool ContentDirectory::getEventData(bool all, vector<string>& names,
+                                    vector<string>& values)
+{
+    std::unique_lock<std::mutex> lock(m->updatemutex);
+    if (!all && m->pendingupdates.empty()) {
+        return true;
+    }
+    // ContainerUpdateIDs is a list of "id,updateid" pairs, also
+    // separated by commas. Commas inside ids must be escaped.
+    string cuids;
+    if (!all) {
+        for (const auto& ent : m->pendingupdates) {
+            if (!cuids.empty()) {
+                cuids += ",";
+            }
+            for (auto c : ent.first) {
+                if (c == ',' || c == '\\') {
+                    cuids += '\\';
+                }
+                cuids += c;
+            }
+            cuids += "," + ulltodecstr(ent.second);
+        }
+        m->pendingupdates.clear();
+    }
+    names.push_back("SystemUpdateID");
+    values.push_back(ulltodecstr(m->systemUpdateID));
+    names.push_back("ContainerUpdateIDs");
+    values.push_back(cuids);
+    return true;
+}
+
 std::string ContentDirectory::getexecpath(CDPlugin *plg)
 {
     string pth = path_cat(g_datadir, "cdplugins");
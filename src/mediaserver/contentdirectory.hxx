@@ -53,6 +53,14 @@ public:
     virtual ConfSimple *getconfig(CDPlugin *);
     virtual std::string getexecpath(CDPlugin *);
 
+    /// Record a container change, to be evented through
+    /// ContainerUpdateIDs and SystemUpdateID.
+    virtual void containerUpdated(CDPlugin *, const std::string& objid,
+                                  unsigned int updateid);
+
+    virtual bool getEventData(bool all, std::vector<std::string>& names,
+                              std::vector<std::string>& values);
+
     /// Check if the configuration indicates that the media server needs to be started.
     static bool mediaServerNeeded();
     
@@ -62,6 +70,11 @@ private:
     int actGetSystemUpdateID(const SoapIncoming& sc, SoapOutgoing& data);
     int actBrowse(const SoapIncoming& sc, SoapOutgoing& data);
     int actSearch(const SoapIncoming& sc, SoapOutgoing& data);
+    size_t mergeLocal(CDPlugin *plg, const std::string& app,
+                      const std::string& ctid, int stidx, int cnt,
+                      const std::string& crit,
+                      const std::vector<std::string>& sortcrits,
+                      std::vector<UpSong>& entries, size_t total);
 
     class Internal;
     Internal *m;
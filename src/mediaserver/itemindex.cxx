@@ -0,0 +1,290 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "itemindex.hxx"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+#include "cdplugins/searchcrit.hxx"
+
+using namespace std;
+
+// Posting list for a word: object numbers in increasing order,
+// stored as variable-length deltas (7 bits per byte, high bit set on
+// all bytes but the last).
+struct Posting {
+    Posting() : last(0), count(0) {}
+    string data;
+    uint32_t last;
+    uint32_t count;
+
+    void add(uint32_t docid) {
+        if (count == 0 || docid > last) {
+            append(docid);
+            return;
+        }
+        if (docid == last) {
+            return;
+        }
+        // Updated object with a new word: rare, rebuild the list.
+        vector<uint32_t> docs;
+        decode(docs);
+        auto it = lower_bound(docs.begin(), docs.end(), docid);
+        if (it != docs.end() && *it == docid) {
+            return;
+        }
+        docs.insert(it, docid);
+        data.clear();
+        count = 0;
+        for (auto d : docs) {
+            append(d);
+        }
+    }
+
+    void append(uint32_t docid) {
+        uint32_t delta = count ? docid - last : docid;
+        while (delta >= 0x80) {
+            data += char((delta & 0x7f) | 0x80);
+            delta >>= 7;
+        }
+        data += char(delta);
+        last = docid;
+        count++;
+    }
+
+    void decode(vector<uint32_t>& out) const {
+        uint32_t docid = 0;
+        uint32_t val = 0;
+        int shift = 0;
+        bool first = true;
+        for (unsigned int i = 0; i < data.size(); i++) {
+            unsigned char c = data[i];
+            val |= uint32_t(c & 0x7f) << shift;
+            if (c & 0x80) {
+                shift += 7;
+                continue;
+            }
+            docid = first ? val : docid + val;
+            first = false;
+            out.push_back(docid);
+            val = 0;
+            shift = 0;
+        }
+    }
+};
+
+class ItemIndex::Internal {
+public:
+    Internal(int mx)
+        : maxitems(mx), queries(0), hits(0), offline(0) {
+    }
+
+    // Split a value into lowercased words. Bytes >= 0x80 (UTF-8
+    // sequences) are considered as word characters.
+    static void words(const string& in, vector<string>& out) {
+        string word;
+        for (unsigned int i = 0; i <= in.size(); i++) {
+            unsigned char c = i < in.size() ? in[i] : 0;
+            if (c >= 0x80 || (c >= '0' && c <= '9') ||
+                (c >= 'a' && c <= 'z')) {
+                word += char(c);
+            } else if (c >= 'A' && c <= 'Z') {
+                word += char(c + 'a' - 'A');
+            } else if (!word.empty()) {
+                out.push_back(word);
+                word.clear();
+            }
+        }
+    }
+
+    // Union of the postings for all words beginning with prefix.
+    void prefixDocs(const string& prefix, vector<uint32_t>& out) {
+        out.clear();
+        for (auto it = vocab.lower_bound(prefix);
+             it != vocab.end() && it->first.compare(0, prefix.size(),
+                                                    prefix) == 0; it++) {
+            it->second.decode(out);
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    }
+
+    void collectWords(const SearchExp& exp, vector<string>& out) {
+        switch (exp.type) {
+        case SearchExp::SE_ALL:
+        case SearchExp::SE_OR:
+            // Nothing mandatory in an 'or'
+            return;
+        case SearchExp::SE_AND:
+            for (const auto& sub : exp.subs) {
+                collectWords(sub, out);
+            }
+            return;
+        case SearchExp::SE_REL:
+            break;
+        }
+        if (exp.op != SearchExp::OP_EQ && exp.op != SearchExp::OP_CONTAINS) {
+            return;
+        }
+        if (!exp.prop.compare("dc:title") ||
+            !exp.prop.compare("upnp:artist") ||
+            !exp.prop.compare("dc:creator") ||
+            !exp.prop.compare("dc:author") ||
+            !exp.prop.compare("upnp:albumArtist") ||
+            !exp.prop.compare("upnp:album")) {
+            vector<string> vw;
+            words(exp.value, vw);
+            out.insert(out.end(), vw.begin(), vw.end());
+        }
+    }
+
+    int maxitems;
+    vector<UpSong> items;
+    unordered_map<string, uint32_t> idmap;
+    map<string, Posting> vocab;
+    int queries;
+    int hits;
+    int offline;
+    std::mutex mutex;
+};
+
+ItemIndex::ItemIndex(int maxitems)
+    : m(new Internal(maxitems))
+{
+}
+
+ItemIndex::~ItemIndex()
+{
+    delete m;
+}
+
+void ItemIndex::add(const vector<UpSong>& entries)
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    for (const auto& entry : entries) {
+        if (entry.id.empty()) {
+            continue;
+        }
+        uint32_t docid;
+        auto it = m->idmap.find(entry.id);
+        if (it != m->idmap.end()) {
+            docid = it->second;
+            m->items[docid] = entry;
+        } else {
+            if (int(m->items.size()) >= m->maxitems) {
+                continue;
+            }
+            docid = m->items.size();
+            m->items.push_back(entry);
+            m->idmap[entry.id] = docid;
+        }
+        vector<string> vw;
+        Internal::words(entry.title, vw);
+        Internal::words(entry.artist, vw);
+        Internal::words(entry.album, vw);
+        for (const auto& word : vw) {
+            m->vocab[word].add(docid);
+        }
+    }
+}
+
+int ItemIndex::search(const SearchExp& exp, const string& idprefix,
+                      vector<UpSong>& out)
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    m->queries++;
+
+    vector<string> vw;
+    m->collectWords(exp, vw);
+
+    // Candidates: intersection of the word postings, or all objects
+    // if there is no usable word.
+    vector<uint32_t> cands;
+    if (vw.empty()) {
+        cands.resize(m->items.size());
+        for (unsigned int i = 0; i < cands.size(); i++) {
+            cands[i] = i;
+        }
+    } else {
+        vector<uint32_t> docs, tmp;
+        for (unsigned int i = 0; i < vw.size(); i++) {
+            m->prefixDocs(vw[i], docs);
+            if (i == 0) {
+                cands.swap(docs);
+            } else {
+                tmp.clear();
+                set_intersection(cands.begin(), cands.end(),
+                                 docs.begin(), docs.end(),
+                                 back_inserter(tmp));
+                cands.swap(tmp);
+            }
+            if (cands.empty()) {
+                break;
+            }
+        }
+    }
+
+    int cnt = 0;
+    for (auto docid : cands) {
+        const UpSong& song = m->items[docid];
+        if (song.id.compare(0, idprefix.size(), idprefix) == 0 &&
+            exp.match(song)) {
+            out.push_back(song);
+            cnt++;
+        }
+    }
+    if (cnt) {
+        m->hits++;
+    }
+    LOGDEB1("ItemIndex::search: " << exp.dump() << " words " << vw.size() <<
+            " candidates " << cands.size() << " found " << cnt << endl);
+    return cnt;
+}
+
+void ItemIndex::noteOffline()
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    m->offline++;
+}
+
+string ItemIndex::report()
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    size_t postbytes = 0;
+    for (const auto& ent : m->vocab) {
+        postbytes += ent.first.size() + ent.second.data.size();
+    }
+    ostringstream str;
+    str << "objects " << m->items.size() << " words " << m->vocab.size() <<
+        " postings bytes " << postbytes << " searches " << m->queries <<
+        " hits " << m->hits;
+    if (m->queries) {
+        str << " (" << (100 * m->hits) / m->queries << "%)";
+    }
+    str << " offline " << m->offline;
+    return str.str();
+}
@@ -0,0 +1,68 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _ITEMINDEX_H_INCLUDED_
+#define _ITEMINDEX_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+#include "upmpdutils.hxx"
+
+class SearchExp;
+
+/// In-memory inverted index over the media server objects which we
+/// have seen in browse or search results.
+///
+/// The title, artist and album values are split into lowercased
+/// words, and each word has a posting list of object numbers, stored
+/// as variable-length deltas. A search uses the words from the
+/// mandatory title/artist/album clauses to select candidates (a query
+/// word matches any indexed word which it prefixes), then evaluates
+/// the full expression on them. So substrings which do not start a
+/// word are not found, but there are no false positives.
+///
+/// Objects are never removed. Their data is updated if they are
+/// seen again. The object count is capped.
+class ItemIndex {
+public:
+    /// @param maxitems max count of objects. New ones are ignored
+    ///   after this is reached.
+    ItemIndex(int maxitems);
+    ~ItemIndex();
+
+    /// Add or update objects.
+    void add(const std::vector<UpSong>& entries);
+
+    /// Find the objects matching the expression, restricted to the
+    /// ones with an id beginning with idprefix (e.g. "0$tidal$").
+    /// @return the number of objects found.
+    int search(const SearchExp& exp, const std::string& idprefix,
+               std::vector<UpSong>& out);
+
+    /// Record whether a search was answered from the index only
+    /// because the remote service failed.
+    void noteOffline();
+
+    /// Size and hit rate report, for logging.
+    std::string report();
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _ITEMINDEX_H_INCLUDED_ */
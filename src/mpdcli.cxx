@@ -31,7 +31,8 @@
 #include "upmpd.hxx"
 #include "smallut.h"
 #include "conftree.h"
-#include "execmd.h"
+#include "extvolpoller.hxx"
+#include "hookrunner.hxx"
 #include "upmpdutils.hxx"
 
 struct mpd_status;
@@ -39,13 +40,20 @@ struct mpd_status;
 using namespace std;
 using namespace UPnPP;
 
+// Max tracks in one command list when restoring the queue
+static const unsigned int restoreBatchSize = 500;
+
+// Max pending hook commands
+static const unsigned int hookQueueSize = 20;
+
 #define M_CONN ((struct mpd_connection *)m_conn)
 
 MPDCli::MPDCli(const string& host, int port, const string& pass)
     : m_conn(0), m_ok(false), m_premutevolume(0), m_cachedvolume(50),
       m_host(host), m_port(port), m_password(pass),
-      m_externalvolumecontrol(false),
-      m_lastinsertid(-1), m_lastinsertpos(-1), m_lastinsertqvers(-1)
+      m_externalvolumecontrol(false), m_hooks(0), m_extvolpoller(0),
+      m_lastinsertid(-1), m_lastinsertpos(-1), m_lastinsertqvers(-1),
+      m_connserial(0)
 {
     regcomp(&m_tpuexpr, "^[[:alpha:]]+://.+", REG_EXTENDED|REG_NOSUB);
     if (!openconn()) {
@@ -71,12 +79,33 @@ MPDCli::MPDCli(const string& host, int port, const string& pass)
     if (g_config->get("externalvolumecontrol", value)) {
         m_externalvolumecontrol = atoi(value.c_str()) != 0;
     }
+    int hooktimeoutsecs = 30;
+    if (g_config->get("hooktimeoutsecs", value)) {
+        hooktimeoutsecs = atoi(value.c_str());
+    }
+    m_hooks = new HookRunner(hookQueueSize, hooktimeoutsecs * 1000);
+
+    if (m_externalvolumecontrol && !m_getexternalvolume.empty()) {
+        int pollms = 1000;
+        if (g_config->get("externalvolumepollms", value)) {
+            pollms = atoi(value.c_str());
+        }
+        bool watch = false;
+        if (g_config->get("externalvolumewatch", value)) {
+            watch = atoi(value.c_str()) != 0;
+        }
+        m_extvolpoller = new ExtVolPoller(m_getexternalvolume, pollms,
+                                          watch, m_hooks);
+    }
 }
 
 MPDCli::~MPDCli()
 {
     if (m_conn) 
         mpd_connection_free(M_CONN);
+    // Stop the poller first, it uses m_hooks
+    delete m_extvolpoller;
+    delete m_hooks;
     regfree(&m_tpuexpr);
 }
 
@@ -86,6 +115,8 @@ MPDCli::~MPDCli()
 void MPDCli::forceInternalVControl()
 {
     m_getexternalvolume.clear();
+    delete m_extvolpoller;
+    m_extvolpoller = 0;
     if (m_externalvolumecontrol)
         m_onvolumechange.clear();
     m_externalvolumecontrol = false;
@@ -96,12 +127,20 @@ bool MPDCli::looksLikeTransportURI(const string& path)
     return (regexec(&m_tpuexpr, path.c_str(), 0, 0, 0) == 0);
 }
 
+void MPDCli::runHook(const string& name, const string& cmdline)
+{
+    if (m_hooks) {
+        m_hooks->runShell(name, cmdline);
+    }
+}
+
 bool MPDCli::openconn()
 {
     if (m_conn) {
         mpd_connection_free(M_CONN);
         m_conn = 0;
     }
+    m_connserial++;
     m_conn = mpd_connection_new(m_host.c_str(), m_port, 0);
     if (m_conn == NULL) {
         LOGERR("mpd_connection_new failed. No memory?" << endl);
@@ -193,15 +232,9 @@ bool MPDCli::updStatus()
         return false;
     }
 
-    if (m_externalvolumecontrol && !m_getexternalvolume.empty()) {
-        string result;
-        if (ExecCmd::backtick(m_getexternalvolume, result)) {
-            //LOGDEB("MPDCli::volume retrieved: " << result << endl);
-            m_stat.volume = atoi(result.c_str());
-        } else {
-            LOGERR("MPDCli::updStatus: error retrieving volume: " <<
-                   m_getexternalvolume[0] << " failed\n");
-        }
+    if (m_extvolpoller) {
+        // Last value read by the poller, -1 if none yet
+        m_stat.volume = m_extvolpoller->volume();
     } else {
 	m_stat.volume = mpd_status_get_volume(mpds);
     }
@@ -223,18 +256,14 @@ bool MPDCli::updStatus()
         // Only execute onstop command if mpd was playing or paused
         if (!m_onstop.empty() && (m_stat.state == MpdStatus::MPDS_PLAY ||
                                   m_stat.state == MpdStatus::MPDS_PAUSE)) {
-            if (system(m_onstop.c_str())) {
-                LOGERR("MPDCli::updStatus: " << m_onstop << " failed "<< endl);
-            }
+            runHook("onstop", m_onstop);
         }
         m_stat.state = MpdStatus::MPDS_STOP;
         break;
     case MPD_STATE_PLAY:
         // Only execute onplay command if mpd was stopped
         if (!m_onplay.empty() && m_stat.state == MpdStatus::MPDS_STOP) {
-            if (system(m_onplay.c_str())) {
-                LOGERR("MPDCli::updStatus: " << m_onplay << " failed "<< endl);
-            }
+            runHook("onplay", m_onplay);
         }
         m_stat.state = MpdStatus::MPDS_PLAY;
         break;
@@ -307,7 +336,51 @@ bool MPDCli::checkForCommand(const string& cmdname)
     return found;
 }
 
-bool MPDCli::saveState(MpdState& st, int seekms)
+// Save the queue to an MPD stored playlist, replacing any previous
+// version. This needs a single command, whatever the queue size, but
+// only the uris are kept (not the tags set with addtagid).
+bool MPDCli::saveQueue(const string& plname)
+{
+    LOGDEB("MPDCli::saveQueue: " << plname << endl);
+    if (!ok())
+        return false;
+    // save fails if the playlist exists
+    if (!mpd_run_rm(M_CONN, plname.c_str())) {
+        mpd_connection_clear_error(M_CONN);
+    }
+    if (!mpd_run_save(M_CONN, plname.c_str())) {
+        showError("MPDCli::saveQueue");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    return true;
+}
+
+// Replace the queue with the contents of a stored playlist saved by
+// saveQueue(), and delete the playlist. The playlist is appended
+// before the old entries are deleted, so that the queue is unchanged
+// if it can't be loaded (e.g. it was removed by another client).
+bool MPDCli::loadQueue(const string& plname)
+{
+    LOGDEB("MPDCli::loadQueue: " << plname << endl);
+    if (!updStatus())
+        return false;
+    unsigned int oldlen = m_stat.qlen;
+    if (!mpd_command_list_begin(M_CONN, false) ||
+        !mpd_send_load(M_CONN, plname.c_str()) ||
+        (oldlen && !mpd_send_delete_range(M_CONN, 0, oldlen)) ||
+        !mpd_command_list_end(M_CONN) || !mpd_response_finish(M_CONN)) {
+        showError("MPDCli::loadQueue");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    if (!mpd_run_rm(M_CONN, plname.c_str())) {
+        mpd_connection_clear_error(M_CONN);
+    }
+    return true;
+}
+
+bool MPDCli::saveState(MpdState& st, int seekms, const string& plname)
 {
     LOGDEB("MPDCli::saveState: seekms " << seekms << endl);
     if (!updStatus()) {
@@ -319,6 +392,17 @@ bool MPDCli::saveState(MpdState& st, int seekms)
         st.status.songelapsedms = seekms;
     }
     st.queue.clear();
+    st.playlist.clear();
+    if (!plname.empty()) {
+        // We still save the queue data below, in case the playlist
+        // is gone when we restore.
+        if (saveQueue(plname)) {
+            st.playlist = plname;
+        } else {
+            // Maybe no playlist_directory in the MPD configuration.
+            LOGINF("MPDCli::saveState: can't use a stored playlist\n");
+        }
+    }
     if (!getQueueData(st.queue)) {
         LOGERR("MPDCli::saveState: can't retrieve current playlist\n");
         return false;
@@ -326,24 +410,56 @@ bool MPDCli::saveState(MpdState& st, int seekms)
     return true;
 }
 
+// Playback options and volume, as one command list
+bool MPDCli::send_options(const MpdStatus& status, bool setvolume)
+{
+    return mpd_command_list_begin(M_CONN, false) &&
+        mpd_send_repeat(M_CONN, status.rept) &&
+        mpd_send_random(M_CONN, status.random) &&
+        mpd_send_single(M_CONN, status.single) &&
+        mpd_send_consume(M_CONN, status.consume) &&
+        (!setvolume || mpd_send_set_volume(M_CONN, status.volume)) &&
+        mpd_command_list_end(M_CONN);
+}
+
 bool MPDCli::restoreState(const MpdState& st)
 {
     LOGDEB("MPDCli::restoreState: seekms " << st.status.songelapsedms << endl);
-    clearQueue();
-    for (unsigned int i = 0; i < st.queue.size(); i++) {
-        if (insert(st.queue[i].uri, i, st.queue[i]) < 0) {
-            LOGERR("MPDCli::restoreState: insert failed\n");
-            return false;
+    if (!st.playlist.empty() && loadQueue(st.playlist)) {
+        // Restored from the stored playlist
+    } else {
+        if (!st.playlist.empty()) {
+            LOGERR("MPDCli::restoreState: can't load " << st.playlist <<
+                   ", restoring the saved queue data\n");
+        }
+        clearQueue();
+        // Insert in batches, a few round trips instead of one per track
+        vector<string> uris;
+        vector<UpSong> metas;
+        vector<int> newids;
+        int afterid = 0;
+        for (unsigned int i = 0; i < st.queue.size(); i++) {
+            uris.push_back(st.queue[i].uri);
+            metas.push_back(st.queue[i]);
+            if (uris.size() == restoreBatchSize || i == st.queue.size() - 1) {
+                if (!insertListAfterId(uris, afterid, metas, newids)) {
+                    LOGERR("MPDCli::restoreState: insert failed\n");
+                    return false;
+                }
+                afterid = newids.back();
+                uris.clear();
+                metas.clear();
+            }
         }
     }
-    repeat(st.status.rept);
-    random(st.status.random);
-    single(st.status.single);
-    consume(st.status.consume);
     m_cachedvolume = st.status.volume;
     //no need to set volume if it is controlled external
-    if (!m_externalvolumecontrol)
-        mpd_run_set_volume(M_CONN, st.status.volume);
+    RETRY_CMD(send_options(st.status, !m_externalvolumecontrol &&
+                           st.status.volume >= 0));
+    if (!mpd_response_finish(M_CONN)) {
+        showError("MPDCli::restoreState");
+        mpd_connection_clear_error(M_CONN);
+    }
 
     if (st.status.state == MpdStatus::MPDS_PAUSE ||
         st.status.state == MpdStatus::MPDS_PLAY) {
@@ -492,17 +608,16 @@ bool MPDCli::setVolume(int volume, bool isMute)
     if (!(m_externalvolumecontrol)) {
     	RETRY_CMD(mpd_run_set_volume(M_CONN, volume));
     }
-    if (!m_onvolumechange.empty()) {
-        ExecCmd ecmd;
+    if (!m_onvolumechange.empty() && m_hooks) {
         vector<string> args = m_onvolumechange;
         stringstream ss;
         ss << volume;
         args.push_back(ss.str());
-        if (ecmd.doexec1(args)) {
-            // doexec returns the exit status, should be zero
-            LOGDEB("MPDCli::setVolume: " << m_onvolumechange[0] <<
-                   " failed " << volume << endl);
-        }
+        // Only the last value matters if several are pending
+        m_hooks->run("onvolumechange", args, true);
+    }
+    if (m_extvolpoller) {
+        m_extvolpoller->setVolume(volume);
     }
     m_stat.volume = volume;
     m_cachedvolume = volume;
@@ -539,9 +654,7 @@ bool MPDCli::play(int pos)
     if (!ok())
         return false;
     if (!m_onstart.empty()) {
-        if (system(m_onstart.c_str())) {
-            LOGERR("MPDCli::play: " << m_onstart << " failed "<< endl);
-        }
+        runHook("onstart", m_onstart);
     }
     if (pos >= 0) {
         RETRY_CMD(mpd_run_play_pos(M_CONN, (unsigned int)pos));
@@ -557,9 +670,7 @@ bool MPDCli::playId(int id)
     if (!ok())
         return false;
     if (!m_onstart.empty()) {
-        if (system(m_onstart.c_str())) {
-            LOGERR("MPDCli::playId: " << m_onstart << " failed "<< endl);
-        }
+        runHook("onstart", m_onstart);
     }
     RETRY_CMD(mpd_run_play_id(M_CONN, (unsigned int)id));
     return updStatus();
@@ -632,7 +743,10 @@ bool MPDCli::single(bool on)
     return true;
 }
 
-bool MPDCli::send_tag(const char *cid, int tag, const string& data)
+// If inlist is set, we are inside a command list, and the response
+// will be read when it ends.
+bool MPDCli::send_tag(const char *cid, int tag, const string& data,
+                      bool inlist)
 {
     if (!mpd_send_command(M_CONN, "addtagid", cid, 
                           mpd_tag_name(mpd_tag_type(tag)),
@@ -641,7 +755,7 @@ bool MPDCli::send_tag(const char *cid, int tag, const string& data)
         return false;
     }
 
-    if (!mpd_response_finish(M_CONN)) {
+    if (!inlist && !mpd_response_finish(M_CONN)) {
         LOGERR("MPDCli::send_tag: mpd_response_finish failed\n");
         showError("MPDCli::send_tag");
         return false;
@@ -651,7 +765,7 @@ bool MPDCli::send_tag(const char *cid, int tag, const string& data)
 
 static const string upmpdcli_comment("client=upmpdcli;");
 
-bool MPDCli::send_tag_data(int id, const UpSong& meta)
+bool MPDCli::send_tag_data(int id, const UpSong& meta, bool inlist)
 {
     LOGDEB1("MPDCli::send_tag_data" << endl);
     if (!m_have_addtagid)
@@ -660,15 +774,15 @@ bool MPDCli::send_tag_data(int id, const UpSong& meta)
     char cid[30];
     sprintf(cid, "%d", id);
 
-    if (!send_tag(cid, MPD_TAG_ARTIST, meta.artist))
+    if (!send_tag(cid, MPD_TAG_ARTIST, meta.artist, inlist))
         return false;
-    if (!send_tag(cid, MPD_TAG_ALBUM, meta.album))
+    if (!send_tag(cid, MPD_TAG_ALBUM, meta.album, inlist))
         return false;
-    if (!send_tag(cid, MPD_TAG_TITLE, meta.title))
+    if (!send_tag(cid, MPD_TAG_TITLE, meta.title, inlist))
         return false;
-    if (!send_tag(cid, MPD_TAG_TRACK, meta.tracknum))
+    if (!send_tag(cid, MPD_TAG_TRACK, meta.tracknum, inlist))
         return false;
-    if (!send_tag(cid, MPD_TAG_COMMENT, upmpdcli_comment))
+    if (!send_tag(cid, MPD_TAG_COMMENT, upmpdcli_comment, inlist))
         return false;
     return true;
 }
@@ -697,9 +811,19 @@ int MPDCli::insertAfterId(const string& uri, int id, const UpSong& meta)
     if (!ok())
         return -1;
 
-    // id == 0 means insert at start
+    int newpos = posAfterId(id);
+    if (newpos < 0) {
+        return -1;
+    }
+    return insert(uri, newpos, meta);
+}
+
+// Translate an id to the position after it, 0 for id 0 (insert at
+// start). If the id is not found, this is the end of the queue.
+int MPDCli::posAfterId(int id)
+{
     if (id == 0) {
-        return insert(uri, 0, meta);
+        return 0;
     }
     updStatus();
 
@@ -708,21 +832,108 @@ int MPDCli::insertAfterId(const string& uri, int id, const UpSong& meta)
         m_lastinsertqvers == m_stat.qvers) {
         newpos = m_lastinsertpos + 1;
     } else {
-        // Translate input id to insert position
-        vector<mpd_song*> songs;
-        if (!getQueueSongs(songs)) {
+        // Ask for the single song instead of reading the whole queue,
+        // which may be very big.
+        mpd_song *song = mpd_run_get_queue_song_id(M_CONN, (unsigned int)id);
+        if (song) {
+            newpos = mpd_song_get_pos(song) + 1;
+            mpd_song_free(song);
+        } else if (mpd_connection_get_error(M_CONN) == MPD_ERROR_SERVER) {
+            // Id not found: append.
+            mpd_connection_clear_error(M_CONN);
+            newpos = m_stat.qlen;
+        } else {
+            showError("MPDCli::posAfterId");
+            return -1;
+        }
+    }
+    return newpos;
+}
+
+bool MPDCli::send_add_list(const vector<string>& uris, int pos)
+{
+    if (!mpd_command_list_begin(M_CONN, true)) {
+        return false;
+    }
+    for (unsigned int i = 0; i < uris.size(); i++) {
+        if (!mpd_send_add_id_to(M_CONN, uris[i].c_str(), pos + i)) {
             return false;
         }
-        for (unsigned int pos = 0; pos < songs.size(); pos++) {
-            unsigned int qid = mpd_song_get_id(songs[pos]);
-            if (qid == (unsigned int)id || pos == songs.size() -1) {
-                newpos = pos + 1;
-                break;
+    }
+    return mpd_command_list_end(M_CONN);
+}
+
+// Insert several tracks with two round trips to MPD instead of one
+// per command: one command list for the addid commands, then one for
+// all the addtagid ones. If MPD fails on one of the tracks, the
+// following ones are not inserted, and newids only has the ids for
+// the previous ones.
+bool MPDCli::insertListAfterId(const vector<string>& uris, int id,
+                               const vector<UpSong>& metas,
+                               vector<int>& newids)
+{
+    LOGDEB("MPDCli::insertListAfterId: id " << id << " count " <<
+           uris.size() << endl);
+    newids.clear();
+    if (!ok() || uris.size() != metas.size())
+        return false;
+    if (uris.empty())
+        return true;
+
+    int pos = posAfterId(id);
+    if (pos < 0) {
+        return false;
+    }
+    // Nothing is executed before the list end, so it is safe to
+    // retry if the connection was closed.
+    RETRY_CMD(send_add_list(uris, pos));
+
+    bool allok = true;
+    for (unsigned int i = 0; i < uris.size(); i++) {
+        int nid = mpd_recv_song_id(M_CONN);
+        if (nid < 0) {
+            allok = false;
+            break;
+        }
+        newids.push_back(nid);
+        if (!mpd_response_next(M_CONN)) {
+            allok = false;
+            break;
+        }
+    }
+    if (!mpd_response_finish(M_CONN) || !allok) {
+        showError("MPDCli::insertListAfterId");
+        mpd_connection_clear_error(M_CONN);
+        allok = false;
+    }
+
+    if (m_have_addtagid && !newids.empty()) {
+        // MPD refuses addtagid for local songs, and the first failure
+        // aborts the rest of the command list: only send the tags for
+        // the remote ones.
+        bool tagok = mpd_command_list_begin(M_CONN, false);
+        for (unsigned int i = 0; tagok && i < newids.size(); i++) {
+            if (!looksLikeTransportURI(uris[i]) ||
+                uris[i].compare(0, 7, "file://") == 0) {
+                continue;
             }
+            tagok = send_tag_data(newids[i], metas[i], true);
+        }
+        if (!tagok || !mpd_command_list_end(M_CONN) ||
+            !mpd_response_finish(M_CONN)) {
+            // Not fatal, the tracks are there.
+            showError("MPDCli::insertListAfterId: tags");
+            mpd_connection_clear_error(M_CONN);
         }
-        freeSongs(songs);
     }
-    return insert(uri, newpos, meta);
+
+    if (!newids.empty()) {
+        m_lastinsertid = newids.back();
+        m_lastinsertpos = pos + newids.size() - 1;
+        updStatus();
+        m_lastinsertqvers = m_stat.qvers;
+    }
+    return allok;
 }
 
 bool MPDCli::clearQueue()
@@ -774,6 +985,40 @@ bool MPDCli::statId(int id)
     return false;
 }
 
+bool MPDCli::send_find_uri(const string& uri)
+{
+    if (mpd_search_queue_songs(M_CONN, true) &&
+        mpd_search_add_uri_constraint(M_CONN, MPD_OPERATOR_DEFAULT,
+                                      uri.c_str()) &&
+        mpd_search_commit(M_CONN)) {
+        return true;
+    }
+    mpd_search_cancel(M_CONN);
+    return false;
+}
+
+bool MPDCli::findUri(const string& uri, vector<int>& ids)
+{
+    LOGDEB("MPDCli::findUri " << uri << endl);
+    ids.clear();
+    if (!ok())
+        return false;
+
+    RETRY_CMD(send_find_uri(uri));
+
+    struct mpd_song *song;
+    while ((song = mpd_recv_song(M_CONN)) != NULL) {
+        ids.push_back(mpd_song_get_id(song));
+        mpd_song_free(song);
+    }
+    if (!mpd_response_finish(M_CONN)) {
+        showError("MPDCli::findUri");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    return true;
+}
+
 bool MPDCli::getQueueSongs(vector<mpd_song*>& songs)
 {
     //LOGDEB1("MPDCli::getQueueSongs" << endl);
@@ -803,6 +1048,115 @@ void MPDCli::freeSongs(vector<mpd_song*>& songs)
     }
 }
 
+bool MPDCli::send_queue_changes(unsigned int fromvers, bool brief)
+{
+    return mpd_command_list_begin(M_CONN, true) &&
+        mpd_send_status(M_CONN) &&
+        (brief ? mpd_send_queue_changes_brief(M_CONN, fromvers) :
+         mpd_send_queue_changes_meta(M_CONN, fromvers)) &&
+        mpd_command_list_end(M_CONN);
+}
+
+// Retrieve the songs which changed in the queue since version
+// fromvers, with their positions, and the current queue version and
+// length. The status is requested in the same command list, so that
+// the length and version match the changes. If brief is set, only
+// the positions and ids are transferred (mpdid is the only UpSong
+// field set).
+bool MPDCli::getQueueChanges(int fromvers, vector<UpSong>& changed,
+                             vector<int>& positions, int *qvers, int *qlen,
+                             bool brief)
+{
+    LOGDEB1("MPDCli::getQueueChanges: from " << fromvers << endl);
+    changed.clear();
+    positions.clear();
+    if (!ok())
+        return false;
+
+    RETRY_CMD(send_queue_changes(fromvers < 0 ? 0 : fromvers, brief));
+
+    mpd_status *mpds = mpd_recv_status(M_CONN);
+    if (mpds == 0 || !mpd_response_next(M_CONN)) {
+        if (mpds)
+            mpd_status_free(mpds);
+        showError("MPDCli::getQueueChanges");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    *qvers = mpd_status_get_queue_version(mpds);
+    *qlen = mpd_status_get_queue_length(mpds);
+    mpd_status_free(mpds);
+
+    if (brief) {
+        unsigned int pos, id;
+        while (mpd_recv_queue_change_brief(M_CONN, &pos, &id)) {
+            changed.push_back(UpSong());
+            changed.back().mpdid = id;
+            positions.push_back(pos);
+        }
+    } else {
+        struct mpd_song *song;
+        while ((song = mpd_recv_song(M_CONN)) != NULL) {
+            changed.push_back(UpSong());
+            mapSong(changed.back(), song);
+            positions.push_back(mpd_song_get_pos(song));
+            mpd_song_free(song);
+        }
+    }
+    if (!mpd_response_finish(M_CONN)) {
+        showError("MPDCli::getQueueChanges");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    LOGDEB("MPDCli::getQueueChanges: from " << fromvers << " to " << *qvers <<
+           ": " << changed.size() << " songs, qlen " << *qlen << endl);
+    return true;
+}
+
+bool MPDCli::send_get_songs(const vector<int>& ids)
+{
+    if (!mpd_command_list_begin(M_CONN, true)) {
+        return false;
+    }
+    for (auto id : ids) {
+        if (!mpd_send_get_queue_song_id(M_CONN, (unsigned int)id)) {
+            return false;
+        }
+    }
+    return mpd_command_list_end(M_CONN);
+}
+
+// Retrieve the data for several songs with a single round trip. This
+// fails if one of the ids is not in the queue.
+bool MPDCli::statSongs(const vector<int>& ids, vector<UpSong>& songs)
+{
+    songs.clear();
+    if (!ok())
+        return false;
+    if (ids.empty())
+        return true;
+
+    RETRY_CMD(send_get_songs(ids));
+    for (unsigned int i = 0; i < ids.size(); i++) {
+        mpd_song *song = mpd_recv_song(M_CONN);
+        if (song == 0) {
+            break;
+        }
+        songs.push_back(UpSong());
+        mapSong(songs.back(), song);
+        mpd_song_free(song);
+        if (!mpd_response_next(M_CONN)) {
+            break;
+        }
+    }
+    if (!mpd_response_finish(M_CONN) || songs.size() != ids.size()) {
+        showError("MPDCli::statSongs");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    return true;
+}
+
 bool MPDCli::getQueueData(std::vector<UpSong>& vdata)
 {
     LOGDEB("MPDCli::getQueueData" << endl);
@@ -25,6 +25,9 @@
 
 #include "upmpdutils.hxx"
 
+class ExtVolPoller;
+class HookRunner;
+
 struct mpd_song;
 
 class MpdStatus {
@@ -68,6 +71,9 @@ public:
 struct MpdState {
     MpdStatus status;
     std::vector<UpSong> queue;
+    // If set, the queue was also saved to this MPD stored playlist,
+    // which restoreState() uses if it still exists.
+    std::string playlist;
 };
 
 class MPDCli {
@@ -94,12 +100,31 @@ public:
     int insert(const std::string& uri, int pos, const UpSong& meta);
     // Insert after given id. Returns new id or -1
     int insertAfterId(const std::string& uri, int id, const UpSong& meta);
+    // Insert several tracks after given id, in order. Returns the
+    // new ids.
+    bool insertListAfterId(const std::vector<std::string>& uris, int id,
+                           const std::vector<UpSong>& metas,
+                           std::vector<int>& newids);
     bool deleteId(int id);
     // start included, end excluded
     bool deletePosRange(unsigned int start, unsigned int end);
     bool statId(int id);
+    // Get the ids of the queue entries for uri (one MPD request)
+    bool findUri(const std::string& uri, std::vector<int>& ids);
     int curpos();
     bool getQueueData(std::vector<UpSong>& vdata);
+    // Retrieve the queue songs which changed since queue version
+    // fromvers (all if fromvers is -1), with their positions. With
+    // brief, only the ids are set.
+    bool getQueueChanges(int fromvers, std::vector<UpSong>& changed,
+                         std::vector<int>& positions, int *qvers, int *qlen,
+                         bool brief = false);
+    bool statSongs(const std::vector<int>& ids, std::vector<UpSong>& songs);
+    // Incremented when the connection is reopened (MPD may have
+    // restarted and reset its queue version).
+    unsigned int connSerial() const {
+        return m_connserial;
+    }
     bool statSong(UpSong& usong, int pos = -1, bool isId = false);
     UpSong& mapSong(UpSong& usong, struct mpd_song *song);
     
@@ -110,8 +135,12 @@ public:
     }
 
     // Copy complete mpd state. If seekms is > 0, this is the value to
-    // save (sometimes useful if mpd was stopped)
-    bool saveState(MpdState& st, int seekms = 0);
+    // save (sometimes useful if mpd was stopped). If plname is set,
+    // also try to save the queue to an MPD stored playlist: restoring
+    // from it is much faster for a big queue, but only works with the
+    // same MPD. The queue data is the fallback if it can't be loaded.
+    bool saveState(MpdState& st, int seekms = 0,
+                   const std::string& plname = std::string());
     bool restoreState(const MpdState& st);
     
 private:
@@ -132,6 +161,10 @@ private:
     bool m_externalvolumecontrol;
     std::vector<std::string> m_onvolumechange;
     std::vector<std::string> m_getexternalvolume;
+    // Executes the hooks above, except getexternalvolume
+    HookRunner *m_hooks;
+    // Runs getexternalvolume in the background
+    ExtVolPoller *m_extvolpoller;
     regex_t m_tpuexpr;
     // addtagid command only exists for mpd 0.19 and later.
     bool m_have_addtagid; 
@@ -143,6 +176,7 @@ private:
     int m_lastinsertid;
     int m_lastinsertpos;
     int m_lastinsertqvers;
+    unsigned int m_connserial;
 
     bool openconn();
     bool updStatus();
@@ -150,9 +184,19 @@ private:
     void freeSongs(std::vector<mpd_song*>& songs);
     bool showError(const std::string& who);
     bool looksLikeTransportURI(const std::string& path);
+    void runHook(const std::string& name, const std::string& cmdline);
     bool checkForCommand(const std::string& cmdname);
-    bool send_tag(const char *cid, int tag, const std::string& data);
-    bool send_tag_data(int id, const UpSong& meta);
+    bool send_tag(const char *cid, int tag, const std::string& data,
+                  bool inlist = false);
+    bool send_tag_data(int id, const UpSong& meta, bool inlist = false);
+    int posAfterId(int id);
+    bool saveQueue(const std::string& plname);
+    bool loadQueue(const std::string& plname);
+    bool send_add_list(const std::vector<std::string>& uris, int pos);
+    bool send_find_uri(const std::string& uri);
+    bool send_options(const MpdStatus& status, bool setvolume);
+    bool send_queue_changes(unsigned int fromvers, bool brief);
+    bool send_get_songs(const std::vector<int>& ids);
 };
 
 
@@ -43,6 +43,9 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include <map>
 
@@ -109,6 +112,35 @@ int Netcon::select1(int fd, int timeo, int write)
     return ret;
 }
 
+SelectLoop::SelectLoop()
+    : m_selectloopDoReturn(false), m_selectloopReturnValue(0),
+      m_placetostart(0),
+      m_periodichandler(0), m_periodicparam(0), m_periodicmillis(0)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    m_nactive = 0;
+    if ((m_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        LOGSYSERR("SelectLoop::SelectLoop", "epoll_create1", "");
+    }
+#endif
+}
+
+SelectLoop::~SelectLoop()
+{
+    // The connections may survive us
+    for (auto& ent : m_polldata) {
+        ent.second->setloop(0);
+#ifdef HAVE_SYS_EPOLL_H
+        ent.second->m_loopEvents = -1;
+#endif
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (m_epfd >= 0) {
+        close(m_epfd);
+    }
+#endif
+}
+
 void SelectLoop::setperiodichandler(int (*handler)(void *), void *p, int ms)
 {
     m_periodichandler = handler;
@@ -166,6 +198,205 @@ int SelectLoop::maybecallperiodic()
     return 1;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+
+// Max number of events we get from one epoll_wait() call
+static const int epollMaxEvents = 64;
+
+// Update the epoll registration of a connection from its wanted
+// events. A connection with no events stays in the map but is removed
+// from epoll, which would otherwise still report errors and hangups.
+int SelectLoop::epollsync(Netcon *con)
+{
+    int wanted = con->m_wantedEvents &
+        (Netcon::NETCONPOLL_READ | Netcon::NETCONPOLL_WRITE);
+    if (wanted == 0) {
+        if (con->m_loopEvents > 0) {
+            // Fails if the fd was closed already, no matter.
+            epoll_ctl(m_epfd, EPOLL_CTL_DEL, con->m_fd, 0);
+            m_nactive--;
+        }
+        con->m_loopEvents = -1;
+        return 0;
+    }
+    if (wanted == con->m_loopEvents) {
+        return 0;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = con->m_fd;
+    if (wanted & Netcon::NETCONPOLL_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (wanted & Netcon::NETCONPOLL_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+    if (con->m_edgetrigger) {
+        ev.events |= EPOLLET;
+    }
+    int op = con->m_loopEvents < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    int ret = epoll_ctl(m_epfd, op, con->m_fd, &ev);
+    // The fd may have been closed and reused since we registered it,
+    // or be registered by another connection object.
+    if (ret < 0 && errno == ENOENT) {
+        ret = epoll_ctl(m_epfd, EPOLL_CTL_ADD, con->m_fd, &ev);
+    } else if (ret < 0 && errno == EEXIST) {
+        ret = epoll_ctl(m_epfd, EPOLL_CTL_MOD, con->m_fd, &ev);
+    }
+    if (ret < 0) {
+        char fdcbuf[20];
+        sprintf(fdcbuf, "%d", con->m_fd);
+        LOGSYSERR("SelectLoop::epollsync", "epoll_ctl", fdcbuf);
+        return -1;
+    }
+    if (con->m_loopEvents < 0) {
+        m_nactive++;
+    }
+    con->m_loopEvents = wanted;
+    return 0;
+}
+
+// Remove a connection from epoll and from the map.
+void SelectLoop::epollerase(int fd)
+{
+    map<int, NetconP>::iterator it = m_polldata.find(fd);
+    if (it == m_polldata.end()) {
+        return;
+    }
+    NetconP& con = it->second;
+    if (con->m_loopEvents > 0) {
+        // Fails if the fd was closed already, no matter.
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, 0);
+        m_nactive--;
+    }
+    con->m_loopEvents = -1;
+    con->setloop(0);
+    m_polldata.erase(it);
+}
+
+int SelectLoop::doLoop()
+{
+    if (m_epfd < 0) {
+        return -1;
+    }
+    struct epoll_event events[epollMaxEvents];
+    for (;;) {
+        if (m_selectloopDoReturn) {
+            m_selectloopDoReturn = false;
+            LOGDEB("Netcon::selectloop: returning on request\n" );
+            return m_selectloopReturnValue;
+        }
+
+        // Register the event changes made since the last wait
+        if (!m_changed.empty()) {
+            vector<int> changed;
+            changed.swap(m_changed);
+            for (int fd : changed) {
+                map<int, NetconP>::iterator it = m_polldata.find(fd);
+                if (it != m_polldata.end()) {
+                    epollsync(it->second.get());
+                }
+            }
+        }
+
+        if (m_nactive == 0) {
+            // Same as the select() version: nothing left to wait for.
+            while (!m_polldata.empty()) {
+                epollerase(m_polldata.begin()->first);
+            }
+            LOGDEB1("Netcon::selectloop: no fds\n" );
+            return 0;
+        }
+
+        struct timeval tv;
+        periodictimeout(&tv);
+        int ret = epoll_wait(m_epfd, events, epollMaxEvents,
+                             tv.tv_sec * 1000 + tv.tv_usec / 1000);
+        LOGDEB2("Netcon::selectloop: epoll_wait returns "  << ret << "\n");
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGSYSERR("Netcon::selectloop", "epoll_wait", "");
+            return -1;
+        }
+        if (m_periodicmillis > 0)
+            if (maybecallperiodic() <= 0) {
+                return 1;
+            }
+
+        for (int i = 0; i < ret; i++) {
+            int fd = events[i].data.fd;
+            map<int, NetconP>::iterator it = m_polldata.find(fd);
+            if (it == m_polldata.end()) {
+                // Removed by a previous callback
+                continue;
+            }
+            // Hold a reference: the callbacks may remove the connection
+            NetconP pll = it->second;
+            uint32_t evs = events[i].events;
+            bool canread = (evs & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                (pll->m_wantedEvents & Netcon::NETCONPOLL_READ);
+            if (canread && pll->cando(Netcon::NETCONPOLL_READ) <= 0) {
+                pll->m_wantedEvents &= ~Netcon::NETCONPOLL_READ;
+            }
+            bool canwrite = (evs & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+                (pll->m_wantedEvents & Netcon::NETCONPOLL_WRITE);
+            if (canwrite && pll->cando(Netcon::NETCONPOLL_WRITE) <= 0) {
+                pll->m_wantedEvents &= ~Netcon::NETCONPOLL_WRITE;
+            }
+            it = m_polldata.find(fd);
+            if (it == m_polldata.end() || it->second != pll) {
+                continue;
+            }
+            if (!(pll->m_wantedEvents & (Netcon::NETCONPOLL_WRITE | Netcon::NETCONPOLL_READ))) {
+                LOGDEB0("Netcon::selectloop: fd "  << fd << " has 0x"  << (pll->m_wantedEvents) << " mask, erasing\n" );
+                epollerase(fd);
+            } else {
+                epollsync(pll.get());
+            }
+        }
+    } // forever loop
+    LOGERR("SelectLoop::doLoop: got out of loop !\n" );
+    return -1;
+}
+
+// Add a connection to the monitored set.
+int SelectLoop::addselcon(NetconP con, int events)
+{
+    if (!con) {
+        return -1;
+    }
+    LOGDEB1("Netcon::addselcon: fd "  << (con->m_fd) << "\n" );
+    con->set_nonblock(1);
+    con->setselevents(events);
+    map<int, NetconP>::iterator it = m_polldata.find(con->m_fd);
+    if (it != m_polldata.end() && it->second != con) {
+        epollerase(con->m_fd);
+    }
+    m_polldata[con->m_fd] = con;
+    con->setloop(this);
+    return epollsync(con.get());
+}
+
+// Remove a connection from the monitored set.
+int SelectLoop::remselcon(NetconP con)
+{
+    if (!con) {
+        return -1;
+    }
+    LOGDEB1("Netcon::remselcon: fd "  << (con->m_fd) << "\n" );
+    map<int, NetconP>::iterator it = m_polldata.find(con->m_fd);
+    if (it == m_polldata.end()) {
+        LOGDEB1("Netcon::remselcon: con not found for fd "  << (con->m_fd) << "\n" );
+        return -1;
+    }
+    epollerase(con->m_fd);
+    return 0;
+}
+
+#else /* !HAVE_SYS_EPOLL_H -> select() */
+
 int SelectLoop::doLoop()
 {
     for (;;) {
@@ -314,6 +545,8 @@ int SelectLoop::remselcon(NetconP con)
     return 0;
 }
 
+#endif /* HAVE_SYS_EPOLL_H */
+
 //////////////////////////////////////////////////////////
 // Base class (Netcon) methods
 Netcon::~Netcon()
@@ -325,6 +558,15 @@ Netcon::~Netcon()
     }
 }
 
+void Netcon::evchanged()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (m_loop) {
+        m_loop->m_changed.push_back(m_fd);
+    }
+#endif
+}
+
 void Netcon::closeconn()
 {
     if (m_ownfd && m_fd >= 0) {
@@ -474,6 +716,11 @@ int NetconData::receive(char *buf, int cnt, int timeo)
     }
     m_didtimo = 0;
     if ((cnt = read(m_fd, buf + fromibuf, cnt)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Non-blocking connection: return what we had, or -1
+            // with errno set, this is not an error for the caller.
+            return fromibuf > 0 ? fromibuf : -1;
+        }
         char fdcbuf[20];
         sprintf(fdcbuf, "%d", m_fd);
         LOGSYSERR("NetconData::receive", "read", fdcbuf);
@@ -1017,3 +1264,151 @@ NetconServLis::checkperms(void *cl, int)
     return -1;
 }
 #endif /* NETCON_ACCESSCONTROL */
+
+#ifdef TEST_NETCON
+// SelectLoop benchmark: time per loop iteration, with one active
+// connection (a socketpair ping-pong) and nidle connections which never
+// have data. Build with and without HAVE_SYS_EPOLL_H to compare epoll
+// and select().
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+static int pingfd = -1;
+static int pingcount;
+static int pingmax;
+
+class Pinger : public NetconWorker {
+public:
+    int data(NetconData *con, Netcon::Event) {
+        char c;
+        if (con->receive(&c, 1) != 1) {
+            return -1;
+        }
+        if (++pingcount == pingmax) {
+            con->getloop()->loopReturn(0);
+        }
+        if (write(pingfd, &c, 1) != 1) {
+            return -1;
+        }
+        return 1;
+    }
+};
+
+static char *thisprog;
+static char usage [] =
+    "trnetcon [-n iterations] nidle\n"
+    "   Time a SelectLoop iteration with nidle idle connections\n"
+    ;
+
+static void Usage(void)
+{
+    fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    pingmax = 200000;
+
+    thisprog = argv[0];
+    argc--;
+    argv++;
+
+    while (argc > 0 && **argv == '-') {
+        (*argv)++;
+        if (!(**argv)) {
+            Usage();
+        }
+        while (**argv)
+            switch (*(*argv)++) {
+            case 'n':
+                if (argc < 2) {
+                    Usage();
+                }
+                if (sscanf(*(++argv), "%d", &pingmax) != 1 || pingmax < 1) {
+                    Usage();
+                }
+                argc--;
+                goto b1;
+            default:
+                Usage();
+                break;
+            }
+b1:
+        argc--;
+        argv++;
+    }
+    if (argc != 1) {
+        Usage();
+    }
+    int nidle = atoi(*argv);
+
+    // The idle connections are duplicates of one end of a socketpair
+    // which never gets data, so that select() can go up to ~1000.
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < rlim_t(nidle + 20)) {
+        rl.rlim_cur = std::min(rl.rlim_max, rlim_t(nidle + 20));
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+#ifndef HAVE_SYS_EPOLL_H
+    if (nidle + 20 > FD_SETSIZE) {
+        cerr << "select() can't handle more than " << FD_SETSIZE <<
+            " descriptors" << endl;
+        return 1;
+    }
+#endif
+
+    SelectLoop loop;
+    int idlesv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, idlesv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    for (int i = 0; i < nidle; i++) {
+        int fd = dup(idlesv[0]);
+        if (fd < 0) {
+            perror("dup");
+            return 1;
+        }
+        NetconCli *con = new NetconCli();
+        con->setconn(fd);
+        if (loop.addselcon(NetconP(con), Netcon::NETCONPOLL_READ) < 0) {
+            cerr << "addselcon failed" << endl;
+            return 1;
+        }
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pingfd = sv[1];
+    NetconCli *con = new NetconCli();
+    con->setconn(sv[0]);
+    con->setcallback(std::make_shared<Pinger>());
+    loop.addselcon(NetconP(con), Netcon::NETCONPOLL_READ);
+
+    if (write(pingfd, "x", 1) != 1) {
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    loop.doLoop();
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+#ifdef HAVE_SYS_EPOLL_H
+    const char *method = "epoll";
+#else
+    const char *method = "select";
+#endif
+    printf("%s, %d idle connections: %.2f uS per iteration\n", method, nidle,
+           elapsed.count() / pingcount);
+    return 0;
+}
+#endif // TEST_NETCON
@@ -25,6 +25,7 @@
 #include <sys/time.h>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <memory>
 
@@ -51,7 +52,7 @@ public:
     enum Event {NETCONPOLL_READ = 0x1, NETCONPOLL_WRITE = 0x2};
     Netcon()
         : m_peer(0), m_fd(-1), m_ownfd(true), m_didtimo(0), m_wantedEvents(0),
-          m_loop(0) {
+          m_loopEvents(-1), m_edgetrigger(false), m_loop(0) {
     }
     virtual ~Netcon();
     /// Remember whom we're talking to. We let external code do this because
@@ -86,7 +87,9 @@ public:
     /// Decide what events the connection will be looking for
     /// (NETCONPOLL_READ, NETCONPOLL_WRITE)
     int setselevents(int evs) {
-        return m_wantedEvents = evs;
+        m_wantedEvents = evs;
+        evchanged();
+        return m_wantedEvents;
     }
     /// Retrieve the connection's currently monitored set of events
     int getselevents() {
@@ -94,11 +97,22 @@ public:
     }
     /// Add events to current set
     int addselevents(int evs) {
-        return m_wantedEvents |= evs;
+        m_wantedEvents |= evs;
+        evchanged();
+        return m_wantedEvents;
     }
     /// Clear events from current set
     int clearselevents(int evs) {
-        return m_wantedEvents &= ~evs;
+        m_wantedEvents &= ~evs;
+        evchanged();
+        return m_wantedEvents;
+    }
+    /// Ask for edge-triggered notification when the selectloop uses
+    /// epoll. Only set this if cando() always reads or writes until
+    /// the operation would block, else the loop will not call it
+    /// again for the remaining data. Call before addselcon().
+    void setedgetrigger(bool onoff) {
+        m_edgetrigger = onoff;
     }
 
     friend class SelectLoop;
@@ -117,6 +131,9 @@ protected:
     int   m_didtimo;
     // Used when part of the selectloop map.
     short m_wantedEvents;
+    // Events currently registered with epoll, -1 if none
+    short m_loopEvents;
+    bool  m_edgetrigger;
     SelectLoop *m_loop;
     // Method called by the selectloop when something can be done with a netcon
     virtual int cando(Netcon::Event reason) = 0;
@@ -124,6 +141,9 @@ protected:
     virtual void setloop(SelectLoop *loop) {
         m_loop = loop;
     }
+private:
+    // Tell the loop that m_wantedEvents changed
+    void evchanged();
 };
 
 
@@ -133,13 +153,16 @@ protected:
 // or written. In a multithread program which is also using select, it
 // would typically make sense to have one SelectLoop active per
 // thread.
+//
+// On Linux, the loop uses epoll instead of select(). The connections
+// stay registered with the kernel between the calls, and the event
+// changes (setselevents() etc.) are applied before the next wait, so
+// that the cost of an iteration depends on the number of active
+// connections, not on the total. There is also no FD_SETSIZE limit.
 class SelectLoop {
 public:
-    SelectLoop()
-        : m_selectloopDoReturn(false), m_selectloopReturnValue(0),
-          m_placetostart(0),
-          m_periodichandler(0), m_periodicparam(0), m_periodicmillis(0) {
-    }
+    SelectLoop();
+    ~SelectLoop();
 
     /// Loop waiting for events on the connections and call the
     /// cando() method on the object when something happens (this will in
@@ -173,6 +196,8 @@ public:
     void setperiodichandler(int (*handler)(void *), void *clp, int ms);
 
 private:
+    friend class Netcon;
+
     // Set by client callback to tell selectloop to return.
     bool m_selectloopDoReturn;
     int  m_selectloopReturnValue;
@@ -190,6 +215,16 @@ private:
     int m_periodicmillis;
     void periodictimeout(struct timeval *tv);
     int maybecallperiodic();
+
+#ifdef HAVE_SYS_EPOLL_H
+    int m_epfd;
+    // Count of connections registered with some events
+    int m_nactive;
+    // Connections (fds) for which the wanted events changed
+    std::vector<int> m_changed;
+    int epollsync(Netcon *con);
+    void epollerase(int fd);
+#endif
 };
 
 ///////////////////////
@@ -0,0 +1,184 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "ohidarray.hxx"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Encoding pairs for all 12 bits values: each 3 bytes group is
+// translated with two lookups instead of four shift and mask
+// operations.
+static char b64pairs[4096][2];
+static bool initpairs()
+{
+    for (int i = 0; i < 4096; i++) {
+        b64pairs[i][0] = b64chars[i >> 6];
+        b64pairs[i][1] = b64chars[i & 0x3f];
+    }
+    return true;
+}
+
+void IdArrayBuffer::encode(const char *data, size_t len, string& out)
+{
+    static bool pairsok = initpairs();
+    (void)pairsok;
+    const unsigned char *cp = (const unsigned char *)data;
+    size_t ngroups = len / 3;
+    size_t start = out.size();
+    out.resize(start + 4 * ((len + 2) / 3));
+    char *op = &out[start];
+    for (size_t i = 0; i < ngroups; i++) {
+        unsigned int v = (cp[0] << 16) | (cp[1] << 8) | cp[2];
+        memcpy(op, b64pairs[v >> 12], 2);
+        memcpy(op + 2, b64pairs[v & 0xfff], 2);
+        cp += 3;
+        op += 4;
+    }
+    switch (len % 3) {
+    case 1:
+        op[0] = b64chars[cp[0] >> 2];
+        op[1] = b64chars[(cp[0] & 0x3) << 4];
+        op[2] = op[3] = '=';
+        break;
+    case 2:
+        op[0] = b64chars[cp[0] >> 2];
+        op[1] = b64chars[((cp[0] & 0x3) << 4) | (cp[1] >> 4)];
+        op[2] = b64chars[(cp[1] & 0xf) << 2];
+        op[3] = '=';
+        break;
+    default:
+        break;
+    }
+}
+
+IdArrayBuffer::IdArrayBuffer()
+    : m_dirty(string::npos)
+{
+}
+
+void IdArrayBuffer::clear()
+{
+    m_raw.clear();
+    m_enc.clear();
+    m_dirty = string::npos;
+}
+
+void IdArrayBuffer::touch(size_t byteoffs)
+{
+    if (m_dirty == string::npos || byteoffs < m_dirty) {
+        m_dirty = byteoffs;
+    }
+}
+
+static inline void idbytes(unsigned int id, char *bytes)
+{
+    bytes[0] = (unsigned char)((id >> 24) & 0xff);
+    bytes[1] = (unsigned char)((id >> 16) & 0xff);
+    bytes[2] = (unsigned char)((id >> 8) & 0xff);
+    bytes[3] = (unsigned char)(id & 0xff);
+}
+
+unsigned int IdArrayBuffer::at(size_t pos) const
+{
+    const unsigned char *cp = (const unsigned char *)m_raw.data() + 4 * pos;
+    return (cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3];
+}
+
+void IdArrayBuffer::assign(const vector<unsigned int>& ids)
+{
+    m_raw.resize(4 * ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        idbytes(ids[i], &m_raw[4 * i]);
+    }
+    m_enc.clear();
+    m_dirty = 0;
+}
+
+void IdArrayBuffer::append(unsigned int id)
+{
+    char bytes[4];
+    idbytes(id, bytes);
+    touch(m_raw.size());
+    m_raw.append(bytes, 4);
+}
+
+void IdArrayBuffer::insert(size_t pos, unsigned int id)
+{
+    if (pos >= size()) {
+        append(id);
+        return;
+    }
+    char bytes[4];
+    idbytes(id, bytes);
+    touch(4 * pos);
+    m_raw.insert(4 * pos, bytes, 4);
+}
+
+void IdArrayBuffer::erase(size_t pos)
+{
+    if (pos >= size()) {
+        return;
+    }
+    touch(4 * pos);
+    m_raw.erase(4 * pos, 4);
+}
+
+void IdArrayBuffer::set(size_t pos, unsigned int id)
+{
+    if (pos >= size()) {
+        return;
+    }
+    char bytes[4];
+    idbytes(id, bytes);
+    if (memcmp(&m_raw[4 * pos], bytes, 4)) {
+        touch(4 * pos);
+        memcpy(&m_raw[4 * pos], bytes, 4);
+    }
+}
+
+void IdArrayBuffer::resize(size_t count)
+{
+    if (count == size()) {
+        return;
+    }
+    touch(4 * (count < size() ? count : size()));
+    m_raw.resize(4 * count, 0);
+}
+
+const string& IdArrayBuffer::encoded()
+{
+    if (m_dirty != string::npos) {
+        // Restart at the beginning of the group containing the first
+        // changed byte. The end of the encoded form may have changed
+        // even if the bytes did not (padding).
+        size_t start = (m_dirty / 3) * 3;
+        if (start > m_raw.size()) {
+            start = (m_raw.size() / 3) * 3;
+        }
+        m_enc.resize(4 * (start / 3));
+        encode(m_raw.data() + start, m_raw.size() - start, m_enc);
+        m_dirty = string::npos;
+    }
+    return m_enc;
+}
@@ -0,0 +1,70 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _OHIDARRAY_H_INCLUDED_
+#define _OHIDARRAY_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+/// OpenHome id array: a list of 32 bits big endian track ids, encoded
+/// in base64 (IdArray state variable and action output).
+///
+/// We keep both the raw bytes and the encoded form. Modifications
+/// only record the first changed byte, and the encoded form is
+/// recomputed from the 3 bytes group containing it when it is next
+/// requested. So appending ids or truncating the list only re-encodes
+/// the tail, and an insert or erase re-encodes from the change
+/// position, instead of re-encoding the whole list.
+class IdArrayBuffer {
+public:
+    IdArrayBuffer();
+
+    void clear();
+    /// Number of ids.
+    size_t size() const {
+        return m_raw.size() / 4;
+    }
+    unsigned int at(size_t pos) const;
+
+    /// Replace the contents.
+    void assign(const std::vector<unsigned int>& ids);
+    void append(unsigned int id);
+    void insert(size_t pos, unsigned int id);
+    void erase(size_t pos);
+    void set(size_t pos, unsigned int id);
+    /// Truncate, or extend with 0 ids.
+    void resize(size_t count);
+
+    /// Return the base64 encoding of the list.
+    const std::string& encoded();
+
+    /// Base64 encoding (with padding) appended to out. This is
+    /// faster than the general-purpose libupnpp routine, which we do
+    /// not want for big arrays.
+    static void encode(const char *data, size_t len, std::string& out);
+
+private:
+    void touch(size_t byteoffs);
+    // Big endian ids
+    std::string m_raw;
+    // Encoded form, valid up to the group which contains m_dirty
+    std::string m_enc;
+    // First raw byte changed since the last encoding, or npos.
+    size_t m_dirty;
+};
+
+#endif /* _OHIDARRAY_H_INCLUDED_ */
@@ -0,0 +1,1262 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "ohmreceiver.hxx"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <microhttpd.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+using namespace std;
+
+// Songcast message header: "Ohm ", version, type, total length (all
+// integers are big-endian)
+static const int ohmHeaderSize = 8;
+enum OhmMsgType {OHM_JOIN = 0, OHM_LISTEN = 1, OHM_LEAVE = 2, OHM_AUDIO = 3,
+                 OHM_TRACK = 4, OHM_METATEXT = 5, OHM_SLAVE = 6,
+                 OHM_RESEND = 7};
+// Audio message header size (after the ohm header)
+static const int ohmAudioHeaderSize = 50;
+
+// Interval for the Listen messages which keep the sender sending to us
+static const int listenIntervalMs = 500;
+// Frames which can wait for a missing one before we give it up
+static const size_t reorderMax = 64;
+// Max frames in one resend request
+static const unsigned int resendMax = 32;
+// Ring capacity (frames, must be a power of 2). Songcast frames are a
+// few ms, this is more than enough for any sensible depth.
+static const size_t ringSize = 4096;
+// How long the HTTP reader waits for the initial prefill before
+// giving up.
+static const int prefillWaitMs = 10000;
+// How far the HTTP stream may get ahead of real time. MPD would
+// otherwise read as much as its buffers hold, adding to the latency.
+static const int readAheadMs = 20;
+// Silence sent at a time while we are refilling after an underrun
+static const int silenceChunkMs = 10;
+
+typedef std::chrono::steady_clock Clock;
+
+static inline unsigned int be16(const unsigned char *cp)
+{
+    return (cp[0] << 8) | cp[1];
+}
+
+static inline unsigned int be32(const unsigned char *cp)
+{
+    return ((unsigned int)cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3];
+}
+
+static inline void setbe32(unsigned char *cp, unsigned int v)
+{
+    cp[0] = v >> 24;
+    cp[1] = (v >> 16) & 0xff;
+    cp[2] = (v >> 8) & 0xff;
+    cp[3] = v & 0xff;
+}
+
+// Frame numbers wrap around
+struct FrameCmp {
+    bool operator()(unsigned int a, unsigned int b) const {
+        return int32_t(a - b) < 0;
+    }
+};
+
+namespace {
+// Decoded audio: little-endian PCM, as WAV wants it.
+struct AudioFrame {
+    unsigned int samplerate;
+    int bitdepth;
+    int channels;
+    int samples;
+    vector<char> data;
+};
+
+// Single producer (network thread), single consumer (HTTP reader)
+// queue of frames. The slots are reused, so that their buffers are
+// not reallocated once they have grown.
+class FrameRing {
+public:
+    FrameRing() : slots(ringSize), head(0), tail(0) {}
+
+    // Producer side: get the slot to fill, or null if we are full
+    AudioFrame *writeSlot() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == ringSize) {
+            return nullptr;
+        }
+        return &slots[h & (ringSize - 1)];
+    }
+    void commit() {
+        head.store(head.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+    }
+
+    // Consumer side: oldest slot, or null if we are empty
+    AudioFrame *readSlot() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots[t & (ringSize - 1)];
+    }
+    void release() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+    }
+    // Consumer side, drop everything
+    void drain() {
+        tail.store(head.load(std::memory_order_acquire),
+                   std::memory_order_release);
+    }
+
+private:
+    vector<AudioFrame> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+}
+
+struct StreamCtx;
+
+class OhmReceiver::Internal {
+public:
+    Internal(int port, int depth)
+        : httpport(port), depthms(depth), mhd(nullptr), fd(-1),
+          stopreq(false), active(false), httpserial(0), readoffs(0),
+          bufsamples(0),
+          bufrate(0), frames(0), late(0), lost(0), resent(0), overruns(0),
+          underruns(0), dropped(0), silence(0), latencyms(0) {
+        if (depthms < 0) {
+            depthms = 0;
+        }
+        // Excess over the depth before we drop frames. This must be
+        // larger than the normal jitter.
+        trimslackms = max(depthms / 4, 20);
+    }
+    bool startHttp();
+    bool openSocket(const string& uri);
+    void sendMsg(int type, const unsigned char *body = nullptr,
+                 size_t len = 0);
+    void netloop();
+    void processAudio(const unsigned char *msg, size_t len);
+    bool decodeAudio(const unsigned char *msg, size_t len,
+                     AudioFrame& frame);
+    void queueFrame(AudioFrame& frame);
+    void flushPending(bool giveup);
+    void requestResend(unsigned int from, unsigned int to);
+    int bufferedms() {
+        unsigned int rate = bufrate.load();
+        return rate ? int(bufsamples.load() * 1000 / rate) : 0;
+    }
+    void logStats(bool final);
+    ssize_t read(unsigned int serial, StreamCtx *ctx, char *buf, size_t max);
+    ssize_t sendSilence(StreamCtx *ctx, char *buf, size_t max);
+    unsigned long long silencems() {
+        unsigned int rate = bufrate.load();
+        return rate ? silence.load() * 1000 / rate : 0;
+    }
+    void endRebuffer(StreamCtx *ctx);
+    void trimBuffer();
+    void dropFrame();
+    long long depthsamples(int ms) {
+        return (long long)ms * bufrate.load() / 1000;
+    }
+    void dropPartial();
+
+    int httpport;
+    int depthms;
+    int trimslackms;
+    struct MHD_Daemon *mhd;
+
+    // Network side, only accessed by the network thread while it runs
+    int fd;
+    struct sockaddr_in sender;
+    std::thread netthread;
+    bool havenext;
+    // Next frame to queue, and highest seen
+    unsigned int nextframe;
+    unsigned int highest;
+    // Out of order frames waiting for a missing one
+    map<unsigned int, AudioFrame, FrameCmp> pending;
+    std::chrono::steady_clock::time_point gapsince;
+    std::atomic<bool> stopreq;
+    bool unsupportedlogged;
+
+    // Control (start/stop) and HTTP reader side
+    std::mutex controlmutex;
+    std::mutex readmutex;
+    std::atomic<bool> active;
+    std::atomic<unsigned int> httpserial;
+
+    FrameRing ring;
+    // Bytes already read from the oldest ring frame (readmutex)
+    size_t readoffs;
+    // Buffered audio: samples and rate (for computing the duration)
+    std::atomic<long long> bufsamples;
+    std::atomic<unsigned int> bufrate;
+
+    std::atomic<unsigned long long> frames;
+    std::atomic<unsigned long long> late;
+    std::atomic<unsigned long long> lost;
+    std::atomic<unsigned long long> resent;
+    std::atomic<unsigned long long> overruns;
+    std::atomic<unsigned long long> underruns;
+    std::atomic<unsigned long long> dropped;
+    // Silence sent (samples)
+    std::atomic<unsigned long long> silence;
+    std::atomic<int> latencyms;
+};
+
+OhmReceiver::OhmReceiver(int httpport, int depthms)
+{
+    m = new Internal(httpport, depthms);
+}
+
+OhmReceiver::~OhmReceiver()
+{
+    stop();
+    delete m;
+}
+
+bool OhmReceiver::canPlay(const string& uri)
+{
+    return uri.find("ohm://") == 0 || uri.find("ohu://") == 0;
+}
+
+bool OhmReceiver::running()
+{
+    return m->active;
+}
+
+// Parse ohm://host:port or ohu://host:port and open the socket. For
+// multicast, we join the group and receive on its port, for unicast
+// the sender sends to the address our messages come from.
+bool OhmReceiver::Internal::openSocket(const string& uri)
+{
+    bool multicast = uri.find("ohm://") == 0;
+    string hostport = uri.substr(6);
+    string::size_type slash = hostport.find('/');
+    if (slash != string::npos) {
+        hostport.erase(slash);
+    }
+    string::size_type colon = hostport.find(':');
+    if (colon == string::npos) {
+        LOGERR("OhmReceiver: no port in " << uri << endl);
+        return false;
+    }
+    int port = atoi(hostport.substr(colon + 1).c_str());
+    memset(&sender, 0, sizeof(sender));
+    sender.sin_family = AF_INET;
+    sender.sin_port = htons(port);
+    if (inet_pton(AF_INET, hostport.substr(0, colon).c_str(),
+                  &sender.sin_addr) != 1) {
+        LOGERR("OhmReceiver: bad address in " << uri << endl);
+        return false;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOGERR("OhmReceiver: socket() failed, errno " << errno << endl);
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Room for a few hundred ms of audio while we are not scheduled
+    int rcvbuf = 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = multicast ? sender.sin_port : 0;
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        LOGERR("OhmReceiver: bind() failed, errno " << errno << endl);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    if (multicast) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = sender.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                       sizeof(mreq)) < 0) {
+            LOGERR("OhmReceiver: can't join " << uri << " errno " << errno <<
+                   endl);
+            close(fd);
+            fd = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+void OhmReceiver::Internal::sendMsg(int type, const unsigned char *body,
+                                    size_t len)
+{
+    vector<unsigned char> msg(ohmHeaderSize + len);
+    memcpy(&msg[0], "Ohm ", 4);
+    msg[4] = 1;
+    msg[5] = type;
+    msg[6] = (msg.size() >> 8) & 0xff;
+    msg[7] = msg.size() & 0xff;
+    if (len) {
+        memcpy(&msg[ohmHeaderSize], body, len);
+    }
+    if (sendto(fd, &msg[0], msg.size(), 0, (struct sockaddr *)&sender,
+               sizeof(sender)) < 0) {
+        LOGDEB("OhmReceiver: sendto failed, errno " << errno << endl);
+    }
+}
+
+void OhmReceiver::Internal::requestResend(unsigned int from, unsigned int to)
+{
+    unsigned int count = to - from;
+    if (count > resendMax) {
+        from = to - resendMax;
+        count = resendMax;
+    }
+    if (count == 0) {
+        return;
+    }
+    vector<unsigned char> body(4 + 4 * count);
+    setbe32(&body[0], count);
+    for (unsigned int i = 0; i < count; i++) {
+        setbe32(&body[4 + 4 * i], from + i);
+    }
+    sendMsg(OHM_RESEND, &body[0], body.size());
+    resent += count;
+}
+
+// Check an audio message and convert the samples to little-endian.
+bool OhmReceiver::Internal::decodeAudio(const unsigned char *msg, size_t len,
+                                        AudioFrame& frame)
+{
+    if (len < size_t(ohmHeaderSize + ohmAudioHeaderSize)) {
+        return false;
+    }
+    const unsigned char *hdr = msg + ohmHeaderSize;
+    unsigned int hdrsize = hdr[0];
+    frame.samples = be16(hdr + 2);
+    unsigned int latency = be32(hdr + 12);
+    frame.samplerate = be32(hdr + 36);
+    frame.bitdepth = hdr[46];
+    frame.channels = hdr[47];
+    unsigned int codecnamelen = hdr[49];
+    size_t dataoffs = ohmHeaderSize + hdrsize + codecnamelen;
+    if (hdrsize < size_t(ohmAudioHeaderSize) || dataoffs > len) {
+        return false;
+    }
+    // The latency unit is 1/256 of a sample at 44.1 or 48 kHz,
+    // depending on the rate family.
+    unsigned int base = frame.samplerate % 441 == 0 ? 44100 : 48000;
+    latencyms = int((unsigned long long)latency * 1000 / (256 * base));
+
+    int bytes = frame.bitdepth / 8;
+    if ((bytes != 2 && bytes != 3 && bytes != 4) || frame.channels <= 0 ||
+        frame.samplerate == 0) {
+        if (!unsupportedlogged) {
+            LOGERR("OhmReceiver: unsupported format: bits " <<
+                   frame.bitdepth << " channels " << frame.channels <<
+                   " rate " << frame.samplerate << endl);
+            unsupportedlogged = true;
+        }
+        return false;
+    }
+    size_t datalen = size_t(frame.samples) * frame.channels * bytes;
+    if (dataoffs + datalen > len) {
+        return false;
+    }
+    frame.data.resize(datalen);
+    const unsigned char *in = msg + dataoffs;
+    char *out = &frame.data[0];
+    for (size_t i = 0; i < datalen; i += bytes) {
+        for (int j = 0; j < bytes; j++) {
+            out[i + j] = in[i + bytes - 1 - j];
+        }
+    }
+    return true;
+}
+
+void OhmReceiver::Internal::queueFrame(AudioFrame& frame)
+{
+    frames++;
+    if (frame.samples == 0) {
+        return;
+    }
+    AudioFrame *slot = ring.writeSlot();
+    if (nullptr == slot) {
+        overruns++;
+        return;
+    }
+    slot->samplerate = frame.samplerate;
+    slot->bitdepth = frame.bitdepth;
+    slot->channels = frame.channels;
+    slot->samples = frame.samples;
+    slot->data.swap(frame.data);
+    bufrate = frame.samplerate;
+    bufsamples += frame.samples;
+    ring.commit();
+}
+
+// Queue the pending frames which are now in sequence. With giveup,
+// first skip the missing frame(s) before the oldest pending one.
+void OhmReceiver::Internal::flushPending(bool giveup)
+{
+    if (giveup && !pending.empty()) {
+        unsigned int first = pending.begin()->first;
+        LOGDEB("OhmReceiver: lost frames " << nextframe << " to " <<
+               first - 1 << endl);
+        lost += first - nextframe;
+        nextframe = first;
+    }
+    auto it = pending.begin();
+    while (it != pending.end() && it->first == nextframe) {
+        queueFrame(it->second);
+        nextframe++;
+        it = pending.erase(it);
+    }
+    if (!pending.empty()) {
+        gapsince = std::chrono::steady_clock::now();
+    }
+}
+
+void OhmReceiver::Internal::processAudio(const unsigned char *msg, size_t len)
+{
+    AudioFrame frame;
+    if (!decodeAudio(msg, len, frame)) {
+        return;
+    }
+    unsigned int fnum = be32(msg + ohmHeaderSize + 4);
+    if (!havenext) {
+        havenext = true;
+        nextframe = highest = fnum;
+    }
+    int32_t d = int32_t(fnum - nextframe);
+    if (d < 0) {
+        late++;
+        return;
+    }
+    if (int32_t(fnum - highest) > 0) {
+        if (fnum - highest > 1) {
+            requestResend(highest + 1, fnum);
+        }
+        highest = fnum;
+    }
+    if (d == 0) {
+        queueFrame(frame);
+        nextframe++;
+        flushPending(false);
+        return;
+    }
+    if (pending.find(fnum) != pending.end()) {
+        late++;
+        return;
+    }
+    if (pending.empty()) {
+        gapsince = std::chrono::steady_clock::now();
+    }
+    pending[fnum].data.swap(frame.data);
+    AudioFrame& pf = pending[fnum];
+    pf.samplerate = frame.samplerate;
+    pf.bitdepth = frame.bitdepth;
+    pf.channels = frame.channels;
+    pf.samples = frame.samples;
+    if (pending.size() > reorderMax) {
+        flushPending(true);
+    }
+}
+
+void OhmReceiver::Internal::logStats(bool final)
+{
+    string s = string("OhmReceiver: frames ") + to_string(frames) +
+        " late " + to_string(late) + " lost " + to_string(lost) +
+        " resent " + to_string(resent) + " overruns " + to_string(overruns) +
+        " underruns " + to_string(underruns) + " dropped " +
+        to_string(dropped) + " silence " + to_string(silencems()) +
+        " mS, buffer " +
+        to_string(bufferedms()) + " mS, sender latency " +
+        to_string(latencyms) + " mS\n";
+    if (final) {
+        LOGINF(s);
+    } else {
+        LOGDEB(s);
+    }
+}
+
+void OhmReceiver::Internal::netloop()
+{
+    // Frames are waited for at most this long before being given up,
+    // so that the reordering does not eat up all the buffer.
+    int gapwaitms = depthms > 40 ? depthms / 2 : 20;
+    auto lastlisten = std::chrono::steady_clock::now();
+    auto laststats = lastlisten;
+    vector<unsigned char> buf(65536);
+
+    sendMsg(OHM_JOIN);
+    sendMsg(OHM_LISTEN);
+    while (!stopreq) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, 20);
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - lastlisten).count() >= listenIntervalMs) {
+            sendMsg(OHM_LISTEN);
+            lastlisten = now;
+        }
+        if (!pending.empty() &&
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - gapsince).count() >= gapwaitms) {
+            flushPending(true);
+        }
+        if (std::chrono::duration_cast<std::chrono::seconds>(
+                now - laststats).count() >= 10) {
+            logStats(false);
+            laststats = now;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+        ssize_t len = recv(fd, &buf[0], buf.size(), 0);
+        if (len < ohmHeaderSize || memcmp(&buf[0], "Ohm ", 4)) {
+            continue;
+        }
+        switch (buf[5]) {
+        case OHM_AUDIO:
+            processAudio(&buf[0], len);
+            break;
+        case OHM_SLAVE:
+            // We would have to forward the audio to other receivers
+            // in the group, which we don't do.
+            LOGDEB1("OhmReceiver: ignoring slave message\n");
+            break;
+        default:
+            // Our own messages (multicast), track, metatext...
+            break;
+        }
+    }
+    sendMsg(OHM_LEAVE);
+}
+
+bool OhmReceiver::start(const string& uri)
+{
+    LOGDEB("OhmReceiver::start: " << uri << endl);
+    if (!canPlay(uri)) {
+        LOGERR("OhmReceiver: unsupported uri " << uri << endl);
+        return false;
+    }
+    stop();
+    std::unique_lock<std::mutex> lock(m->controlmutex);
+    // Open the socket first: stop() does nothing if we are not
+    // active, and the daemon would keep the port.
+    if (!m->openSocket(uri)) {
+        return false;
+    }
+    if (!m->startHttp()) {
+        close(m->fd);
+        m->fd = -1;
+        return false;
+    }
+    m->havenext = false;
+    m->pending.clear();
+    m->unsupportedlogged = false;
+    m->frames = m->late = m->lost = m->resent = 0;
+    m->overruns = m->underruns = m->dropped = m->silence = 0;
+    m->latencyms = 0;
+    m->stopreq = false;
+    m->active = true;
+    m->netthread = std::thread(&Internal::netloop, m);
+    return true;
+}
+
+void OhmReceiver::stop()
+{
+    std::unique_lock<std::mutex> lock(m->controlmutex);
+    if (!m->active) {
+        return;
+    }
+    LOGDEB("OhmReceiver::stop\n");
+    m->stopreq = true;
+    m->netthread.join();
+    close(m->fd);
+    m->fd = -1;
+    m->logStats(true);
+    // End the current HTTP stream and drop the buffered data.
+    m->active = false;
+    m->httpserial++;
+    {
+        std::unique_lock<std::mutex> rlock(m->readmutex);
+        m->ring.drain();
+        m->readoffs = 0;
+        m->bufsamples = 0;
+    }
+    // The port is shared with sc2mpd, which we may have to use for
+    // the next sender, so don't keep it.
+    if (m->mhd) {
+        MHD_stop_daemon(m->mhd);
+        m->mhd = nullptr;
+    }
+}
+
+OhmReceiver::Stats OhmReceiver::getStats()
+{
+    Stats stats;
+    stats.frames = m->frames;
+    stats.late = m->late;
+    stats.lost = m->lost;
+    stats.resent = m->resent;
+    stats.overruns = m->overruns;
+    stats.underruns = m->underruns;
+    stats.dropped = m->dropped;
+    stats.silencems = m->silencems();
+    stats.bufferms = m->bufferedms();
+    stats.latencyms = m->latencyms;
+    return stats;
+}
+
+// State for one HTTP stream (there is only one current at a time, an
+// older one ends when a newer one starts)
+struct StreamCtx {
+    OhmReceiver::Internal *m;
+    unsigned int serial;
+    string header;
+    size_t hdroffs;
+    unsigned int samplerate;
+    int bitdepth;
+    int channels;
+    size_t blockalign;
+    // Pacing: stream start time and audio bytes sent since
+    Clock::time_point start;
+    unsigned long long sentbytes;
+    // Refilling the buffer after an underrun, and silence sent
+    // meanwhile (samples)
+    bool rebuffering;
+    long long silencesamples;
+};
+
+static void setle32(string& s, unsigned int v)
+{
+    for (int i = 0; i < 4; i++) {
+        s += char((v >> (8 * i)) & 0xff);
+    }
+}
+
+static void setle16(string& s, unsigned int v)
+{
+    s += char(v & 0xff);
+    s += char((v >> 8) & 0xff);
+}
+
+// WAV header for an endless stream.
+static string wavheader(unsigned int rate, int bits, int channels)
+{
+    int blockalign = channels * bits / 8;
+    string s("RIFF");
+    setle32(s, 0xffffffff);
+    s += "WAVEfmt ";
+    setle32(s, 16);
+    setle16(s, 1);
+    setle16(s, channels);
+    setle32(s, rate);
+    setle32(s, rate * blockalign);
+    setle16(s, blockalign);
+    setle16(s, bits);
+    s += "data";
+    setle32(s, 0xffffffff);
+    return s;
+}
+
+// Drop the oldest frame. Called with readmutex held, at a frame
+// boundary.
+void OhmReceiver::Internal::dropFrame()
+{
+    AudioFrame *frame = ring.readSlot();
+    if (frame) {
+        bufsamples -= frame->samples;
+        ring.release();
+        dropped++;
+    }
+}
+
+// The sender clock is faster than ours, or a burst came in: drop
+// frames if the buffer exceeds the depth by more than the margin.
+// Called with readmutex held, at a frame boundary.
+void OhmReceiver::Internal::trimBuffer()
+{
+    long long high = depthsamples(depthms + trimslackms);
+    if (bufsamples <= high) {
+        return;
+    }
+    int count = 0;
+    AudioFrame *frame;
+    while ((frame = ring.readSlot()) != nullptr &&
+           bufsamples - frame->samples >= high) {
+        dropFrame();
+        count++;
+    }
+    LOGDEB1("OhmReceiver: dropped " << count << " frames, buffer " <<
+            bufferedms() << " mS\n");
+}
+
+// The buffer is refilled after an underrun. The audio beyond the
+// depth arrived late, and was replaced by the silence we sent: drop it
+// so that the latency does not grow. Called with readmutex held.
+void OhmReceiver::Internal::endRebuffer(StreamCtx *ctx)
+{
+    ctx->rebuffering = false;
+    long long excess = min(bufsamples - depthsamples(depthms),
+                           ctx->silencesamples);
+    long long droppedsamples = 0;
+    AudioFrame *frame;
+    while ((frame = ring.readSlot()) != nullptr &&
+           droppedsamples + frame->samples <= excess) {
+        droppedsamples += frame->samples;
+        dropFrame();
+    }
+    LOGDEB("OhmReceiver: buffer refilled. Sent " <<
+           ctx->silencesamples * 1000 / ctx->samplerate <<
+           " mS of silence, dropped " <<
+           droppedsamples * 1000 / ctx->samplerate << " mS of late audio\n");
+}
+
+ssize_t OhmReceiver::Internal::sendSilence(StreamCtx *ctx, char *buf,
+                                           size_t max)
+{
+    size_t cnt = min(max, ctx->samplerate * silenceChunkMs / 1000 *
+                     ctx->blockalign);
+    cnt -= cnt % ctx->blockalign;
+    if (cnt == 0) {
+        cnt = ctx->blockalign;
+    }
+    memset(buf, 0, cnt);
+    ctx->sentbytes += cnt;
+    long long samples = cnt / ctx->blockalign;
+    ctx->silencesamples += samples;
+    silence += samples;
+    return cnt;
+}
+
+// HTTP data callback. This is called in the connection thread, and
+// must return some data or end the stream.
+ssize_t OhmReceiver::Internal::read(unsigned int serial, StreamCtx *ctx,
+                                    char *buf, size_t max)
+{
+    // Wait for the prefill, then set the format from the first frame
+    if (ctx->header.empty()) {
+        int waited = 0;
+        while (active && serial == httpserial && bufferedms() < depthms) {
+            if (waited >= prefillWaitMs) {
+                LOGERR("OhmReceiver: no audio data\n");
+                return MHD_CONTENT_READER_END_WITH_ERROR;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            waited += 5;
+        }
+        std::unique_lock<std::mutex> lock(readmutex);
+        AudioFrame *frame;
+        if (!active || serial != httpserial ||
+            (frame = ring.readSlot()) == nullptr) {
+            return MHD_CONTENT_READER_END_OF_STREAM;
+        }
+        ctx->samplerate = frame->samplerate;
+        ctx->bitdepth = frame->bitdepth;
+        ctx->channels = frame->channels;
+        ctx->blockalign = ctx->channels * ctx->bitdepth / 8;
+        ctx->header = wavheader(ctx->samplerate, ctx->bitdepth, ctx->channels);
+        ctx->start = Clock::now();
+        ctx->sentbytes = 0;
+        ctx->rebuffering = false;
+        ctx->silencesamples = 0;
+        // MPD may have connected long after the start of the stream
+        trimBuffer();
+        LOGDEB("OhmReceiver: stream start: rate " << ctx->samplerate <<
+               " bits " << ctx->bitdepth << " channels " << ctx->channels <<
+               " buffer " << bufferedms() << " mS\n");
+    }
+    if (ctx->hdroffs < ctx->header.size()) {
+        size_t cnt = min(max, ctx->header.size() - ctx->hdroffs);
+        memcpy(buf, ctx->header.c_str() + ctx->hdroffs, cnt);
+        ctx->hdroffs += cnt;
+        return cnt;
+    }
+
+    long long bytespersec = (long long)ctx->samplerate * ctx->blockalign;
+    long long maxlead = bytespersec * readAheadMs / 1000;
+    for (;;) {
+        if (!active || serial != httpserial) {
+            return MHD_CONTENT_READER_END_OF_STREAM;
+        }
+        // How far we are ahead of real time
+        long long elapsedus = std::chrono::duration_cast<
+            std::chrono::microseconds>(Clock::now() - ctx->start).count();
+        long long lead = (long long)ctx->sentbytes -
+            elapsedus * bytespersec / 1000000;
+        if (lead >= maxlead) {
+            long long waitus = (lead - maxlead) * 1000000 / bytespersec;
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(min(waitus + 500, 10000LL)));
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(readmutex);
+        if (!active || serial != httpserial) {
+            return MHD_CONTENT_READER_END_OF_STREAM;
+        }
+        if (ctx->rebuffering) {
+            if (bufferedms() < depthms) {
+                // Don't get further ahead than for real audio
+                return sendSilence(ctx, buf, min(max, size_t(maxlead - lead)));
+            }
+            endRebuffer(ctx);
+        } else if (readoffs == 0) {
+            trimBuffer();
+        }
+        AudioFrame *frame = ring.readSlot();
+        if (frame) {
+            if (frame->samplerate != ctx->samplerate ||
+                frame->bitdepth != ctx->bitdepth ||
+                frame->channels != ctx->channels) {
+                // Can't change the format inside a WAV stream.
+                LOGERR("OhmReceiver: audio format changed, ending stream\n");
+                return MHD_CONTENT_READER_END_OF_STREAM;
+            }
+            size_t cnt = min(max, frame->data.size() - readoffs);
+            memcpy(buf, &frame->data[readoffs], cnt);
+            readoffs += cnt;
+            if (readoffs == frame->data.size()) {
+                bufsamples -= frame->samples;
+                ring.release();
+                readoffs = 0;
+            }
+            ctx->sentbytes += cnt;
+            return cnt;
+        }
+        lock.unlock();
+        if (lead > 0) {
+            // MPD still has some of what we sent. Wait for data.
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        // Nothing came in time: send silence until the buffer is
+        // refilled to the full depth.
+        LOGDEB("OhmReceiver: underrun\n");
+        underruns++;
+        ctx->rebuffering = true;
+        ctx->silencesamples = 0;
+    }
+}
+
+// Drop the frame partially read by a previous stream, so that the
+// new one starts on a sample boundary.
+void OhmReceiver::Internal::dropPartial()
+{
+    std::unique_lock<std::mutex> lock(readmutex);
+    AudioFrame *frame;
+    if (readoffs && (frame = ring.readSlot()) != nullptr) {
+        bufsamples -= frame->samples;
+        ring.release();
+    }
+    readoffs = 0;
+}
+
+static ssize_t content_reader(void *cls, uint64_t, char *buf, size_t max)
+{
+    StreamCtx *ctx = (StreamCtx *)cls;
+    return ctx->m->read(ctx->serial, ctx, buf, max);
+}
+
+static void content_free(void *cls)
+{
+    delete (StreamCtx *)cls;
+}
+
+static int answer_to_connection(void *cls, struct MHD_Connection *connection,
+                                const char *url,
+                                const char *method, const char *version,
+                                const char *upload_data,
+                                size_t *upload_data_size, void **con_cls)
+{
+    static int aptr;
+    if (&aptr != *con_cls) {
+        /* do not respond on first call */
+        *con_cls = &aptr;
+        return MHD_YES;
+    }
+    LOGDEB("OhmReceiver: HTTP " << method << " " << url << endl);
+    OhmReceiver::Internal *m = (OhmReceiver::Internal *)cls;
+    if (!m->active) {
+        return MHD_NO;
+    }
+
+    // A new stream supersedes the current one
+    StreamCtx *ctx = new StreamCtx;
+    ctx->m = m;
+    ctx->serial = ++m->httpserial;
+    ctx->hdroffs = 0;
+    ctx->sentbytes = 0;
+    ctx->rebuffering = false;
+    ctx->silencesamples = 0;
+    m->dropPartial();
+    struct MHD_Response *response =
+        MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 16 * 1024,
+                                          content_reader, ctx, content_free);
+    if (response == NULL) {
+        LOGERR("OhmReceiver: could not create response" << endl);
+        delete ctx;
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", "audio/wav");
+    int ret = MHD_queue_response(connection, 200, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Only MPD on the local host is supposed to connect.
+static int accept_policy(void *, const struct sockaddr* sa, socklen_t addrlen)
+{
+    if (sa->sa_family == AF_INET &&
+        ((struct sockaddr_in *)sa)->sin_addr.s_addr == htonl(INADDR_LOOPBACK)) {
+        return MHD_YES;
+    }
+    return MHD_NO;
+}
+
+bool OhmReceiver::Internal::startHttp()
+{
+    if (mhd) {
+        return true;
+    }
+    LOGDEB("OhmReceiver: starting httpd on port " << httpport << endl);
+    mhd = MHD_start_daemon(
+        MHD_USE_THREAD_PER_CONNECTION, httpport,
+        /* Accept policy callback and arg */
+        accept_policy, NULL,
+        /* handler and arg */
+        &answer_to_connection, this,
+        MHD_OPTION_END);
+    if (nullptr == mhd) {
+        LOGERR("OhmReceiver: MHD_start_daemon failed\n");
+        return false;
+    }
+    return true;
+}
+
+#ifdef OHMRECEIVER_TEST
+// Loopback test: a local unicast sender sends real time audio, with
+// the frame number stored in the samples, and goes through a few
+// network and clock troubles. A client reads the HTTP stream as fast
+// as it can, like MPD would, and we check that the stream does not get
+// ahead of real time, and that the latency (from the nominal send
+// time of a frame to its play time, if the stream is played from the
+// time it starts) stays within the depth.
+
+#include <stdio.h>
+
+#include <iostream>
+
+static const int tstRate = 48000;
+static const int tstFrameSamples = 240;
+static const int tstDepthMs = 100;
+static const int tstHttpPort = 8768;
+
+enum Scenario {SC_NORMAL, SC_REORDER, SC_DROP, SC_STALL, SC_FAST, SC_SLOW};
+static const char *scnames[] = {"normal", "reorder", "drop+resend",
+                                "stall+burst", "fast clock", "slow clock"};
+
+static int sendfd;
+static struct sockaddr_in rcvaddr;
+static std::atomic<bool> tstdone(false);
+static std::mutex sentmutex;
+// Nominal send time of each frame
+static vector<Clock::time_point> senttimes;
+
+static void sendframe(unsigned int fnum)
+{
+    unsigned char msg[ohmHeaderSize + ohmAudioHeaderSize + 3 +
+                      tstFrameSamples * 4];
+    memset(msg, 0, sizeof(msg));
+    memcpy(msg, "Ohm ", 4);
+    msg[4] = 1;
+    msg[5] = OHM_AUDIO;
+    msg[6] = sizeof(msg) >> 8;
+    msg[7] = sizeof(msg) & 0xff;
+    unsigned char *hdr = msg + ohmHeaderSize;
+    hdr[0] = ohmAudioHeaderSize;
+    hdr[2] = tstFrameSamples >> 8;
+    hdr[3] = tstFrameSamples & 0xff;
+    setbe32(hdr + 4, fnum);
+    setbe32(hdr + 12, tstDepthMs * 256 * 48);
+    setbe32(hdr + 36, tstRate);
+    hdr[46] = 16;
+    hdr[47] = 2;
+    hdr[49] = 3;
+    memcpy(hdr + ohmAudioHeaderSize, "PCM", 3);
+    // Left: frame number low bits, right: high bits (big-endian)
+    unsigned char *data = hdr + ohmAudioHeaderSize + 3;
+    for (int i = 0; i < tstFrameSamples; i++) {
+        data[4 * i] = (fnum >> 8) & 0xff;
+        data[4 * i + 1] = fnum & 0xff;
+        data[4 * i + 2] = (fnum >> 24) & 0xff;
+        data[4 * i + 3] = (fnum >> 16) & 0xff;
+    }
+    sendto(sendfd, msg, sizeof(msg), 0, (struct sockaddr *)&rcvaddr,
+           sizeof(rcvaddr));
+}
+
+// Answer the resend requests which came in
+static void tstresend()
+{
+    unsigned char buf[2000];
+    ssize_t len;
+    while ((len = recv(sendfd, buf, sizeof(buf), MSG_DONTWAIT)) >= 12) {
+        if (buf[5] != OHM_RESEND) {
+            continue;
+        }
+        unsigned int count = be32(buf + 8);
+        for (unsigned int i = 0; i < count && 12 + 4 * i + 4 <= size_t(len);
+             i++) {
+            sendframe(be32(buf + 12 + 4 * i));
+        }
+    }
+}
+
+static void sender(const vector<Scenario>& scenarios, int secs)
+{
+    // Wait for the receiver to join
+    unsigned char buf[2000];
+    socklen_t alen = sizeof(rcvaddr);
+    for (;;) {
+        ssize_t len = recvfrom(sendfd, buf, sizeof(buf), 0,
+                               (struct sockaddr *)&rcvaddr, &alen);
+        if (len >= ohmHeaderSize && buf[5] == OHM_JOIN) {
+            break;
+        }
+    }
+    // Frame numbers start at 1, so that silence is recognizable
+    unsigned int fnum = 1;
+    Clock::time_point next = Clock::now();
+    for (auto sc : scenarios) {
+        cerr << "Sender: " << scnames[sc] << endl;
+        double speed = sc == SC_FAST ? 1.02 : sc == SC_SLOW ? 0.98 : 1.0;
+        auto period = std::chrono::microseconds(
+            int64_t(tstFrameSamples * 1e6 / tstRate / speed));
+        Clock::time_point end = next + std::chrono::seconds(secs);
+        Clock::time_point stallend = next + std::chrono::milliseconds(
+            sc == SC_STALL ? 2 * tstDepthMs + 100 : 0);
+        unsigned int held = 0;
+        while (next < end) {
+            {
+                std::unique_lock<std::mutex> lock(sentmutex);
+                senttimes.push_back(next);
+            }
+            if (sc == SC_STALL && next < stallend) {
+                // Nothing goes out, then the lot all at once
+                held++;
+            } else if (held) {
+                for (unsigned int f = fnum - held; f <= fnum; f++) {
+                    sendframe(f);
+                }
+                held = 0;
+            } else if (sc == SC_REORDER && fnum % 2 == 1) {
+                // Sent with the next one
+            } else if (sc == SC_REORDER) {
+                sendframe(fnum);
+                sendframe(fnum - 1);
+            } else if (sc == SC_DROP && fnum % 20 == 0) {
+                // Lost, will be asked again
+            } else {
+                sendframe(fnum);
+            }
+            fnum++;
+            next += period;
+            tstresend();
+            std::this_thread::sleep_until(next);
+        }
+    }
+    tstdone = true;
+}
+
+struct TstResult {
+    TstResult() : frames(0), maxlatencyms(0), reordered(0), silence(0),
+                  maxleadms(0) {}
+    unsigned int frames;
+    int maxlatencyms;
+    unsigned int reordered;
+    unsigned long long silence;
+    int maxleadms;
+};
+
+// Read the stream as fast as we can, and check each frame latency
+static bool client(TstResult& res)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tstHttpPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        cerr << "Client: connect failed, errno " << errno << endl;
+        return false;
+    }
+    const char *req = "GET /Songcast.wav HTTP/1.0\r\n\r\n";
+    if (write(fd, req, strlen(req)) < 0) {
+        return false;
+    }
+    string hdr;
+    char c;
+    while (hdr.find("\r\n\r\n") == string::npos && ::read(fd, &c, 1) == 1) {
+        hdr += c;
+    }
+    // WAV header, then 4 bytes per sample
+    size_t skip = 44;
+    unsigned char sample[4];
+    size_t soffs = 0;
+    unsigned int last = 0;
+    unsigned long long samples = 0;
+    Clock::time_point start;
+    char buf[8192];
+    ssize_t len;
+    while (!tstdone && (len = ::read(fd, buf, sizeof(buf))) > 0) {
+        Clock::time_point now = Clock::now();
+        for (ssize_t i = 0; i < len; i++) {
+            if (skip) {
+                if (--skip == 0) {
+                    start = now;
+                }
+                continue;
+            }
+            sample[soffs++] = buf[i];
+            if (soffs < 4) {
+                continue;
+            }
+            soffs = 0;
+            samples++;
+            unsigned int fnum = sample[0] | (sample[1] << 8) |
+                (sample[2] << 16) | (sample[3] << 24);
+            if (fnum == 0) {
+                res.silence++;
+                continue;
+            }
+            if (fnum == last) {
+                continue;
+            }
+            if (fnum < last) {
+                res.reordered++;
+            }
+            last = fnum;
+            res.frames++;
+            Clock::time_point sent;
+            {
+                std::unique_lock<std::mutex> lock(sentmutex);
+                sent = senttimes[fnum - 1];
+            }
+            Clock::time_point played = start + std::chrono::microseconds(
+                (samples - 1) * 1000000 / tstRate);
+            int latency = int(std::chrono::duration_cast<
+                              std::chrono::milliseconds>(
+                                  played - sent).count());
+            res.maxlatencyms = max(res.maxlatencyms, latency);
+        }
+        if (!skip) {
+            int lead = int(samples * 1000 / tstRate -
+                           std::chrono::duration_cast<
+                           std::chrono::milliseconds>(now - start).count());
+            res.maxleadms = max(res.maxleadms, lead);
+        }
+    }
+    close(fd);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        Logger::getTheLog("stderr")->setLogLevel(Logger::LLDEB);
+    }
+    sendfd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    if (bind(sendfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(sendfd, (struct sockaddr *)&addr, &alen) < 0) {
+        cerr << "Can't bind the sender socket\n";
+        return 1;
+    }
+    string uri = string("ohu://127.0.0.1:") + to_string(ntohs(addr.sin_port));
+
+    OhmReceiver receiver(tstHttpPort, tstDepthMs);
+    if (!receiver.start(uri)) {
+        cerr << "Can't start the receiver on " << uri << endl;
+        return 1;
+    }
+    vector<Scenario> scenarios{SC_NORMAL, SC_REORDER, SC_DROP, SC_STALL,
+            SC_NORMAL, SC_FAST, SC_SLOW};
+    std::thread sthread(sender, scenarios, 3);
+    // Let the buffer fill up
+    std::this_thread::sleep_for(std::chrono::milliseconds(tstDepthMs / 2));
+    TstResult res;
+    bool ok = client(res);
+    sthread.join();
+    OhmReceiver::Stats stats = receiver.getStats();
+    receiver.stop();
+
+    // The latency limit is the depth, the trimming margin and the
+    // read-ahead, plus a frame and some scheduling slack.
+    int maxlatency = tstDepthMs + max(tstDepthMs / 4, 20) + readAheadMs + 15;
+    cout << "frames " << stats.frames << " late " << stats.late <<
+        " lost " << stats.lost << " resent " << stats.resent <<
+        " overruns " << stats.overruns << " underruns " << stats.underruns <<
+        " dropped " << stats.dropped << " silence " << stats.silencems <<
+        " mS" << endl;
+    cout << "client: frames " << res.frames << " reordered " <<
+        res.reordered << " silence " << res.silence * 1000 / tstRate <<
+        " mS, max latency " << res.maxlatencyms << " mS (limit " <<
+        maxlatency << "), max lead " << res.maxleadms << " mS" << endl;
+    if (!ok || res.frames == 0 || res.reordered ||
+        res.maxlatencyms > maxlatency || res.maxleadms > readAheadMs + 10 ||
+        stats.underruns == 0 || stats.dropped == 0) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
+#endif // OHMRECEIVER_TEST
@@ -0,0 +1,93 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _OHMRECEIVER_H_INCLUDED_
+#define _OHMRECEIVER_H_INCLUDED_
+
+#include <string>
+
+/// In-process Songcast audio receiver, an alternative to running
+/// sc2mpd in mpd mode.
+///
+/// This joins an ohm (multicast) or ohu (unicast) Songcast stream,
+/// reorders the audio frames and queues them in a jitter buffer, and
+/// serves the PCM data as an endless WAV stream on
+/// http://localhost:<port>/Songcast.wav, for MPD to play.
+///
+/// Missing frames are requested again from the sender, and given up
+/// when they are too old. The HTTP stream starts when the buffer
+/// holds the configured duration, and is then paced to real time, so
+/// that MPD can't read ahead: the latency is the buffer depth plus
+/// what MPD itself needs for starting. If the buffer runs dry,
+/// silence is sent until it is refilled to the configured depth, and
+/// the late audio which the silence replaced is then dropped. If the
+/// sender clock is faster than ours, the buffer grows, and frames are
+/// dropped when it exceeds the depth by a margin. The HTTP server only
+/// runs while we are receiving.
+///
+/// ohz (zone) uris are not supported, and we do not forward the
+/// audio to other receivers when the sender asks us to (unicast slave
+/// messages).
+class OhmReceiver {
+public:
+    /// @param httpport local port for the HTTP stream.
+    /// @param depthms jitter buffer depth (prefill) in milliseconds.
+    OhmReceiver(int httpport, int depthms);
+    ~OhmReceiver();
+
+    /// Check if we can handle this sender uri (ohm:// or ohu://).
+    static bool canPlay(const std::string& uri);
+
+    /// Join the stream. Any current stream is left first.
+    bool start(const std::string& uri);
+    /// Leave the stream and end the HTTP response.
+    void stop();
+    bool running();
+
+    struct Stats {
+        Stats()
+            : frames(0), late(0), lost(0), resent(0), overruns(0),
+              underruns(0), dropped(0), silencems(0), bufferms(0),
+              latencyms(0) {}
+        // Audio frames received, in sequence or reordered
+        unsigned long long frames;
+        // Frames arriving after we gave up on them, or duplicates
+        unsigned long long late;
+        // Frames which never arrived
+        unsigned long long lost;
+        // Frames we asked the sender to send again
+        unsigned long long resent;
+        // Frames dropped because the buffer was full
+        unsigned long long overruns;
+        // Times the buffer ran dry
+        unsigned long long underruns;
+        // Frames dropped for keeping the latency to the depth
+        unsigned long long dropped;
+        // Silence sent while the buffer was refilled after underruns
+        unsigned long long silencems;
+        // Audio currently buffered
+        int bufferms;
+        // Latency requested by the sender
+        int latencyms;
+    };
+    Stats getStats();
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _OHMRECEIVER_H_INCLUDED_ */
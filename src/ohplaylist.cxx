@@ -27,7 +27,6 @@
 #include <utility>
 #include <vector>
 
-#include "libupnpp/base64.hxx"
 #include "libupnpp/log.hxx"
 #include "libupnpp/soaphelp.hxx"
 #include "libupnpp/upnpavutils.hxx"
@@ -44,11 +43,16 @@ using namespace std::placeholders;
 
 static const string sTpProduct("urn:av-openhome-org:service:Playlist:1");
 static const string sIdProduct("urn:av-openhome-org:serviceId:Playlist");
+// MPD stored playlist for saving the queue while another source is
+// active.
+static const string sSavePlaylist("upmpdcli-ohplaylist");
 
 // Playlist is the default oh service, so it's active when starting up
-OHPlaylist::OHPlaylist(UpMpd *dev, unsigned int cssleep)
+OHPlaylist::OHPlaylist(UpMpd *dev, unsigned int cssleep, int tracksmax)
     : OHService(sTpProduct, sIdProduct, dev),
-      m_active(true), m_cachedirty(false), m_mpdqvers(-1)
+      m_active(true), m_cachedirty(false), m_mpdqvers(-1),
+      m_queuevers(-1), m_queueconn(0), m_zeropos(-1),
+      m_tracksmax(tracksmax)
 {
     dev->addActionMapping(this, "Play", 
                           bind(&OHPlaylist::play, this, _1, _2));
@@ -86,6 +90,8 @@ OHPlaylist::OHPlaylist(UpMpd *dev, unsigned int cssleep)
                           bind(&OHPlaylist::readList, this, _1, _2));
     dev->addActionMapping(this, "Insert",
                           bind(&OHPlaylist::insert, this, _1, _2));
+    dev->addActionMapping(this, "InsertList",
+                          bind(&OHPlaylist::insertList, this, _1, _2));
     dev->addActionMapping(this, "DeleteId",
                           bind(&OHPlaylist::deleteId, this, _1, _2));
     dev->addActionMapping(this, "DeleteAll",
@@ -109,8 +115,6 @@ OHPlaylist::OHPlaylist(UpMpd *dev, unsigned int cssleep)
     }
 }
 
-static const int tracksmax = 16384;
-
 static string mpdstatusToTransportState(MpdStatus::State st)
 {
     string tstate;
@@ -128,23 +132,155 @@ static string mpdstatusToTransportState(MpdStatus::State st)
 }
 
 // The data format for id lists is an array of msb 32 bits ints
-// encoded in base64...
-static string translateIdArray(const vector<UpSong>& in)
+// encoded in base64. The array is normally updated incrementally by
+// updateQueue(). This rebuilds it from the queue copy. Id 0 means "no
+// track" for OpenHome and is not reported, but it is the first id
+// MPD hands out after a start, see m_zeropos.
+void OHPlaylist::rebuildIdArray()
 {
-    string out1;
-    string sdeb;
-    for (auto us = in.begin(); us != in.end(); us++) {
-        unsigned int val = us->mpdid;
-        if (val) {
-            out1 += (unsigned char) ((val & 0xff000000) >> 24);
-            out1 += (unsigned char) ((val & 0x00ff0000) >> 16);
-            out1 += (unsigned char) ((val & 0x0000ff00) >> 8);
-            out1 += (unsigned char) ((val & 0x000000ff));
+    vector<unsigned int> ids;
+    ids.reserve(m_queue.size());
+    m_zeropos = -1;
+    for (unsigned int i = 0; i < m_queue.size(); i++) {
+        if (m_queue[i].id) {
+            ids.push_back(m_queue[i].id);
+        } else {
+            m_zeropos = i;
+        }
+    }
+    m_idarray.assign(ids);
+    // Only build the id list if it is going to be printed: this can
+    // be very long.
+    if (Logger::getTheLog("")->getloglevel() >= Logger::LLDEB1) {
+        string sdeb;
+        for (auto id : ids) {
+            sdeb += SoapHelp::i2s(id) + " ";
         }
-        sdeb += SoapHelp::i2s(val) + " ";
+        LOGDEB1("OHPlaylist::rebuildIdArray: current ids: " << sdeb << endl);
     }
-    LOGDEB("OHPlaylist::translateIdArray: current ids: " << sdeb << endl);
-    return base64_encode(out1);
+}
+
+// Bring our copy of the queue ids and uris up to date, using the
+// changes reported by MPD since the last look. changed is set to the
+// data for the songs which are new in the queue. appendonly is set if
+// the changes only added songs at the end. The id array is updated
+// along.
+//
+// After the first full read, we only ask MPD for the positions and
+// ids of the changed songs: when a track is inserted or deleted, all
+// the following ones change position, and transferring all their
+// data would be slow with a big queue. The uris for the moved songs
+// are found from their ids in our old copy, and the data is fetched
+// only for the new ids.
+bool OHPlaylist::updateQueue(vector<UpSong>& changed, bool *appendonly)
+{
+    MPDCli *mpdcli = m_dev->m_mpdcli;
+    unsigned int serial = mpdcli->connSerial();
+    int fromvers = serial == m_queueconn ? m_queuevers : -1;
+    vector<int> positions;
+    int qvers, qlen;
+    if (!mpdcli->getQueueChanges(fromvers, changed, positions, &qvers, &qlen,
+                                 fromvers != -1)) {
+        m_queuevers = -1;
+        return false;
+    }
+    if (mpdcli->connSerial() != serial) {
+        // We reconnected: MPD may have restarted, and the queue
+        // versions are not comparable any more.
+        if (fromvers == -1) {
+            return false;
+        }
+        m_queuevers = -1;
+        return updateQueue(changed, appendonly);
+    }
+
+    unsigned int oldsize = m_queue.size();
+    if (fromvers == -1) {
+        // After a full read, we know nothing about what was removed.
+        *appendonly = false;
+        m_queue.clear();
+        m_queue.resize(qlen);
+        for (unsigned int i = 0; i < changed.size(); i++) {
+            if (positions[i] >= 0 && positions[i] < qlen) {
+                m_queue[positions[i]].id = changed[i].mpdid;
+                m_queue[positions[i]].uri = changed[i].uri;
+            }
+        }
+        rebuildIdArray();
+    } else {
+        *appendonly = qlen >= int(oldsize);
+        for (unsigned int i = 0; i < changed.size(); i++) {
+            if ((unsigned int)positions[i] < oldsize) {
+                *appendonly = false;
+            }
+        }
+        // Uris of the previous songs, by id, if any may have moved.
+        unordered_map<int, string> olduris;
+        if (!*appendonly) {
+            olduris.reserve(oldsize);
+            for (const auto& entry : m_queue) {
+                olduris[entry.id] = entry.uri;
+            }
+        }
+        m_queue.resize(qlen);
+        // Find where the id 0 song is now. If it did not move, it is
+        // not in the changes.
+        int oldzero = m_zeropos;
+        if (m_zeropos >= qlen) {
+            m_zeropos = -1;
+        }
+        for (unsigned int i = 0; i < changed.size(); i++) {
+            if (positions[i] >= 0 && positions[i] < qlen) {
+                if (changed[i].mpdid == 0) {
+                    m_zeropos = positions[i];
+                } else if (positions[i] == m_zeropos) {
+                    m_zeropos = -1;
+                }
+            }
+        }
+        m_idarray.resize(m_zeropos >= 0 ? qlen - 1 : qlen);
+        vector<int> newids, newpos;
+        for (unsigned int i = 0; i < changed.size(); i++) {
+            if (positions[i] < 0 || positions[i] >= qlen) {
+                continue;
+            }
+            QueueEntry& entry = m_queue[positions[i]];
+            entry.id = changed[i].mpdid;
+            if (entry.id) {
+                m_idarray.set(idSlot(positions[i]), entry.id);
+            }
+            auto it = olduris.find(entry.id);
+            if (it != olduris.end()) {
+                entry.uri = it->second;
+            } else {
+                newids.push_back(entry.id);
+                newpos.push_back(positions[i]);
+            }
+        }
+        if (!mpdcli->statSongs(newids, changed)) {
+            m_queuevers = -1;
+            return false;
+        }
+        for (unsigned int i = 0; i < changed.size(); i++) {
+            m_queue[newpos[i]].uri = changed[i].uri;
+        }
+        if (m_zeropos != oldzero) {
+            // The unchanged songs between the old and new positions
+            // of the id 0 song moved by one slot.
+            int first = oldzero < 0 ? m_zeropos :
+                m_zeropos < 0 ? oldzero : min(oldzero, m_zeropos);
+            int last = oldzero < 0 || m_zeropos < 0 ? qlen - 1 :
+                max(oldzero, m_zeropos);
+            for (int pos = first; pos <= last && pos < qlen; pos++) {
+                if (m_queue[pos].id) {
+                    m_idarray.set(idSlot(pos), m_queue[pos].id);
+                }
+            }
+        }
+    }
+    m_queuevers = qvers;
+    m_queueconn = serial;
+    return true;
 }
 
 bool OHPlaylist::makeIdArray(string& out)
@@ -153,7 +289,7 @@ bool OHPlaylist::makeIdArray(string& out)
     const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
 
     if (mpds.qvers == m_mpdqvers) {
-        out = m_idArrayCached;
+        out = m_idarray.encoded();
         // Mpd queue did not change: no need to look at the metadata cache
         //LOGDEB("OHPlaylist::makeIdArray: mpd queue did not change" << endl);
         // Update the current song anyway: if it's an internet radio,
@@ -164,23 +300,23 @@ bool OHPlaylist::makeIdArray(string& out)
             auto it = m_metacache.find(mpds.currentsong.uri);
             if (it != m_metacache.end() && 
                 it->second.find("<orig>mpd</orig>") != string::npos) {
-                m_metacache[mpds.currentsong.uri] = didlmake(mpds.currentsong);
+                it->second = didlmake(mpds.currentsong);
             }
         }
         return true;
     }
 
-    // Retrieve the data for current queue songs from mpd, and make an
-    // ohPlaylist id array.
-    vector<UpSong> vdata;
-    bool ok = m_dev->m_mpdcli->getQueueData(vdata);
-    if (!ok) {
-        LOGERR("OHPlaylist::makeIdArray: getQueueData failed." 
+    // Retrieve the changes to the mpd queue, and make an ohPlaylist
+    // id array.
+    vector<UpSong> changed;
+    bool appendonly;
+    if (!updateQueue(changed, &appendonly)) {
+        LOGERR("OHPlaylist::makeIdArray: updateQueue failed." 
                "metacache size " << m_metacache.size() << endl);
         return false;
     }
 
-    m_idArrayCached = out = translateIdArray(vdata);
+    out = m_idarray.encoded();
     m_mpdqvers = mpds.qvers;
 
     // Don't perform metadata cache maintenance if we're not active
@@ -190,52 +326,52 @@ bool OHPlaylist::makeIdArray(string& out)
         return true;
     }
 
-    // Update metadata cache: entries not in the current list are not
-    // valid any more. Also there may be entries which were added
+    // Update metadata cache: there may be entries which were added
     // through an MPD client and which don't know about, record the
-    // metadata for these. We don't update the current array, but just
-    // build a new cache for data about current entries.
+    // metadata for these. Only the changed songs can be new.
     //
     // The songids are not preserved through mpd restarts (they
     // restart at 0) this means that the ids are not a good cache key,
     // we use the uris instead.
-    unordered_map<string, string> nmeta;
-
-    // Walk the playlist data from MPD
-    for (auto usong = vdata.begin(); usong != vdata.end(); usong++) {
-        auto inold = m_metacache.find(usong->uri);
-        if (inold != m_metacache.end()) {
-            // Entries already in the metadata array just get
-            // transferred to the new array
-            nmeta[usong->uri].swap(inold->second);
-            m_metacache.erase(inold);
-        } else {
-            // Entries not in the arrays are translated from the
-            // MPD data to our format. They were probably added by
-            // another MPD client. 
-            if (nmeta.find(usong->uri) == nmeta.end()) {
-                nmeta[usong->uri] = didlmake(*usong);
-                m_cachedirty = true;
-                LOGDEB("OHPlaylist::makeIdArray: using mpd data for " << 
-                       usong->mpdid << " uri " << usong->uri << endl);
-            }
+    for (const auto& usong : changed) {
+        if (m_metacache.find(usong.uri) == m_metacache.end()) {
+            // Entries not in the cache are translated from the MPD
+            // data to our format.
+            m_metacache[usong.uri] = didlmake(usong);
+            m_cachedirty = true;
+            LOGDEB("OHPlaylist::makeIdArray: using mpd data for " << 
+                   usong.mpdid << " uri " << usong.uri << endl);
         }
     }
 
-    for (unordered_map<string, string>::const_iterator it = m_metacache.begin();
-         it != m_metacache.end(); it++) {
-        LOGDEB("OHPlaylist::makeIdArray: dropping uri " << it->first << endl);
+    // Entries not in the current list are not valid any more. If
+    // songs were only appended, there can be none. Else, build a new
+    // cache with the entries for the current queue songs.
+    if (!appendonly) {
+        unordered_map<string, string> nmeta;
+        nmeta.reserve(m_queue.size());
+        for (const auto& entry : m_queue) {
+            auto inold = m_metacache.find(entry.uri);
+            if (inold != m_metacache.end()) {
+                nmeta[entry.uri].swap(inold->second);
+                m_metacache.erase(inold);
+            }
+        }
+        for (const auto& ent : m_metacache) {
+            LOGDEB("OHPlaylist::makeIdArray: dropping uri " << ent.first <<
+                   endl);
+            m_cachedirty = true;
+        }
+        m_metacache.swap(nmeta);
     }
 
-    // If we added entries or there are some stale entries, the new
-    // map differs, save it to cache
-    if ((m_dev->m_options & UpMpd::upmpdOhMetaPersist) &&
-        (!m_metacache.empty() || m_cachedirty)) {
+    // If we added entries or there were some stale entries, the map
+    // changed, save it to cache
+    if ((m_dev->m_options & UpMpd::upmpdOhMetaPersist) && m_cachedirty) {
         LOGDEB("OHPlaylist::makeIdArray: saving metacache" << endl);
-        dmcacheSave(m_dev->getMetaCacheFn(), nmeta);
+        dmcacheSave(m_dev->getMetaCacheFn(), m_metacache);
         m_cachedirty = false;
     }
-    m_metacache = nmeta;
 
     return true;
 }
@@ -250,7 +386,7 @@ bool OHPlaylist::makestate(unordered_map<string, string> &st)
     st["Repeat"] = SoapHelp::i2s(mpds.rept);
     st["Shuffle"] = SoapHelp::i2s(mpds.random);
     st["Id"] = mpds.songid == -1 ? "0" : SoapHelp::i2s(mpds.songid);
-    st["TracksMax"] = SoapHelp::i2s(tracksmax);
+    st["TracksMax"] = SoapHelp::i2s(m_tracksmax);
     st["ProtocolInfo"] = g_protocolInfo;
     makeIdArray(st["IdArray"]);
 
@@ -274,12 +410,15 @@ void OHPlaylist::setActive(bool onoff)
 {
     m_active = onoff;
     if (m_active) {
+        // The cache maintenance was not done while inactive, look at
+        // the whole queue again.
+        m_queuevers = -1;
         m_dev->m_mpdcli->clearQueue();
         m_dev->m_mpdcli->restoreState(m_mpdsavedstate);
         refreshState();
         maybeWakeUp(true);
     } else {
-        m_dev->m_mpdcli->saveState(m_mpdsavedstate);
+        m_dev->m_mpdcli->saveState(m_mpdsavedstate, 0, sSavePlaylist);
         iStop();
     }
 }
@@ -636,6 +775,10 @@ int OHPlaylist::insert(const SoapIncoming& sc, SoapOutgoing& data)
 
     LOGDEB("OHPlaylist::insert: afterid " << afterid << " Uri " <<
            uri << " Metadata " << metadata << endl);
+    if (ok && m_dev->getMpdStatusNoUpdate().qlen >= m_tracksmax) {
+        LOGERR("OHPlaylist::insert: playlist full" << endl);
+        ok = false;
+    }
     if (ok) {
         int newid;
         ok = insertUri(afterid, uri, metadata, &newid);
@@ -648,6 +791,152 @@ int OHPlaylist::insert(const SoapIncoming& sc, SoapOutgoing& data)
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
 }
 
+// Extract the text of the first element named tag in [pos, end).
+static bool eltText(const string& in, const string& tag, string::size_type pos,
+                    string::size_type end, string& text)
+{
+    string::size_type beg = in.find("<" + tag + ">", pos);
+    if (beg == string::npos || beg >= end) {
+        return false;
+    }
+    beg += tag.size() + 2;
+    string::size_type fin = in.find("</" + tag + ">", beg);
+    if (fin == string::npos || fin > end) {
+        return false;
+    }
+    text = SoapHelp::xmlUnquote(in.substr(beg, fin - beg));
+    return true;
+}
+
+// Parse a track list in the same format as the ReadList output
+// (without the Id elements). This is not a general XML parser (the
+// DIDL one only knows about items): we expect exactly what we
+// produce in ReadList. The Entry, Uri and Metadata elements have no
+// namespace prefix and no attributes, and the Uri and Metadata
+// contents are escaped text (no CDATA sections, no comments), so that
+// the markup strings can't appear inside them. Other elements are
+// ignored.
+static bool parseTrackList(const string& in, vector<string>& uris,
+                           vector<string>& metas)
+{
+    string::size_type pos = 0;
+    for (;;) {
+        string::size_type beg = in.find("<Entry>", pos);
+        if (beg == string::npos) {
+            break;
+        }
+        string::size_type end = in.find("</Entry>", beg);
+        if (end == string::npos) {
+            return false;
+        }
+        string uri, meta;
+        if (!eltText(in, "Uri", beg, end, uri)) {
+            return false;
+        }
+        eltText(in, "Metadata", beg, end, meta);
+        uris.push_back(uri);
+        metas.push_back(meta);
+        pos = end;
+    }
+    return true;
+}
+
+// Vendor extension: insert a list of tracks with a single call, for
+// control points adding a whole album. The TrackList argument has the
+// same format as the ReadList output, without the Id elements:
+//
+//  <TrackList>
+//    <Entry>
+//      <Uri></Uri>
+//      <Metadata></Metadata>
+//    </Entry>
+//  </TrackList>
+//
+// Tracks with an unsupported format are skipped. NewIdList is the
+// space-separated list of the new ids, in order. The call fails if no
+// track could be inserted, or if MPD failed in the middle of the list
+// (the tracks inserted before the failure are kept).
+int OHPlaylist::insertList(const SoapIncoming& sc, SoapOutgoing& data)
+{
+    LOGDEB("OHPlaylist::insertList" << endl);
+    int afterid;
+    string tracklist;
+    bool ok = sc.get("AfterId", &afterid);
+    ok = ok && sc.get("TrackList", &tracklist);
+    if (!ok) {
+        return UPNP_E_INVALID_PARAM;
+    }
+
+    if (!m_active) {
+        // See comment in insert()
+        if (afterid == 0 && m_dev->m_ohpr) {
+            m_dev->m_ohpr->iSetSourceIndexByName("Playlist");
+        } else {
+            LOGERR("OHPlaylist::insertList: not active" << endl);
+            return UPNP_E_INTERNAL_ERROR;
+        }
+    }
+
+    vector<string> uris, metas;
+    if (!parseTrackList(tracklist, uris, metas)) {
+        LOGERR("OHPlaylist::insertList: bad track list" << endl);
+        return UPNP_E_INVALID_PARAM;
+    }
+
+    // Check the formats and compute the MPD tags. This used to be
+    // the costly part of an insert, but the metadata parse is now
+    // cheap enough that doing it in parallel would not gain anything.
+    vector<string> okuris, okmetas;
+    vector<UpSong> songs;
+    for (unsigned int i = 0; i < uris.size(); i++) {
+        UpSong metaformpd;
+        if (!m_dev->checkContentFormat(uris[i], metas[i], &metaformpd)) {
+            LOGERR("OHPlaylist::insertList: unsupported format: uri " <<
+                   uris[i] << endl);
+            continue;
+        }
+        okuris.push_back(uris[i]);
+        okmetas.push_back(metas[i]);
+        songs.push_back(metaformpd);
+    }
+
+    const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
+    if (mpds.qlen + int(okuris.size()) > m_tracksmax) {
+        LOGERR("OHPlaylist::insertList: playlist full" << endl);
+        return UPNP_E_INTERNAL_ERROR;
+    }
+
+    vector<int> newids;
+    bool allok = m_dev->m_mpdcli->insertListAfterId(okuris, afterid, songs,
+                                                    newids) &&
+        newids.size() == okuris.size();
+    string sids;
+    for (unsigned int i = 0; i < newids.size(); i++) {
+        m_metacache[okuris[i]] = okmetas[i];
+        sids += (i ? " " : "") + SoapHelp::i2s(newids[i]);
+    }
+    if (!newids.empty()) {
+        m_cachedirty = true;
+        m_mpdqvers = -1;
+    }
+    LOGDEB("OHPlaylist::insertList: " << uris.size() << " tracks, " <<
+           newids.size() << " inserted" << endl);
+    // A single wakeup, so that the IdArray change is evented once.
+    maybeWakeUp(!newids.empty());
+    if (!allok) {
+        // The tracks which were inserted stay in the queue. The
+        // control point will see them through the IdArray change.
+        LOGERR("OHPlaylist::insertList: MPD failure: only " << newids.size()
+               << " of " << okuris.size() << " tracks inserted" << endl);
+        return UPNP_E_INTERNAL_ERROR;
+    }
+    ok = !newids.empty();
+    if (ok) {
+        data.addarg("NewIdList", sids);
+    }
+    return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
+}
+
 bool OHPlaylist::insertUri(int afterid, const string& uri, 
                            const string& metadata, int *newid)
 {
@@ -715,7 +1004,7 @@ int OHPlaylist::deleteAll(const SoapIncoming& sc, SoapOutgoing& data)
 int OHPlaylist::tracksMax(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::tracksMax" << endl);
-    data.addarg("Value", SoapHelp::i2s(tracksmax));
+    data.addarg("Value", SoapHelp::i2s(m_tracksmax));
     return UPNP_E_SUCCESS;
 }
 
@@ -752,25 +1041,6 @@ bool OHPlaylist::iidArray(string& idarray, int *token)
     return false;
 }
 
-bool OHPlaylist::urlMap(unordered_map<int, string>& umap)
-{
-    //LOGDEB1("OHPlaylist::urlMap\n");
-    string sarray; 
-    if (iidArray(sarray, 0)) {
-        vector<int> ids;
-        if (ohplIdArrayToVec(sarray, &ids)) {
-            vector<UpSong> songs;
-            if (ireadList(ids, songs)) {
-                for (auto it = songs.begin(); it != songs.end(); it++) {
-                    umap[it->mpdid] = it->uri;
-                }
-                return true;
-            }
-        }
-    }
-    return false;
-}
-
 // Check if id array changed since last call (which returned a gen token)
 int OHPlaylist::idArrayChanged(const SoapIncoming& sc, SoapOutgoing& data)
 {
@@ -795,3 +1065,546 @@ int OHPlaylist::protocolInfo(const SoapIncoming& sc, SoapOutgoing& data)
     data.addarg("Value", g_protocolInfo);
     return UPNP_E_SUCCESS;
 }
+
+#ifdef OHPLAYLIST_TEST
+// Scaling benchmark: a mock MPD, running in a thread of this process,
+// serves a queue of ntracks songs, and we time the OpenHome Playlist
+// operations on it, through the real OHPlaylist and MPDCli code. The
+// mock implements the part of the protocol which MPDCli uses, with
+// MPD's per-song change versions, so the transfer and parsing costs
+// are those of a real MPD.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include "libupnpp/base64.hxx"
+#include "libupnpp/upnpplib.hxx"
+
+#include "conftree.h"
+
+// The daemon globals live in main.cxx
+string g_configfilename;
+string g_datadir;
+string g_cachedir;
+std::mutex g_configlock;
+ConfSimple *g_config;
+string g_protocolInfo;
+unordered_set<string> g_supportedFormats;
+
+class MockMpd {
+public:
+    MockMpd(int ntracks) : m_vers(1), m_nextid(0), m_lfd(-1), m_port(0) {
+        for (int i = 0; i < ntracks; i++) {
+            Song song;
+            song.uri = makeUri(i);
+            song.artist = "Artist " + SoapHelp::i2s(i % 500);
+            song.album = "Album " + SoapHelp::i2s(i % 3000);
+            song.title = "Track title number " + SoapHelp::i2s(i);
+            song.track = SoapHelp::i2s(i % 20 + 1);
+            addSong(m_queue.size(), song);
+        }
+        m_vers = 1;
+        for (auto& song : m_queue) {
+            song.vers = m_vers;
+        }
+    }
+    static string makeUri(int i) {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "http://192.168.1.10:9790/minimserver/"
+                 "*/Music/Artist%d/Album%d/%02d%%20Some%%20Track%%20Title.flac",
+                 i % 500, i % 3000, i % 20 + 1);
+        return buf;
+    }
+    // Listen on a loopback port and serve the connections in a thread
+    bool start() {
+        m_lfd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (m_lfd < 0 || bind(m_lfd, (struct sockaddr *)&addr, len) < 0 ||
+            listen(m_lfd, 5) < 0 ||
+            getsockname(m_lfd, (struct sockaddr *)&addr, &len) < 0) {
+            return false;
+        }
+        m_port = ntohs(addr.sin_port);
+        std::thread(&MockMpd::serve, this).detach();
+        return true;
+    }
+    int port() {
+        return m_port;
+    }
+    int size() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_queue.size();
+    }
+    int idAt(int pos) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_queue[pos].id;
+    }
+    vector<int> ids() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        vector<int> out;
+        for (const auto& song : m_queue) {
+            out.push_back(song.id);
+        }
+        return out;
+    }
+
+private:
+    struct Song {
+        int id;
+        unsigned int vers;
+        string uri, artist, album, title, track;
+    };
+    vector<Song> m_queue;
+    // Queue position for each id ever given, -1 if deleted
+    vector<int> m_idpos;
+    unsigned int m_vers;
+    int m_nextid;
+    std::mutex m_mutex;
+    int m_lfd;
+    int m_port;
+
+    // Like MPD, the songs after the insertion or deletion point get
+    // the new queue version, as their position changed.
+    void renumber(unsigned int from) {
+        for (unsigned int pos = from; pos < m_queue.size(); pos++) {
+            m_queue[pos].vers = m_vers;
+            m_idpos[m_queue[pos].id] = pos;
+        }
+    }
+    int addSong(unsigned int pos, Song& song) {
+        m_vers++;
+        song.id = m_nextid++;
+        m_idpos.push_back(-1);
+        m_queue.insert(m_queue.begin() + pos, song);
+        renumber(pos);
+        return song.id;
+    }
+    void deleteRange(unsigned int start, unsigned int end) {
+        m_vers++;
+        for (unsigned int pos = start; pos < end; pos++) {
+            m_idpos[m_queue[pos].id] = -1;
+        }
+        m_queue.erase(m_queue.begin() + start, m_queue.begin() + end);
+        renumber(start);
+    }
+    int idToPos(const string& sid) {
+        unsigned int id = atoi(sid.c_str());
+        return id < m_idpos.size() ? m_idpos[id] : -1;
+    }
+    void songOut(unsigned int pos, string& out) {
+        const Song& song = m_queue[pos];
+        out += "file: " + song.uri + "\n";
+        out += "Time: 225\nduration: 225.000\n";
+        out += "Artist: " + song.artist + "\n";
+        out += "Album: " + song.album + "\n";
+        out += "Title: " + song.title + "\n";
+        out += "Track: " + song.track + "\n";
+        out += "Pos: " + SoapHelp::i2s(pos) + "\n";
+        out += "Id: " + SoapHelp::i2s(song.id) + "\n";
+    }
+
+    // Split a command line into words, as quoted by libmpdclient
+    static void split(const string& line, vector<string>& words) {
+        words.clear();
+        unsigned int i = 0;
+        while (i < line.size()) {
+            if (line[i] == ' ') {
+                i++;
+                continue;
+            }
+            string word;
+            if (line[i] == '"') {
+                for (i++; i < line.size() && line[i] != '"'; i++) {
+                    if (line[i] == '\\' && i + 1 < line.size()) {
+                        i++;
+                    }
+                    word += line[i];
+                }
+                i++;
+            } else {
+                for (; i < line.size() && line[i] != ' '; i++) {
+                    word += line[i];
+                }
+            }
+            words.push_back(word);
+        }
+    }
+
+    // Execute one command, appending the response to out. Errors
+    // append an ACK and return false. listidx is the command index
+    // in a command list.
+    bool command(const string& line, string& out, int listidx) {
+        vector<string> args;
+        split(line, args);
+        if (args.empty()) {
+            args.push_back("");
+        }
+        const string& cmd = args[0];
+        if (cmd == "status") {
+            out += "volume: 50\nrepeat: 0\nrandom: 0\nsingle: 0\n"
+                "consume: 0\nplaylist: " + SoapHelp::i2s(m_vers) +
+                "\nplaylistlength: " + SoapHelp::i2s(m_queue.size()) +
+                "\nmixrampdb: 0.000000\nstate: stop\n";
+        } else if (cmd == "commands") {
+            static const char *cmds[] = {"add", "addid", "addtagid", "clear",
+                                         "delete", "deleteid", "playlistid",
+                                         "playlistinfo", "plchanges",
+                                         "plchangesposid", "status"};
+            for (auto name : cmds) {
+                out += string("command: ") + name + "\n";
+            }
+        } else if (cmd == "plchanges" || cmd == "plchangesposid") {
+            unsigned int from = args.size() > 1 ? atoi(args[1].c_str()) : 0;
+            for (unsigned int pos = 0; pos < m_queue.size(); pos++) {
+                if (m_queue[pos].vers <= from && from <= m_vers) {
+                    continue;
+                }
+                if (cmd == "plchanges") {
+                    songOut(pos, out);
+                } else {
+                    out += "cpos: " + SoapHelp::i2s(pos) + "\nId: " +
+                        SoapHelp::i2s(m_queue[pos].id) + "\n";
+                }
+            }
+        } else if (cmd == "playlistinfo") {
+            if (args.size() > 1) {
+                unsigned int pos = atoi(args[1].c_str());
+                if (pos >= m_queue.size()) {
+                    return ack(out, listidx, cmd, "Bad song index");
+                }
+                songOut(pos, out);
+            } else {
+                for (unsigned int pos = 0; pos < m_queue.size(); pos++) {
+                    songOut(pos, out);
+                }
+            }
+        } else if (cmd == "playlistid") {
+            int pos = args.size() > 1 ? idToPos(args[1]) : -1;
+            if (pos < 0) {
+                return ack(out, listidx, cmd, "No such song");
+            }
+            songOut(pos, out);
+        } else if (cmd == "addid") {
+            unsigned int pos = args.size() > 2 ?
+                atoi(args[2].c_str()) : m_queue.size();
+            if (args.size() < 2 || pos > m_queue.size()) {
+                return ack(out, listidx, cmd, "Bad song index");
+            }
+            Song song;
+            song.uri = args[1];
+            out += "Id: " + SoapHelp::i2s(addSong(pos, song)) + "\n";
+        } else if (cmd == "addtagid") {
+            int pos = args.size() > 3 ? idToPos(args[1]) : -1;
+            if (pos < 0) {
+                return ack(out, listidx, cmd, "No such song");
+            }
+            Song& song = m_queue[pos];
+            if (args[2] == "Artist") {
+                song.artist = args[3];
+            } else if (args[2] == "Album") {
+                song.album = args[3];
+            } else if (args[2] == "Title") {
+                song.title = args[3];
+            } else if (args[2] == "Track") {
+                song.track = args[3];
+            }
+            m_vers++;
+            song.vers = m_vers;
+        } else if (cmd == "deleteid") {
+            int pos = args.size() > 1 ? idToPos(args[1]) : -1;
+            if (pos < 0) {
+                return ack(out, listidx, cmd, "No such song");
+            }
+            deleteRange(pos, pos + 1);
+        } else if (cmd == "delete") {
+            string range = args.size() > 1 ? args[1] : "";
+            unsigned int start = atoi(range.c_str());
+            string::size_type colon = range.find(':');
+            unsigned int end = colon == string::npos ? start + 1 :
+                atoi(range.c_str() + colon + 1);
+            if (end > m_queue.size() || start >= end) {
+                return ack(out, listidx, cmd, "Bad song index");
+            }
+            deleteRange(start, end);
+        } else if (cmd == "clear") {
+            deleteRange(0, m_queue.size());
+        }
+        // Anything else (playback control, options...) just succeeds
+        return true;
+    }
+    static bool ack(string& out, int listidx, const string& cmd,
+                    const string& msg) {
+        out += "ACK [50@" + SoapHelp::i2s(listidx) + "] {" + cmd + "} " +
+            msg + "\n";
+        return false;
+    }
+
+    void serve() {
+        int fd;
+        while ((fd = accept(m_lfd, 0, 0)) >= 0) {
+            session(fd);
+            close(fd);
+        }
+    }
+    void session(int fd) {
+        string out("OK MPD 0.19.0\n");
+        string in;
+        string::size_type start = 0;
+        bool inlist = false, listok = false;
+        vector<string> list;
+        char buf[16384];
+        for (;;) {
+            for (string::size_type done = 0; done < out.size();) {
+                ssize_t n = send(fd, out.c_str() + done, out.size() - done,
+                                 MSG_NOSIGNAL);
+                if (n <= 0) {
+                    return;
+                }
+                done += n;
+            }
+            out.clear();
+            string::size_type nl;
+            while ((nl = in.find('\n', start)) == string::npos) {
+                in.erase(0, start);
+                start = 0;
+                ssize_t n = recv(fd, buf, sizeof(buf), 0);
+                if (n <= 0) {
+                    return;
+                }
+                in.append(buf, n);
+            }
+            string line = in.substr(start, nl - start);
+            start = nl + 1;
+            if (line == "close") {
+                return;
+            }
+            if (line == "command_list_begin" ||
+                line == "command_list_ok_begin") {
+                inlist = true;
+                listok = line == "command_list_ok_begin";
+                list.clear();
+                continue;
+            }
+            if (inlist && line != "command_list_end") {
+                list.push_back(line);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (inlist) {
+                inlist = false;
+                bool ok = true;
+                for (unsigned int i = 0; ok && i < list.size(); i++) {
+                    ok = command(list[i], out, i);
+                    if (ok && listok) {
+                        out += "list_OK\n";
+                    }
+                }
+                if (ok) {
+                    out += "OK\n";
+                }
+            } else if (command(line, out, 0)) {
+                out += "OK\n";
+            }
+        }
+    }
+};
+
+static long rsskb()
+{
+    long pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+            rss = 0;
+        fclose(fp);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Mean time for one call, in milliseconds
+static double timeit(std::function<void()> func, int count)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        func();
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / count;
+}
+
+static char *thisprog;
+
+static char usage [] =
+"ohplaylist [-n ntracks]\n"
+"  Fill a mock MPD queue with ntracks songs (default 1000), and time\n"
+"  the OpenHome Playlist operations on it.\n"
+;
+static void
+Usage(void)
+{
+    fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int ntracks = 1000;
+
+    thisprog = argv[0];
+    argc--; argv++;
+
+    while (argc > 0 && **argv == '-') {
+        (*argv)++;
+        if (!(**argv))
+            Usage();
+        while (**argv)
+            switch (*(*argv)++) {
+            case 'n': if (argc < 2)  Usage();
+                if ((sscanf(*(++argv), "%d", &ntracks)) != 1 || ntracks < 2)
+                    Usage();
+                argc--;
+                goto b1;
+            default: Usage(); break;
+            }
+    b1: argc--; argv++;
+    }
+    if (argc != 0)
+        Usage();
+
+    Logger::getTheLog("")->setLogLevel(Logger::LLERR);
+    g_config = new ConfSimple(string(), 1);
+    // didlmake() describes the tracks as mp3
+    g_supportedFormats.insert("audio/mpeg");
+
+    MockMpd mock(ntracks);
+    if (!mock.start()) {
+        cerr << "Could not start the mock MPD" << endl;
+        return 1;
+    }
+    if (LibUPnP::getLibUPnP(true) == 0) {
+        cerr << "Can't initialize the UPnP library" << endl;
+        return 1;
+    }
+    MPDCli cli("127.0.0.1", mock.port());
+    if (!cli.ok()) {
+        cerr << "Cli connection failed" << endl;
+        return 1;
+    }
+
+    // Same as the daemon defaults, with the metadata cache saved to a
+    // scratch file.
+    UpMpd::Options opts;
+    opts.options = UpMpd::upmpdNoAV | UpMpd::upmpdOhMetaPersist;
+    opts.cachefn = "/tmp/ohplaylist-test-metacache";
+    std::ofstream(opts.cachefn.c_str(), std::ios::trunc);
+    ohProductDesc_t ohProductDesc;
+    unordered_map<string, VDirContent> files;
+    UpMpd dev("uuid:ohplaylist-test", "ohplaylist-test", ohProductDesc,
+              files, &cli, opts);
+
+    long rss0 = rsskb();
+    OHPlaylist ohpl(&dev, 0, 2 * ntracks);
+    string idarray;
+    int token;
+    // What the event loop does after an action, and the IdArray
+    // action itself.
+    auto idarr = [&]() {
+        dev.getMpdStatus();
+        if (!ohpl.iidArray(idarray, &token)) {
+            cerr << "iidArray failed" << endl;
+            exit(1);
+        }
+    };
+    double tfirst = timeit(idarr, 1);
+    long rss1 = rsskb();
+
+    int inserted = 0;
+    auto insert = [&](int afterid) {
+        UpSong song;
+        song.uri = MockMpd::makeUri(ntracks + inserted) + "?inserted=" +
+            SoapHelp::i2s(inserted);
+        song.title = "Inserted " + SoapHelp::i2s(inserted);
+        song.artist = "Artist";
+        song.album = "Album";
+        inserted++;
+        int newid;
+        if (!ohpl.insertUri(afterid, song.uri, didlmake(song), &newid)) {
+            cerr << "insertUri failed" << endl;
+            exit(1);
+        }
+        idarr();
+        return newid;
+    };
+
+    int count = ntracks >= 100000 ? 5 : ntracks >= 10000 ? 20 : 100;
+    // Party mode: add after the last track
+    int lastid = mock.idAt(mock.size() - 1);
+    double tinsend = timeit([&]() {lastid = insert(lastid);}, count);
+    double tinsmid = timeit([&]() {insert(mock.idAt(mock.size() / 2));},
+                            count);
+    double tdelete = timeit([&]() {
+            if (!cli.deleteId(mock.idAt(mock.size() / 2))) {
+                cerr << "deleteId failed" << endl;
+                exit(1);
+            }
+            idarr();
+        }, count);
+    double tidarray = timeit(idarr, 100);
+    // A control point reads the metadata by chunks of ids
+    vector<int> ids;
+    for (int pos = 0; pos < 100 && pos < mock.size(); pos++) {
+        ids.push_back(mock.idAt(pos * (mock.size() / 100)));
+    }
+    double treadlist = timeit([&]() {
+            vector<UpSong> songs;
+            ohpl.ireadList(ids, songs);
+            if (songs.size() != ids.size()) {
+                cerr << "ireadList failed" << endl;
+                exit(1);
+            }
+        }, 20);
+
+    // The id array must match the queue, minus id 0.
+    vector<int> expected;
+    for (auto id : mock.ids()) {
+        if (id) {
+            expected.push_back(id);
+        }
+    }
+    string bin = base64_decode(idarray);
+    bool match = bin.size() == 4 * expected.size();
+    for (unsigned int i = 0; match && i < expected.size(); i++) {
+        const unsigned char *cp = (const unsigned char *)bin.c_str() + 4 * i;
+        match = int((cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3]) ==
+            expected[i];
+    }
+
+    printf("%d tracks, %d operations for each\n", ntracks, count);
+    printf("First IdArray          %10.2f ms\n", tfirst);
+    printf("Insert(end) + IdArray  %10.2f ms\n", tinsend);
+    printf("Insert(mid) + IdArray  %10.2f ms\n", tinsmid);
+    printf("DeleteId + IdArray     %10.2f ms\n", tdelete);
+    printf("IdArray, no change     %10.3f ms\n", tidarray);
+    printf("ReadList, %3d ids      %10.2f ms\n", int(ids.size()), treadlist);
+    printf("Memory after the first IdArray: +%ld KB\n", rss1 - rss0);
+    if (!match) {
+        printf("Id array does not match the MPD queue\n");
+        return 1;
+    }
+    return 0;
+}
+#endif // OHPLAYLIST_TEST
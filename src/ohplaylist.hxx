@@ -25,13 +25,14 @@
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, SoapOutgoing
 
 #include "mpdcli.hxx"
+#include "ohidarray.hxx"
 #include "ohservice.hxx"
 
 using namespace UPnPP;
 
 class OHPlaylist : public OHService {
 public:
-    OHPlaylist(UpMpd *dev, unsigned int cachesavesleep);
+    OHPlaylist(UpMpd *dev, unsigned int cachesavesleep, int tracksmax);
 
     bool cacheFind(const std::string& uri, std:: string& meta);
 
@@ -41,7 +42,6 @@ public:
                    const std::string& metadata, int *newid = 0);
     bool ireadList(const std::vector<int>&, std::vector<UpSong>&);
     bool iidArray(std::string& idarray, int *token);
-    bool urlMap(std::unordered_map<int, std::string>& umap);
 
     int iStop();
     void refreshState();
@@ -70,6 +70,7 @@ private:
     int ohread(const SoapIncoming& sc, SoapOutgoing& data);
     int readList(const SoapIncoming& sc, SoapOutgoing& data);
     int insert(const SoapIncoming& sc, SoapOutgoing& data);
+    int insertList(const SoapIncoming& sc, SoapOutgoing& data);
     int deleteId(const SoapIncoming& sc, SoapOutgoing& data);
     int deleteAll(const SoapIncoming& sc, SoapOutgoing& data);
     int tracksMax(const SoapIncoming& sc, SoapOutgoing& data);
@@ -78,6 +79,12 @@ private:
     int protocolInfo(const SoapIncoming& sc, SoapOutgoing& data);
 
     bool makeIdArray(std::string&);
+    bool updateQueue(std::vector<UpSong>& changed, bool *appendonly);
+    void rebuildIdArray();
+    // Id array slot for a queue position
+    size_t idSlot(int pos) {
+        return m_zeropos >= 0 && pos > m_zeropos ? pos - 1 : pos;
+    }
     void maybeWakeUp(bool ok);
 
     bool m_active;
@@ -92,7 +99,26 @@ private:
     // Avoid re-reading the whole MPD queue every time by using the
     // queue version.
     int m_mpdqvers;
-    std::string m_idArrayCached;
+
+    // Ids and uris of the MPD queue songs, by position. This is
+    // updated with the changes since m_queuevers, instead of
+    // re-reading the whole queue, which may be very big.
+    struct QueueEntry {
+        int id;
+        std::string uri;
+    };
+    std::vector<QueueEntry> m_queue;
+    int m_queuevers;
+    // MPDCli connection serial when m_queuevers was set.
+    unsigned int m_queueconn;
+    // Encoded id array, updated with the queue
+    IdArrayBuffer m_idarray;
+    // Position of the song with id 0, or -1. MPD numbers ids from 0
+    // after each start, and id 0 means "no track" for OpenHome, so
+    // this song is not in m_idarray, and the following positions are
+    // shifted by one. Ids are unique, so there is at most one.
+    int m_zeropos;
+    int m_tracksmax;
 };
 
 #endif /* _OHPLAYLIST_H_X_INCLUDED_ */
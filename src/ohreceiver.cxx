@@ -21,6 +21,7 @@
 
 #include <upnp/upnp.h>                  // for UPNP_E_SUCCESS, etc
 
+#include <chrono>
 #include <functional>                   // for _Bind, bind, _1, _2
 #include <iostream>                     // for endl, etc
 #include <string>                       // for string, allocator, etc
@@ -31,6 +32,7 @@
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, SoapOutgoing, i2s, etc
 
 #include "mpdcli.hxx"                   // for MpdStatus, UpSong, MPDCli, etc
+#include "ohmreceiver.hxx"
 #include "upmpd.hxx"                    // for UpMpd, etc
 #include "upmpdutils.hxx"               // for didlmake, diffmaps, etc
 #include "ohplaylist.hxx"
@@ -44,7 +46,8 @@ static const string sIdProduct("urn:av-openhome-org:serviceId:Receiver");
 
 OHReceiver::OHReceiver(UpMpd *dev, const OHReceiverParams& parms)
     : OHService(sTpProduct, sIdProduct, dev), m_active(false),
-      m_httpport(parms.httpport), m_sc2mpdpath(parms.sc2mpdpath), m_pm(parms.pm)
+      m_httpport(parms.httpport), m_sc2mpdpath(parms.sc2mpdpath), m_pm(parms.pm),
+      m_standby(parms.standby && !parms.sc2mpdpath.empty()), m_ohm(nullptr)
 {
     dev->addActionMapping(this, "Play", 
                           bind(&OHReceiver::play, this, _1, _2));
@@ -61,9 +64,22 @@ OHReceiver::OHReceiver(UpMpd *dev, const OHReceiverParams& parms)
 
     m_httpuri = "http://localhost:"+ SoapHelp::i2s(m_httpport) + 
         "/Songcast.wav";
+    // ohz (zone) senders need sc2mpd, the internal receiver only does
+    // ohm and ohu.
+    m_protocolinfo = m_sc2mpdpath.empty() ? "ohm:*:*:*,ohu:*.*.*" :
+        "ohz:*:*:*,ohm:*:*:*,ohu:*.*.*";
+    if (parms.internal && m_pm == OHReceiverParams::OHRP_MPD) {
+        m_ohm = new OhmReceiver(m_httpport, parms.jitterms);
+    }
+    if (m_standby) {
+        startStandby();
+    }
 }
 
-static const string o_protocolinfo("ohz:*:*:*,ohm:*:*:*,ohu:*.*.*");
+OHReceiver::~OHReceiver()
+{
+    delete m_ohm;
+}
 
 bool OHReceiver::makestate(unordered_map<string, string> &st)
 {
@@ -94,11 +110,11 @@ bool OHReceiver::makestate(unordered_map<string, string> &st)
     // Allowed states: Stopped, Playing,Waiting, Buffering
     // We won't receive a Stop action if we are not Playing. So we
     // are playing as long as we have a subprocess
-    if (m_cmd)
+    if (m_cmd || (m_ohm && m_ohm->running()))
         st["TransportState"] = "Playing";
     else 
         st["TransportState"] = "Stopped";
-    st["ProtocolInfo"] = o_protocolinfo;
+    st["ProtocolInfo"] = m_protocolinfo;
     return true;
 }
 
@@ -115,6 +131,88 @@ void OHReceiver::setActive(bool onoff)
         iStop();
 }
 
+static int msSince(std::chrono::steady_clock::time_point& start)
+{
+    auto now = std::chrono::steady_clock::now();
+    int ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        now - start).count();
+    start = now;
+    return ms;
+}
+
+// Start an sc2mpd process in standby mode (-S). It waits for
+// commands on its standard input:
+//  - "PLAY <uri>": connect to the sender, and print "CONNECTED" when
+//    ready, as sc2mpd -u does.
+//  - "STOP": disconnect, and wait for the next command.
+// It exits when its input is closed.
+bool OHReceiver::startStandby()
+{
+    if (m_standbycmd) {
+        int status;
+        if (!m_standbycmd->maybereap(&status)) {
+            return true;
+        }
+        LOGERR("OHReceiver: standby sc2mpd exited with status " << status <<
+               endl);
+    }
+    m_standbycmd = shared_ptr<ExecCmd>(new ExecCmd());
+    vector<string> args;
+    if (m_pm == OHReceiverParams::OHRP_ALSA) {
+        args.push_back("-d");
+    }
+    args.push_back("-S");
+    if (!g_configfilename.empty()) {
+        args.push_back("-c");
+        args.push_back(g_configfilename);
+    }
+    if (m_standbycmd->startExec(m_sc2mpdpath, args, true, true) < 0) {
+        LOGERR("OHReceiver: executing " << m_sc2mpdpath << " -S failed\n");
+        m_standbycmd = shared_ptr<ExecCmd>();
+        return false;
+    }
+    LOGDEB("OHReceiver: standby sc2mpd pid " << m_standbycmd->getChildPid() <<
+           endl);
+    return true;
+}
+
+// Get an sc2mpd process receiving from m_uri: the standby one if
+// possible, else a new one.
+bool OHReceiver::startCmd(bool *usedstandby)
+{
+    *usedstandby = false;
+    if (m_standby && startStandby()) {
+        m_cmd = m_standbycmd;
+        m_standbycmd = shared_ptr<ExecCmd>();
+        if (m_cmd->send("PLAY " + m_uri + "\n") > 0) {
+            *usedstandby = true;
+            return true;
+        }
+        m_cmd->zapChild();
+    }
+
+    m_cmd = shared_ptr<ExecCmd>(new ExecCmd());
+    vector<string> args;
+    if (m_pm == OHReceiverParams::OHRP_ALSA) {
+        args.push_back("-d");
+    }
+    args.push_back("-u");
+    args.push_back(m_uri);
+    if (!g_configfilename.empty()) {
+        args.push_back("-c");
+        args.push_back(g_configfilename);
+    }
+        
+    LOGDEB("OHReceiver::play: executing " << m_sc2mpdpath << endl);
+    if (m_cmd->startExec(m_sc2mpdpath, args, false, true) < 0) {
+        LOGERR("OHReceiver::play: executing " << m_sc2mpdpath << " failed" 
+               << endl);
+        return false;
+    }
+    LOGDEB("OHReceiver::play: sc2mpd pid "<< m_cmd->getChildPid()<< endl);
+    return true;
+}
+
 bool OHReceiver::iPlay()
 {
     bool ok = false;
@@ -133,82 +231,103 @@ bool OHReceiver::iPlay()
     }
 
     int id = -1;
-    unordered_map<int, string> urlmap;
+    vector<int> ids;
     string line;
+    bool usedstandby = false;
+    bool usedinternal = false;
+    // Time spent in each phase, for diagnosing slow starts.
+    auto phasestart = std::chrono::steady_clock::now();
+    int startms = 0, connms = 0, queuems = 0, playms = 0;
         
     // We start the songcast command to receive the audio flux and either
     // export it as HTTP (then insert http URI at the front of the
     // queue and execute next/play), or play it directly to the sound card
-    if (m_cmd)
-        m_cmd->zapChild();
-    m_cmd = shared_ptr<ExecCmd>(new ExecCmd());
-    vector<string> args;
-    if (m_pm == OHReceiverParams::OHRP_ALSA) {
-        args.push_back("-d");
-    }
-    args.push_back("-u");
-    args.push_back(m_uri);
-    if (!g_configfilename.empty()) {
-        args.push_back("-c");
-        args.push_back(g_configfilename);
+    if (m_cmd || (m_ohm && m_ohm->running()))
+        iStop();
+    if (m_ohm && OhmReceiver::canPlay(m_uri)) {
+        // No need to wait: MPD will get the data when it is there.
+        ok = usedinternal = m_ohm->start(m_uri);
+    } else if (m_sc2mpdpath.empty()) {
+        LOGERR("OHReceiver::play: can't play " << m_uri << ": only sc2mpd "
+               "can receive from this sender, and it is not installed\n");
+        ok = false;
+    } else {
+        ok = startCmd(&usedstandby);
     }
-        
-    LOGDEB("OHReceiver::play: executing " << m_sc2mpdpath << endl);
-    ok = m_cmd->startExec(m_sc2mpdpath, args, false, true) >= 0;
+    startms = msSince(phasestart);
     if (!ok) {
-        LOGERR("OHReceiver::play: executing " << m_sc2mpdpath << " failed" 
-               << endl);
         goto out;
-    } else {
-        LOGDEB("OHReceiver::play: sc2mpd pid "<< m_cmd->getChildPid()<< endl);
     }
 
     if (m_pm == OHReceiverParams::OHRP_MPD) {
         m_dev->m_mpdcli->stop();
-
+    }
+    if ((m_pm == OHReceiverParams::OHRP_MPD && !usedinternal) || usedstandby) {
         // Wait for sc2mpd to signal ready, then play.
         // sc2mpd writes a single line to stdout "CONNECTED" when
         // it gets there, which should be more or less instantaneous
         int timeo = 15;
         if (m_cmd->getline(line, timeo) < 0) {
+            if (usedstandby) {
+                // Maybe an sc2mpd version without standby mode: don't
+                // try it again.
+                LOGERR("OHReceiver: no answer from standby sc2mpd. "
+                       "Disabling standby mode\n");
+                m_standby = false;
+                iStop();
+                return iPlay();
+            }
             LOGERR("OHReceiver: mpd mode: sc2mpd still not ready to play after "
                    << timeo << " seconds\n");
+            ok = false;
             goto out;
         }
         LOGDEB("OHReceiver: sc2mpd sent: " << line);
-        // And insert the appropriate uri in the mpd playlist
-        if (!m_dev->m_ohpl->urlMap(urlmap)) {
-            LOGERR("OHReceiver::play: urlMap() failed" <<endl);
+        connms = msSince(phasestart);
+    }
+
+    if (m_pm == OHReceiverParams::OHRP_MPD) {
+        // And insert the appropriate uri in the mpd playlist, if it
+        // is not already there
+        if (!m_dev->m_mpdcli->findUri(m_httpuri, ids)) {
+            LOGERR("OHReceiver::play: findUri() failed" <<endl);
+            ok = false;
             goto out;
         }
-        for (auto it = urlmap.begin(); it != urlmap.end(); it++) {
-            if (it->second == m_httpuri) {
-                id = it->first;
-            }
-        }
-        if (id == -1) {
+        if (!ids.empty()) {
+            id = ids.back();
+        } else {
             UpSong metaformpd;
             string metadata(SoapHelp::xmlUnquote(m_metadata));
             if (!uMetaToUpSong(metadata, &metaformpd)) {
                 LOGERR("OHReceiver::play: failed to parse metadata " << " Uri [" 
                        << m_httpuri << "] Metadata [" << metadata << "]"
                        << endl);
+                ok = false;
                 goto out;
             }
             id = m_dev->m_mpdcli->insertAfterId(m_httpuri, 0, metaformpd);
             if (id == -1) {
                 LOGERR("OHReceiver::play: insertAfterId() failed\n");
+                ok = false;
                 goto out;
             }
         }
+        queuems = msSince(phasestart);
 
         ok = m_dev->m_mpdcli->playId(id);
         if (!ok) {
             LOGERR("OHReceiver::play: play() failed\n");
             goto out;
         }
+        playms = msSince(phasestart);
     }
 
+    LOGINF("OHReceiver::play: " << (usedinternal ? "internal receiver" :
+                                    usedstandby ? "standby sc2mpd" :
+                                    "new sc2mpd") << ". start " << startms <<
+           " mS, connect " << connms << " mS, queue " << queuems <<
+           " mS, play " << playms << " mS\n");
 out:
     if (!ok) {
         iStop();
@@ -230,22 +349,33 @@ bool OHReceiver::iStop()
 {
     LOGDEB("OHReceiver::iStop()\n");
     if (m_cmd) {
-        m_cmd->zapChild();
+        int status;
+        if (m_standby && !m_cmd->maybereap(&status) &&
+            m_cmd->send("STOP\n") > 0) {
+            // Keep the process for the next Play
+            m_standbycmd = m_cmd;
+        } else {
+            m_cmd->zapChild();
+        }
         m_cmd = shared_ptr<ExecCmd>();
     }
 
     if (m_pm == OHReceiverParams::OHRP_MPD) {
+        auto start = std::chrono::steady_clock::now();
         m_dev->m_mpdcli->stop();
-        unordered_map<int, string> urlmap;
+        if (m_ohm) {
+            m_ohm->stop();
+        }
+        vector<int> ids;
         // Remove our bogus URi from the playlist
-        if (!m_dev->m_ohpl->urlMap(urlmap)) {
-            LOGERR("OHReceiver::stop: urlMap() failed" <<endl);
+        if (!m_dev->m_mpdcli->findUri(m_httpuri, ids)) {
+            LOGERR("OHReceiver::stop: findUri() failed" <<endl);
         }
-        for (auto it = urlmap.begin(); it != urlmap.end(); it++) {
-            if (it->second == m_httpuri) {
-                m_dev->m_mpdcli->deleteId(it->first);
-            }
+        for (auto id : ids) {
+            m_dev->m_mpdcli->deleteId(id);
         }
+        LOGINF("OHReceiver::stop: queue cleanup " << msSince(start) <<
+               " mS\n");
     }
     
     return true;
@@ -313,7 +443,8 @@ int OHReceiver::transportState(const SoapIncoming& sc, SoapOutgoing& data)
     // Allowed states: Stopped, Playing,Waiting, Buffering
     // We won't receive a Stop action if we are not Playing. So we
     // are playing as long as we have a subprocess
-    string tstate = m_cmd ? "Playing" : "Stopped";
+    string tstate = m_cmd || (m_ohm && m_ohm->running()) ?
+        "Playing" : "Stopped";
     data.addarg("Value", tstate);
     LOGDEB("OHReceiver::transportState: " << tstate << endl);
     return UPNP_E_SUCCESS;
@@ -322,6 +453,6 @@ int OHReceiver::transportState(const SoapIncoming& sc, SoapOutgoing& data)
 int OHReceiver::protocolInfo(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHReceiver::protocolInfo" << endl);
-    data.addarg("Value", o_protocolinfo);
+    data.addarg("Value", m_protocolinfo);
     return UPNP_E_SUCCESS;
 }
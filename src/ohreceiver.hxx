@@ -32,18 +32,29 @@ using namespace UPnPP;
 class UpMpd;
 class OHPlaylist;
 class OHProduct;
+class OhmReceiver;
 
 struct OHReceiverParams {
     enum PlayMethod {OHRP_MPD, OHRP_ALSA};
     PlayMethod pm;
     int httpport;
     std::string sc2mpdpath;
-    OHReceiverParams() : pm(OHRP_MPD), httpport(8768) {}
+    // Keep a standby sc2mpd process running, and pass it the sender
+    // uri on Play, instead of starting a new one each time.
+    bool standby;
+    // Receive ohm/ohu streams in-process instead of using sc2mpd
+    // (mpd play method only), with a jitter buffer of jitterms.
+    bool internal;
+    int jitterms;
+    OHReceiverParams()
+        : pm(OHRP_MPD), httpport(8768), standby(false), internal(false),
+          jitterms(100) {}
 };
 
 class OHReceiver : public OHService {
 public:
     OHReceiver(UpMpd *dev, const OHReceiverParams& parms);
+    ~OHReceiver();
 
     bool iStop();
     bool iPlay();
@@ -63,6 +74,8 @@ private:
     int transportState(const SoapIncoming& sc, SoapOutgoing& data);
 
     void maybeWakeUp(bool ok);
+    bool startStandby();
+    bool startCmd(bool *usedstandby);
 
     // Current
     std::string m_uri;
@@ -73,7 +86,13 @@ private:
     int m_httpport;
     std::string m_sc2mpdpath;
     std::string m_httpuri;
+    std::string m_protocolinfo;
     OHReceiverParams::PlayMethod m_pm;
+    bool m_standby;
+    // Idle sc2mpd process, waiting for a sender uri.
+    std::shared_ptr<ExecCmd> m_standbycmd;
+    // In-process receiver, or null
+    OhmReceiver *m_ohm;
 };
 
 #endif /* _OHRECEIVER_H_X_INCLUDED_ */
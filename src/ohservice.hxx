@@ -47,7 +47,8 @@ public:
         } else {
             changed = diffmaps(m_state, state);
         }
-        m_state = state;
+        // The values may be big (playlist id array): don't copy.
+        m_state.swap(state);
 
         for (auto& it : changed) {
             //LOGDEB("OHService: state change: " << it.first << " -> "
@@ -17,6 +17,9 @@
 
 #include "ohsndrcv.hxx"
 
+#include <chrono>
+#include <thread>
+
 #include "libupnpp/log.hxx"
 #include "libupnpp/base64.hxx"
 
@@ -49,15 +52,28 @@ public:
         // Stream volume control ? This decides if the aux mpd has mixer
         // "software" or "none"
         scalestream = true;
+        prestart = false;
         std::unique_lock<std::mutex>(g_configlock);
         string value;
         if (g_config->get("scstreamscaled", value)) {
             scalestream = atoi(value.c_str()) != 0;
         }
+        if (g_config->get("scsenderprestart", value)) {
+            prestart = atoi(value.c_str()) != 0;
+        }
     }
     ~Internal() {
+        waitPrestart();
         clear();
     }
+    bool startInternalSender();
+    // The prestart thread runs startInternalSender(), wait for it
+    // before using the internal sender.
+    void waitPrestart() {
+        if (prestarter.joinable()) {
+            prestarter.join();
+        }
+    }
     void clear() {
         if (dev && origmpd) {
             dev->m_mpdcli = origmpd;
@@ -80,12 +96,25 @@ public:
     string makeisendercmd;
     int mpdport;
     bool scalestream;
+    bool prestart;
+    std::thread prestarter;
 };
 
 
 SenderReceiver::SenderReceiver(UpMpd *dev, const string& starterpath, int port)
 {
     m = new Internal(dev, starterpath, port);
+    if (m->prestart) {
+        // Start the aux mpd and sender now, so that switching to the
+        // sender source is fast. This takes a few seconds, don't
+        // block the startup.
+        m->prestarter = std::thread(
+            [this] () {
+                if (!m->startInternalSender()) {
+                    LOGERR("SenderReceiver: prestart failed\n");
+                }
+            });
+    }
 }
 
 SenderReceiver::~SenderReceiver()
@@ -94,6 +123,63 @@ SenderReceiver::~SenderReceiver()
         delete m;
 }
 
+// Read the sender script output line:
+// [Ok mpdport URI base64-encoded-uri METADATA b64-meta]
+// mpdport is bogus, but present, for ext scripts
+static bool readSenderLine(ExecCmd *cmd, string& uri, string& meta)
+{
+    string output;
+    if (cmd->getline(output) <= 0) {
+        LOGERR("SenderReceiver::start: makesender command failed\n");
+        return false;
+    }
+    LOGDEB("SenderReceiver::start got [" << output << "] from script\n");
+
+    vector<string> toks;
+    stringToTokens(output, toks);
+    if (toks.size() != 6 || toks[0].compare("Ok")) {
+        LOGERR("SenderReceiver::start: bad output from script: " << output
+               << endl);
+        return false;
+    }
+    uri = base64_decode(toks[3]);
+    meta = base64_decode(toks[5]);
+    return true;
+}
+
+// Start the fifo MPD and Sender for internal sources, and connect to
+// the MPD. The MPD is left stopped. Called from start() or, with
+// prestart, from a separate thread when we are created.
+bool SenderReceiver::Internal::startInternalSender()
+{
+    auto start = std::chrono::steady_clock::now();
+    isender = new ExecCmd();
+    vector<string> args;
+    args.push_back("-p");
+    args.push_back(SoapHelp::i2s(mpdport));
+    args.push_back("-f");
+    args.push_back(dev->m_friendlyname);
+    if (!scalestream)
+        args.push_back("-e");
+    isender->startExec(makeisendercmd, args, false, true);
+    if (!readSenderLine(isender, iuri, imeta)) {
+        deleteZ(isender);
+        return false;
+    }
+    mpd = new MPDCli("localhost", mpdport);
+    if (!mpd || !mpd->ok()) {
+        LOGERR("SenderReceiver::start: can't connect to new MPD\n");
+        deleteZ(mpd);
+        deleteZ(isender);
+        return false;
+    }
+    mpd->stop();
+    LOGINF("SenderReceiver: aux mpd and sender started in " <<
+           std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - start).count() << " mS\n");
+    return true;
+}
+
 static bool copyMpd(MPDCli *src, MPDCli *dest, int seekms)
 {
     if (!src || !dest) {
@@ -118,29 +204,27 @@ bool SenderReceiver::start(const string& script, int seekms)
         return false;
     }
     
+    auto starttime = std::chrono::steady_clock::now();
+
     // Stop MPD Play (normally already done)
     m->dev->m_mpdcli->stop();
 
-    // sndcmd will non empty if we actually started a script instead
-    // of reusing an old one (then need to read the initial data).
-    ExecCmd *sndcmd = 0;
-
-    if (script.empty() && !m->isender) {
-        // Internal source, first time: Start fifo MPD and Sender
-        m->isender = sndcmd = new ExecCmd();
-        vector<string> args;
-        args.push_back("-p");
-        args.push_back(SoapHelp::i2s(m->mpdport));
-        args.push_back("-f");
-        args.push_back(m->dev->m_friendlyname);
-	if (!m->scalestream)
-            args.push_back("-e");
-        m->isender->startExec(m->makeisendercmd, args, false, true);
-    } else if (!script.empty()) {
+    string meta, uri;
+    if (script.empty()) {
+        // Internal source: start the fifo MPD and Sender the first
+        // time, then reuse them.
+        m->waitPrestart();
+        if (!m->isender && !m->startInternalSender()) {
+            m->clear();
+            return false;
+        }
+        uri = m->iuri;
+        meta = m->imeta;
+    } else {
         // External source. ssender should already be zero, we delete
         // it just in case
         deleteZ(m->ssender);
-        m->ssender = sndcmd = new ExecCmd();
+        m->ssender = new ExecCmd();
         vector<string> args;
         args.push_back("-f");
         args.push_back(m->dev->m_friendlyname);
@@ -148,47 +232,7 @@ bool SenderReceiver::start(const string& script, int seekms)
         if (!m->scalestream)
             args.push_back("-e");
         m->ssender->startExec(script, args, false, true);
-    }
-
-    string meta, uri;
-    if (sndcmd) {
-        // Just started internal or external sender script, need to read the
-        // details
-        string output;
-        if (sndcmd->getline(output) <= 0) {
-            LOGERR("SenderReceiver::start: makesender command failed\n");
-            m->clear();
-            return false;
-        }
-        LOGDEB("SenderReceiver::start got [" << output << "] from script\n");
-
-        // Output is like [Ok mpdport URI base64-encoded-uri METADATA b64-meta]
-        // mpdport is bogus, but present, for ext scripts
-        vector<string> toks;
-        stringToTokens(output, toks);
-        if (toks.size() != 6 || toks[0].compare("Ok")) {
-            LOGERR("SenderReceiver::start: bad output from script: " << output
-                   << endl);
-            m->clear();
-            return false;
-        }
-        uri = base64_decode(toks[3]);
-        meta = base64_decode(toks[5]);
-        if (script.empty()) {
-            m->iuri = uri;
-            m->imeta = meta;
-        }
-    } else {
-        // Reusing internal source
-        uri = m->iuri;
-        meta = m->imeta;
-    }
-    
-    if (sndcmd && script.empty()) {
-        // Just started the internal source script, connect to the new MPD
-        m->mpd = new MPDCli("localhost", m->mpdport);
-        if (!m->mpd || !m->mpd->ok()) {
-            LOGERR("SenderReceiver::start: can't connect to new MPD\n");
+        if (!readSenderLine(m->ssender, uri, meta)) {
             m->clear();
             return false;
         }
@@ -202,7 +246,8 @@ bool SenderReceiver::start(const string& script, int seekms)
     }
 
     if (script.empty()) {
-        // Internal source: copy mpd state
+        // Internal source: copy mpd state. If MPD closed our idle
+        // connection in the meantime, the first command reopens it.
         copyMpd(m->dev->m_mpdcli, m->mpd, seekms);
         if (m->scalestream) {
             m->mpd->forceInternalVControl();
@@ -217,6 +262,10 @@ bool SenderReceiver::start(const string& script, int seekms)
         m->origmpd = 0;
     }
 
+    LOGINF("SenderReceiver::start: done in " <<
+           std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - starttime).count() <<
+           " mS\n");
     return true;
 }
 
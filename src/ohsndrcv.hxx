@@ -34,6 +34,10 @@
  *  - Switch to receiver mode and play from the just created Sender.
  * At this point other Receivers may be connected.
  *
+ * The auxiliary MPD and the Sender are kept across start/stop. With
+ * the scsenderprestart option, they are started when we are created
+ * instead of on the first start.
+ *
  * The mode is entered by selecting the SenderReceiver source in
  * OHProduct::setSource. This is a slight abuse of the function, but
  * allows controlling this from any CP implementing setSource.
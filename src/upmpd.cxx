@@ -20,11 +20,12 @@
 #include "libupnpp/device/device.hxx"   // for UpnpDevice, UpnpService
 #include "libupnpp/log.hxx"             // for LOGFAT, LOGERR, Logger, etc
 #include "libupnpp/upnpplib.hxx"        // for LibUPnP
-#include "libupnpp/control/cdircontent.hxx"
+#include "libupnpp/upnpavutils.hxx"
 
 #include "smallut.h"
 #include "avtransport.hxx"
 #include "conman.hxx"
+#include "didlparse.hxx"
 #include "mpdcli.hxx"
 #include "ohinfo.hxx"
 #include "ohplaylist.hxx"
@@ -70,7 +71,7 @@ UpMpd::UpMpd(const string& deviceid, const string& friendlyname,
         m_services.push_back(m_ohif);
         m_services.push_back(new OHTime(this));
         m_services.push_back(new OHVolume(this));
-        m_ohpl = new OHPlaylist(this, opts.ohmetasleep);
+        m_ohpl = new OHPlaylist(this, opts.ohmetasleep, opts.ohtracksmax);
         m_services.push_back(m_ohpl);
         if (m_avt)
             m_avt->setOHP(m_ohpl);
@@ -95,6 +96,10 @@ UpMpd::UpMpd(const string& deviceid, const string& friendlyname,
                 }
             }
             parms.sc2mpdpath = opts.sc2mpdpath;
+            parms.standby = opts.scstandby;
+            parms.internal = opts.scinternal;
+            if (opts.scjitterms > 0)
+                parms.jitterms = opts.scjitterms;
             m_ohrcv = new OHReceiver(this, parms);
             m_services.push_back(m_ohrcv);
         }
@@ -127,34 +132,32 @@ const MpdStatus& UpMpd::getMpdStatus()
 bool UpMpd::checkContentFormat(const string& uri, const string& didl,
                                UpSong *ups)
 {
-    UPnPClient::UPnPDirContent dirc;
-    if (!dirc.parse(didl) || dirc.m_items.size() == 0) {
+    DidlItem item;
+    if (!item.parse(didl)) {
         LOGERR("checkContentFormat: didl parse failed\n");
         return false;
     }
-    UPnPClient::UPnPDirObject& dobj = *dirc.m_items.begin();
 
     if ((m_options & upmpdNoContentFormatCheck)) {
         LOGERR("checkContentFormat: format check disabled\n");
-        return dirObjToUpSong(dobj, ups);
+        return ups ? item.toUpSong(ups) : true;
     }
     
-    for (vector<UPnPClient::UPnPResource>::const_iterator it =
-             dobj.m_resources.begin(); it != dobj.m_resources.end(); it++) {
-        if (!it->m_uri.compare(uri)) {
-            ProtocolinfoEntry e;
-            if (!it->protoInfo(e)) {
+    for (const auto& res : item.resources) {
+        if (!res.uri.compare(uri)) {
+            vector<ProtocolinfoEntry> vpe;
+            if (!parseProtocolInfo(res.protocolinfo, vpe) || vpe.empty()) {
                 LOGERR("checkContentFormat: resource has no protocolinfo\n");
                 return false;
             }
-            string cf = e.contentFormat;
+            string cf = vpe[0].contentFormat;
             if (g_supportedFormats.find(cf) == g_supportedFormats.end()) {
                 LOGERR("checkContentFormat: unsupported:: " << cf << endl);
                 return false;
             } else {
                 LOGDEB("checkContentFormat: supported: " << cf << endl);
                 if (ups) {
-                    return dirObjToUpSong(dobj, ups);
+                    return item.toUpSong(ups);
                 } else {
                     return true;
                 }
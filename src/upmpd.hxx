@@ -74,15 +74,20 @@ public:
         upmpdNoContentFormatCheck = 64,
     };
     struct Options {
-        Options() : options(upmpdNone), ohmetasleep(0), schttpport(0),
+        Options() : options(upmpdNone), ohmetasleep(0), ohtracksmax(16384),
+            schttpport(0), scstandby(false), scinternal(false), scjitterms(0),
             sendermpdport(0) {}
         unsigned int options;
         std::string  cachefn;
         std::string  radioconf;
         unsigned int ohmetasleep;
+        int ohtracksmax;
         int schttpport;
         std::string scplaymethod;
         std::string sc2mpdpath;
+        bool scstandby;
+        bool scinternal;
+        int scjitterms;
         std::string senderpath;
         int sendermpdport;
     };
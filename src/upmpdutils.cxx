@@ -46,14 +46,13 @@
 #include "libupnpp/log.hxx"             // for LOGERR
 #include "libupnpp/soaphelp.hxx"        // for xmlQuote
 #include "libupnpp/upnpavutils.hxx"     // for upnpduration
-#include "libupnpp/control/cdircontent.hxx"
 
+#include "didlparse.hxx"
 #include "mpdcli.hxx"                   // for UpSong
 #include "smallut.h"
 
 using namespace std;
 using namespace UPnPP;
-using namespace UPnPClient;
 
 // Translate 0-100% MPD volume to UPnP VolumeDB: we do db upnp-encoded
 // values from -10240 (0%) to 0 (100%)
@@ -123,8 +122,8 @@ diffmaps(const unordered_map<string, string>& old,
 }
 
 
-#define UPNPXML(FLD, TAG)                                               \
-    if (!FLD.empty()) {                                                 \
+#define UPNPXML(FLD, TAG, PROP)                                         \
+    if ((props & PROP) && !FLD.empty()) {                               \
         ss << "<" #TAG ">" << SoapHelp::xmlQuote(FLD) << "</" #TAG ">"; \
     }
 #define UPNPXMLD(FLD, TAG, DEF)                                         \
@@ -134,7 +133,65 @@ diffmaps(const unordered_map<string, string>& old,
         ss << "<" #TAG ">" << SoapHelp::xmlQuote(DEF) << "</" #TAG ">"; \
     }
 
-string UpSong::didl()
+static const struct {
+    const char *name;
+    unsigned int props;
+} didlfilternames[] = {
+    {"@searchable", UpSong::DP_SEARCHABLE},
+    {"container@searchable", UpSong::DP_SEARCHABLE},
+    {"dc:creator", UpSong::DP_CREATOR},
+    {"upnp:artist", UpSong::DP_ARTIST},
+    {"upnp:genre", UpSong::DP_GENRE},
+    {"upnp:originalTrackNumber", UpSong::DP_TRACKNUM},
+    {"upnp:userAnnotation", UpSong::DP_ANNOT},
+    {"upnp:albumArtURI", UpSong::DP_ARTURI},
+    {"res", UpSong::DP_RES},
+    {"res@duration", UpSong::DP_RES | UpSong::DP_RESDURATION},
+    {"@duration", UpSong::DP_RES | UpSong::DP_RESDURATION},
+    {"res@sampleFrequency", UpSong::DP_RES | UpSong::DP_RESSAMPLEFREQ},
+    {"@sampleFrequency", UpSong::DP_RES | UpSong::DP_RESSAMPLEFREQ},
+    {"res@audioChannels", UpSong::DP_RES | UpSong::DP_RESCHANNELS},
+    {"@audioChannels", UpSong::DP_RES | UpSong::DP_RESCHANNELS},
+};
+
+unsigned int UpSong::didlFilter(const string& filter)
+{
+    // An empty filter should mean "required properties only", but
+    // quite a few control points send it and expect everything.
+    string sfilter(filter);
+    trimstring(sfilter);
+    if (sfilter.empty() || sfilter.find('*') != string::npos) {
+        return DP_ALL;
+    }
+    vector<string> names;
+    stringToTokens(sfilter, names, ",");
+    unsigned int props = 0;
+    for (auto& name : names) {
+        trimstring(name);
+        bool found = false;
+        for (const auto& fn : didlfilternames) {
+            if (!name.compare(fn.name)) {
+                props |= fn.props;
+                found = true;
+                break;
+            }
+        }
+        // Asking for any res attribute (e.g. res@protocolInfo,
+        // @size) implies res. The other bare attributes belong to
+        // the object, and are always output.
+        if (!found && (name.find("res@") == 0 ||
+                       (name.find('@') == 0 &&
+                        name.compare("@id") && name.compare("@parentID") &&
+                        name.compare("@restricted") &&
+                        name.compare("@childCount") &&
+                        name.compare("@refID")))) {
+            props |= DP_RES;
+        }
+    }
+    return props;
+}
+
+string UpSong::didl(unsigned int props)
 {
     ostringstream ss;
     string typetag;
@@ -144,36 +201,44 @@ string UpSong::didl()
 	typetag = "item";
     }
     ss << "<" << typetag << " id=\"" << id << "\" parentID=\"" <<
-	parentid << "\" restricted=\"1\" searchable=\"" <<
-	(searchable ? string("1") : string("0")) << "\">" <<
-	"<dc:title>" << SoapHelp::xmlQuote(title) << "</dc:title>";
+	parentid << "\" restricted=\"1\"";
+    if (props & DP_SEARCHABLE) {
+        ss << " searchable=\"" << (searchable ? string("1") : string("0")) <<
+            "\"";
+    }
+    ss << ">" << "<dc:title>" << SoapHelp::xmlQuote(title) << "</dc:title>";
 
     if (iscontainer) {
         UPNPXMLD(upnpClass, upnp:class, "object.container");
         // tracknum is reused for annotations for containers
-        ss << (tracknum.empty() ? string() :
-               string("<upnp:userAnnotation>" + SoapHelp::xmlQuote(tracknum) +
-		    "</upnp:userAnnotation>"));
-	    
+        UPNPXML(tracknum, upnp:userAnnotation, DP_ANNOT);
     } else {
         UPNPXMLD(upnpClass, upnp:class, "object.item.audioItem.musicTrack");
-	UPNPXML(genre, upnp:genre);
-	UPNPXML(tracknum, upnp:originalTrackNumber);
-
-        string sfs = SoapHelp::i2s((samplefreq == 0 ? 44100 : samplefreq));
-        string lmime((mime.empty() ? "audio/mpeg" : mime));
-            
-	ss << "<res " <<
-            "duration=\"" << upnpduration(duration_secs * 1000)  << "\" " <<
-	    "sampleFrequency=\"" << sfs << "\" " <<
-            "audioChannels=\"2\" " <<
-	    "protocolInfo=\"http-get:*:" << lmime << ":*\"" << ">" <<
-            SoapHelp::xmlQuote(uri) <<
-            "</res>";
+	UPNPXML(genre, upnp:genre, DP_GENRE);
+	UPNPXML(tracknum, upnp:originalTrackNumber, DP_TRACKNUM);
+
+        if (props & DP_RES) {
+            string lmime((mime.empty() ? "audio/mpeg" : mime));
+            ss << "<res ";
+            if (props & DP_RESDURATION) {
+                ss << "duration=\"" << upnpduration(duration_secs * 1000) <<
+                    "\" ";
+            }
+            if (props & DP_RESSAMPLEFREQ) {
+                ss << "sampleFrequency=\"" <<
+                    SoapHelp::i2s((samplefreq == 0 ? 44100 : samplefreq)) <<
+                    "\" ";
+            }
+            if (props & DP_RESCHANNELS) {
+                ss << "audioChannels=\"2\" ";
+            }
+            ss << "protocolInfo=\"http-get:*:" << lmime << ":*\"" << ">" <<
+                SoapHelp::xmlQuote(uri) << "</res>";
+        }
     }
-    UPNPXML(artist, dc:creator);
-    UPNPXML(artist, upnp:artist);
-    UPNPXML(artUri, upnp:albumArtURI);
+    UPNPXML(artist, dc:creator, DP_CREATOR);
+    UPNPXML(artist, upnp:artist, DP_ARTIST);
+    UPNPXML(artUri, upnp:albumArtURI, DP_ARTURI);
     ss << "</" << typetag << ">";
     return ss.str();
 }
@@ -283,33 +348,17 @@ string didlmake(const UpSong& song)
     return ss.str();
 }
 
-bool dirObjToUpSong(const UPnPDirObject& dobj, UpSong *ups)
-{
-    ups->artist = dobj.getprop("upnp:artist");
-    ups->album = dobj.getprop("upnp:album");
-    ups->title = dobj.m_title;
-    string stmp;
-    dobj.getrprop(0, "duration", stmp);
-    if (!stmp.empty()) {
-        ups->duration_secs = upnpdurationtos(stmp);
-    } else {
-        ups->duration_secs = 0;
-    }
-    ups->tracknum = dobj.getprop("upnp:originalTrackNumber");
-    return true;
-}
-
 bool uMetaToUpSong(const string& metadata, UpSong *ups)
 {
     if (ups == 0) {
         return false;
     }
 
-    UPnPDirContent dirc;
-    if (!dirc.parse(metadata) || dirc.m_items.size() == 0) {
+    DidlItem item;
+    if (!item.parse(metadata)) {
         return false;
     }
-    return dirObjToUpSong(*dirc.m_items.begin(), ups);
+    return item.toUpSong(ups);
 }
     
 // Substitute regular expression
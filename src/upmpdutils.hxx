@@ -22,10 +22,6 @@
 #include <vector>
 #include <unordered_set>
 
-namespace UPnPClient {
-    class UPnPDirObject;
-};
-
 // This was originally purely a translation of data from mpd. Extended
 // to general purpose track/container descriptor
 class UpSong {
@@ -63,8 +59,22 @@ public:
                            "] Album [" +  album + " Title [" + title +
                            "] Tno [" + tracknum + "] Uri [" + uri + "]");
     }
+    // Optional properties for didl(), from the Browse/Search Filter
+    // argument. The object id, parent id, restricted flag, title and
+    // class are always output.
+    enum DidlProps {
+        DP_SEARCHABLE = 0x1, DP_CREATOR = 0x2, DP_ARTIST = 0x4,
+        DP_GENRE = 0x8, DP_TRACKNUM = 0x10, DP_ANNOT = 0x20,
+        DP_ARTURI = 0x40, DP_RES = 0x80, DP_RESDURATION = 0x100,
+        DP_RESSAMPLEFREQ = 0x200, DP_RESCHANNELS = 0x400,
+        DP_ALL = 0xffffffff
+    };
+    // Compute the DidlProps mask for a Filter string ("*" or comma
+    // separated list of property names).
+    static unsigned int didlFilter(const std::string& filter);
+
     // Format to DIDL fragment 
-    std::string didl();
+    std::string didl(unsigned int props = DP_ALL);
 
     static UpSong container(const std::string& id, const std::string& pid,
 			    const std::string& title, bool sable = true,
@@ -111,8 +121,6 @@ extern std::string wrapDIDL(const std::string& data);
 
 // Convert UPnP metadata to UpSong for mpdcli to use
 extern bool uMetaToUpSong(const std::string&, UpSong *ups);
-// Convert UPnP content directory entry object to UpSong
-bool dirObjToUpSong(const UPnPClient::UPnPDirObject& dobj, UpSong *ups);
 
 // Replace the first occurrence of regexp. cxx11 regex does not work
 // that well yet...
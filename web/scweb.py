@@ -3,13 +3,78 @@ import sys
 import bottle
 import re
 import time
+import os
+import socket
 
 SPLITRE = '''\|\|'''
 
-def _listReceivers():
+# scctl option flags, as sent to the server
+OPT_L = 0x1
+OPT_l = 0x10
+OPT_m = 0x20
+OPT_r = 0x80
+OPT_x = 0x200
+
+class ScctlConn(object):
+    """Persistent connection to the scctl server (see the protocol
+    description in scctl.cpp), so that we don't connect for each
+    command."""
+    def __init__(self):
+        self.sock = None
+        self.rfile = None
+
+    def _connect(self):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect("/tmp/scctl%d/sock" % os.getuid())
+        self.sock.sendall(b"KEEP\n")
+        self.rfile = self.sock.makefile('rb')
+
+    def close(self):
+        if self.sock:
+            self.sock.close()
+        self.sock = None
+        self.rfile = None
+
+    def _run(self, flags, args):
+        if self.sock is None:
+            self._connect()
+        payload = "\n".join(["0x%x" % flags] + list(args)).encode('utf-8')
+        self.sock.sendall(str(len(payload)).encode() + b"\n" + payload)
+        while True:
+            hdr = self.rfile.readline().split()
+            if len(hdr) != 2:
+                raise IOError("scctl server: bad reply")
+            data = self.rfile.read(int(hdr[1]))
+            # Skip events (we don't ask for them)
+            if hdr[0] == b"R":
+                return data
+
+    def run(self, flags, args = []):
+        """Return the command output, or None if the server can't be
+        reached"""
+        for i in range(2):
+            try:
+                return self._run(flags, args)
+            except Exception:
+                # Maybe the server was restarted: try again once
+                self.close()
+        return None
+
+_scconn = ScctlConn()
+
+def _scctl(flags, cmdargs, args = []):
+    """Run an scctl command through the server, or the scctl program if
+    this fails"""
+    data = _scconn.run(flags, args)
+    if data is not None:
+        return data
     devnull = open('/dev/null', 'w')
+    return subprocess.check_output(['scctl'] + cmdargs + args,
+                                   stderr = devnull)
+
+def _listReceivers():
     try:
-        data = subprocess.check_output(['scctl', '-lm'], stderr = devnull)
+        data = _scctl(OPT_l|OPT_m, ['-lm'])
     except:
         data = "scctl error"
     o = []
@@ -56,18 +121,18 @@ def assocReceivers():
     assocs = bottle.request.forms.getall('Assoc')
     sender = bottle.request.forms.get('Sender')
     if sender != '' and len(assocs) != 0:
-        arglist = ['scctl', '-r', sender]
+        arglist = [sender]
         for uuid in assocs:
             arglist.append(uuid)
         print >> sys.stderr, arglist
 
         try:
-            subprocess.check_call(arglist, stderr = devnull)
+            _scctl(OPT_r, ['-r'], arglist)
         except:
             pass
 
     try:
-        data = subprocess.check_output(['scctl', '-Lm'], stderr = devnull)
+        data = _scctl(OPT_L|OPT_m, ['-Lm'])
     except:
         data = "scctl error"
 
@@ -87,12 +152,12 @@ def stopReceivers():
     devnull = open('/dev/null', 'w')
     for uuid in bottle.request.forms.getall('Stop'):
         try:
-            subprocess.check_call(['scctl', '-x', uuid], stderr=devnull)
+            _scctl(OPT_x, ['-x'], [uuid])
         except:
             pass
 
     try:
-        data = subprocess.check_output(['scctl', '-lm'], stderr = devnull)
+        data = _scctl(OPT_l|OPT_m, ['-lm'])
     except:
         data = "scctl error"
 